@@ -0,0 +1,296 @@
+#include "grisu.h"
+
+/* Shortest round-trip formatting of doubles, after Florian Loitsch's Grisu2
+ * ("Printing Floating-Point Numbers Quickly and Accurately with Integers").
+ * The output always reads back as the very same double, and is the shortest
+ * such output in all but a tiny fraction of the cases. No libc formatting and
+ * no allocations are involved, everything's done in the caller's buffer.
+ */
+
+// A "do it yourself" floating point number: f * 2^e
+typedef struct {
+    uint64_t f;
+    int e;
+} diyfp_t;
+
+#define DP_SIGNIFICAND_MASK 0x000FFFFFFFFFFFFFULL
+#define DP_EXPONENT_MASK 0x7FF0000000000000ULL
+#define DP_HIDDEN_BIT 0x0010000000000000ULL
+#define DP_SIGNIFICAND_SIZE 52
+#define DP_EXPONENT_BIAS (0x3FF + DP_SIGNIFICAND_SIZE)
+#define DP_MIN_EXPONENT (-DP_EXPONENT_BIAS)
+
+// Normalized 64 bit significands and binary exponents of 10^-348, 10^-340, ..., 10^340
+static const uint64_t cachedPowersF[] = {
+    0xfa8fd5a0081c0288ULL, 0xbaaee17fa23ebf76ULL, 0x8b16fb203055ac76ULL,
+    0xcf42894a5dce35eaULL, 0x9a6bb0aa55653b2dULL, 0xe61acf033d1a45dfULL,
+    0xab70fe17c79ac6caULL, 0xff77b1fcbebcdc4fULL, 0xbe5691ef416bd60cULL,
+    0x8dd01fad907ffc3cULL, 0xd3515c2831559a83ULL, 0x9d71ac8fada6c9b5ULL,
+    0xea9c227723ee8bcbULL, 0xaecc49914078536dULL, 0x823c12795db6ce57ULL,
+    0xc21094364dfb5637ULL, 0x9096ea6f3848984fULL, 0xd77485cb25823ac7ULL,
+    0xa086cfcd97bf97f4ULL, 0xef340a98172aace5ULL, 0xb23867fb2a35b28eULL,
+    0x84c8d4dfd2c63f3bULL, 0xc5dd44271ad3cdbaULL, 0x936b9fcebb25c996ULL,
+    0xdbac6c247d62a584ULL, 0xa3ab66580d5fdaf6ULL, 0xf3e2f893dec3f126ULL,
+    0xb5b5ada8aaff80b8ULL, 0x87625f056c7c4a8bULL, 0xc9bcff6034c13053ULL,
+    0x964e858c91ba2655ULL, 0xdff9772470297ebdULL, 0xa6dfbd9fb8e5b88fULL,
+    0xf8a95fcf88747d94ULL, 0xb94470938fa89bcfULL, 0x8a08f0f8bf0f156bULL,
+    0xcdb02555653131b6ULL, 0x993fe2c6d07b7facULL, 0xe45c10c42a2b3b06ULL,
+    0xaa242499697392d3ULL, 0xfd87b5f28300ca0eULL, 0xbce5086492111aebULL,
+    0x8cbccc096f5088ccULL, 0xd1b71758e219652cULL, 0x9c40000000000000ULL,
+    0xe8d4a51000000000ULL, 0xad78ebc5ac620000ULL, 0x813f3978f8940984ULL,
+    0xc097ce7bc90715b3ULL, 0x8f7e32ce7bea5c70ULL, 0xd5d238a4abe98068ULL,
+    0x9f4f2726179a2245ULL, 0xed63a231d4c4fb27ULL, 0xb0de65388cc8ada8ULL,
+    0x83c7088e1aab65dbULL, 0xc45d1df942711d9aULL, 0x924d692ca61be758ULL,
+    0xda01ee641a708deaULL, 0xa26da3999aef774aULL, 0xf209787bb47d6b85ULL,
+    0xb454e4a179dd1877ULL, 0x865b86925b9bc5c2ULL, 0xc83553c5c8965d3dULL,
+    0x952ab45cfa97a0b3ULL, 0xde469fbd99a05fe3ULL, 0xa59bc234db398c25ULL,
+    0xf6c69a72a3989f5cULL, 0xb7dcbf5354e9beceULL, 0x88fcf317f22241e2ULL,
+    0xcc20ce9bd35c78a5ULL, 0x98165af37b2153dfULL, 0xe2a0b5dc971f303aULL,
+    0xa8d9d1535ce3b396ULL, 0xfb9b7cd9a4a7443cULL, 0xbb764c4ca7a44410ULL,
+    0x8bab8eefb6409c1aULL, 0xd01fef10a657842cULL, 0x9b10a4e5e9913129ULL,
+    0xe7109bfba19c0c9dULL, 0xac2820d9623bf429ULL, 0x80444b5e7aa7cf85ULL,
+    0xbf21e44003acdd2dULL, 0x8e679c2f5e44ff8fULL, 0xd433179d9c8cb841ULL,
+    0x9e19db92b4e31ba9ULL, 0xeb96bf6ebadf77d9ULL, 0xaf87023b9bf0ee6bULL,
+};
+
+static const int16_t cachedPowersE[] = {
+    -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980, -954,
+    -927, -901, -874, -847, -821, -794, -768, -741, -715, -688, -661,
+    -635, -608, -582, -555, -529, -502, -475, -449, -422, -396, -369,
+    -343, -316, -289, -263, -236, -210, -183, -157, -130, -103, -77,
+    -50, -24, 3, 30, 56, 83, 109, 136, 162, 189, 216,
+    242, 269, 295, 322, 348, 375, 402, 428, 455, 481, 508,
+    534, 561, 588, 614, 641, 667, 694, 720, 747, 774, 800,
+    827, 853, 880, 907, 933, 960, 986, 1013, 1039, 1066,
+};
+
+static const uint32_t pow10s[] = {
+    1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000
+};
+
+static diyfp_t diyfpFromDouble(double d) {
+    uint64_t u;
+    memcpy(&u, &d, sizeof(u));
+    int biased = (int)((u & DP_EXPONENT_MASK) >> DP_SIGNIFICAND_SIZE);
+    diyfp_t r;
+    r.f = u & DP_SIGNIFICAND_MASK;
+    if (biased) {
+        r.f += DP_HIDDEN_BIT;
+        r.e = biased - DP_EXPONENT_BIAS;
+    } else {
+        r.e = DP_MIN_EXPONENT + 1;
+    }
+    return r;
+}
+
+static diyfp_t diyfpSub(diyfp_t a, diyfp_t b) {
+    diyfp_t r = { a.f - b.f, a.e };
+    return r;
+}
+
+static diyfp_t diyfpMul(diyfp_t a, diyfp_t b) {
+    unsigned __int128 p = (unsigned __int128)a.f * b.f;
+    uint64_t h = (uint64_t)(p >> 64), l = (uint64_t)p;
+    if (l & (1ULL << 63)) {     // Round
+        h++;
+    }
+    diyfp_t r = { h, a.e + b.e + 64 };
+    return r;
+}
+
+static diyfp_t diyfpNormalize(diyfp_t a) {
+    int s = __builtin_clzll(a.f);
+    diyfp_t r = { a.f << s, a.e - s };
+    return r;
+}
+
+// Gets the normalized boundaries m- and m+ of the interval that rounds to 'v'
+static void normalizedBoundaries(diyfp_t v, diyfp_t *minus, diyfp_t *plus) {
+    diyfp_t pl = { (v.f << 1) + 1, v.e - 1 };
+    pl = diyfpNormalize(pl);
+    diyfp_t mi;
+    if (DP_HIDDEN_BIT == v.f) {
+        mi.f = (v.f << 2) - 1;
+        mi.e = v.e - 2;
+    } else {
+        mi.f = (v.f << 1) - 1;
+        mi.e = v.e - 1;
+    }
+    mi.f <<= mi.e - pl.e;
+    mi.e = pl.e;
+    *minus = mi;
+    *plus = pl;
+}
+
+// Gets a cached power of ten, c = 10^-K, that brings 'e' into Grisu's target range
+static diyfp_t cachedPower(int e, int *K) {
+    double dk = (-61 - e) * 0.30102999566398114 + 347;
+    int k = (int)dk;
+    if (dk - k > 0.0) {
+        k++;
+    }
+    unsigned index = (unsigned)((k >> 3) + 1);
+    *K = -(-348 + (int)(index << 3));
+    diyfp_t r = { cachedPowersF[index], cachedPowersE[index] };
+    return r;
+}
+
+static int countDecimalDigits(uint32_t n) {
+    int d = 1;
+    while (d < 10 && n >= pow10s[d]) {
+        d++;
+    }
+    return d;
+}
+
+static void grisuRound(char *buf, int len, uint64_t delta, uint64_t rest, uint64_t tenkappa, uint64_t wpw) {
+    while (rest < wpw && delta - rest >= tenkappa &&
+           (rest + tenkappa < wpw || wpw - rest > rest + tenkappa - wpw)) {
+        buf[len - 1]--;
+        rest += tenkappa;
+    }
+}
+
+// Generates the shortest digits in [Wm, Wp], and adjusts the decimal exponent 'K' to them
+static int digitGen(diyfp_t W, diyfp_t Mp, uint64_t delta, char *buf, int *K) {
+    diyfp_t one = { 1ULL << -Mp.e, Mp.e };
+    diyfp_t wpw = diyfpSub(Mp, W);
+    uint32_t p1 = (uint32_t)(Mp.f >> -one.e);
+    uint64_t p2 = Mp.f & (one.f - 1);
+    int kappa = countDecimalDigits(p1);
+    int len = 0;
+
+    while (kappa > 0) {
+        uint32_t d = p1 / pow10s[kappa - 1];
+        p1 %= pow10s[kappa - 1];
+        if (d || len) {
+            buf[len++] = (char)('0' + d);
+        }
+        kappa--;
+        uint64_t rest = ((uint64_t)p1 << -one.e) + p2;
+        if (rest <= delta) {
+            *K += kappa;
+            grisuRound(buf, len, delta, rest, (uint64_t)pow10s[kappa] << -one.e, wpw.f);
+            return len;
+        }
+    }
+
+    while (1) {
+        p2 *= 10;
+        delta *= 10;
+        char d = (char)(p2 >> -one.e);
+        if (d || len) {
+            buf[len++] = (char)('0' + d);
+        }
+        p2 &= one.f - 1;
+        kappa--;
+        if (p2 < delta) {
+            *K += kappa;
+            grisuRound(buf, len, delta, p2, one.f, -kappa < 10 ? wpw.f * pow10s[-kappa] : 0);
+            return len;
+        }
+    }
+}
+
+static int writeExponent(int K, char *buf) {
+    int len = 0;
+    if (K < 0) {
+        buf[len++] = '-';
+        K = -K;
+    }
+    if (K >= 100) {
+        buf[len++] = (char)('0' + K / 100);
+        K %= 100;
+        buf[len++] = (char)('0' + K / 10);
+    } else if (K >= 10) {
+        buf[len++] = (char)('0' + K / 10);
+    }
+    buf[len++] = (char)('0' + K % 10);
+    return len;
+}
+
+// Lays out 'len' digits times 10^K in decimal or scientific notation
+static int prettify(char *buf, int len, int K) {
+    int kk = len + K;   // 10^(kk-1) <= v < 10^kk
+
+    if (K >= 0 && kk <= 21) {
+        // 1234e7 -> 12340000000
+        for (int i = len; i < kk; i++) {
+            buf[i] = '0';
+        }
+        return kk;
+    } else if (kk > 0 && kk <= 21) {
+        // 1234e-2 -> 12.34
+        memmove(&buf[kk + 1], &buf[kk], (size_t)(len - kk));
+        buf[kk] = '.';
+        return len + 1;
+    } else if (kk > -6 && kk <= 0) {
+        // 1234e-6 -> 0.001234
+        int offset = 2 - kk;
+        memmove(&buf[offset], &buf[0], (size_t)len);
+        buf[0] = '0';
+        buf[1] = '.';
+        for (int i = 2; i < offset; i++) {
+            buf[i] = '0';
+        }
+        return len + offset;
+    } else if (1 == len) {
+        // 1e30
+        buf[1] = 'e';
+        return 2 + writeExponent(kk - 1, &buf[2]);
+    } else {
+        // 1234e30 -> 1.234e33
+        memmove(&buf[2], &buf[1], (size_t)(len - 1));
+        buf[1] = '.';
+        buf[len + 1] = 'e';
+        return len + 2 + writeExponent(kk - 1, &buf[len + 2]);
+    }
+}
+
+// Formats an integral value, the common case with scores, without Grisu
+static int formatInteger(uint64_t u, char *buf) {
+    char tmp[24];
+    int len = 0;
+    do {
+        tmp[len++] = (char)('0' + u % 10);
+        u /= 10;
+    } while (u);
+    for (int i = 0; i < len; i++) {
+        buf[i] = tmp[len - 1 - i];
+    }
+    return len;
+}
+
+/* Formats 'v' as the shortest string that reads back as 'v' into 'buf', which
+ * must have room for GRISU_BUF_LEN bytes. The output is not null-terminated.
+ * Returns: the length of the output */
+size_t grisuFormat(double v, char *buf) {
+    size_t len = 0;
+    if (signbit(v)) {
+        buf[len++] = '-';
+        v = -v;
+    }
+
+    if (isinf(v)) {
+        memcpy(&buf[len], "inf", 3);
+        return len + 3;
+    }
+
+    // Integers that doubles represent exactly are just digits
+    if (v < 9007199254740992.0 && v == (double)(uint64_t)v) {
+        return len + formatInteger((uint64_t)v, &buf[len]);
+    }
+
+    diyfp_t dv = diyfpFromDouble(v);
+    diyfp_t wm, wp;
+    normalizedBoundaries(dv, &wm, &wp);
+    int K;
+    diyfp_t c = cachedPower(wp.e, &K);
+    diyfp_t W = diyfpMul(diyfpNormalize(dv), c);
+    wp = diyfpMul(wp, c);
+    wm = diyfpMul(wm, c);
+    wm.f++;
+    wp.f--;
+    int dlen = digitGen(W, wp, wp.f - wm.f, &buf[len], &K);
+    return len + prettify(&buf[len], dlen, K);
+}
@@ -0,0 +1,8 @@
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+// Enough room for the longest formatted double, e.g. "-2.2250738585072014e-308"
+#define GRISU_BUF_LEN 32
+
+size_t grisuFormat(double v, char *buf);
@@ -0,0 +1,94 @@
+#include "heap.h"
+
+// A minimal binary heap implementation (because a list is not always enough)
+heap_t *heapNew(heapCmpFunc cmp, size_t size) {
+    heap_t *h = RedisModule_Alloc(sizeof(heap_t));
+    h->size = size ? size : 1;
+    h->items = RedisModule_Alloc(sizeof(void *) * h->size);
+    h->len = 0;
+    h->cmp = cmp;
+    h->setidx = NULL;
+    return h;
+}
+
+void heapSetIdxFunc(heap_t *h, heapIdxFunc setidx) {
+    h->setidx = setidx;
+}
+
+static void heapSet(heap_t *h, size_t i, void *data) {
+    h->items[i] = data;
+    if (h->setidx) {
+        h->setidx(data, i);
+    }
+}
+
+static void heapSwap(heap_t *h, size_t i, size_t j) {
+    void *t = h->items[i];
+    heapSet(h, i, h->items[j]);
+    heapSet(h, j, t);
+}
+
+static void heapSiftUp(heap_t *h, size_t i) {
+    while (i) {
+        size_t parent = (i - 1) / 2;
+        if (h->cmp(h->items[i], h->items[parent]) >= 0) {
+            break;
+        }
+        heapSwap(h, i, parent);
+        i = parent;
+    }
+}
+
+static void heapSiftDown(heap_t *h, size_t i) {
+    while (1) {
+        size_t top = i, l = 2 * i + 1, r = 2 * i + 2;
+        if (l < h->len && h->cmp(h->items[l], h->items[top]) < 0) {
+            top = l;
+        }
+        if (r < h->len && h->cmp(h->items[r], h->items[top]) < 0) {
+            top = r;
+        }
+        if (top == i) {
+            break;
+        }
+        heapSwap(h, i, top);
+        i = top;
+    }
+}
+
+void heapPush(heap_t *h, void *data) {
+    if (h->len == h->size) {
+        h->size *= 2;
+        h->items = RedisModule_Realloc(h->items, sizeof(void *) * h->size);
+    }
+    heapSet(h, h->len, data);
+    heapSiftUp(h, h->len);
+    h->len++;
+}
+
+void *heapPop(heap_t *h) {
+    return h->len ? heapRemove(h, 0) : NULL;
+}
+
+// Removes the item at a position, as told by the heap's index function
+void *heapRemove(heap_t *h, size_t idx) {
+    void *data = h->items[idx];
+    h->len--;
+    if (idx < h->len) {
+        heapSet(h, idx, h->items[h->len]);
+        heapSiftDown(h, idx);
+        heapSiftUp(h, idx);
+    }
+    return data;
+}
+
+void *heapPeek(heap_t *h) {
+    return h->len ? h->items[0] : NULL;
+}
+
+void heapFree(heap_t *h) {
+    if (h) {
+        RedisModule_Free(h->items);
+        RedisModule_Free(h);
+    }
+}
@@ -0,0 +1,23 @@
+#include <stdint.h>
+#include <string.h>
+#include "redismodule.h"
+
+// Returns a negative value if 'a' should be closer to the heap's top than 'b'
+typedef int (*heapCmpFunc)(const void *a, const void *b);
+// Tells an item its position in the heap, so it can later be removed from it
+typedef void (*heapIdxFunc)(void *data, size_t idx);
+
+typedef struct heap {
+    void **items;
+    size_t len, size;
+    heapCmpFunc cmp;
+    heapIdxFunc setidx;
+} heap_t;
+
+heap_t *heapNew(heapCmpFunc cmp, size_t size);
+void heapSetIdxFunc(heap_t *h, heapIdxFunc setidx);
+void heapPush(heap_t *h, void *data);
+void *heapPop(heap_t *h);
+void *heapPeek(heap_t *h);
+void *heapRemove(heap_t *h, size_t idx);
+void heapFree(heap_t *h);
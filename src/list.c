@@ -1,67 +1,49 @@
 #include "list.h"
 
-// A minimal linked list implementation (you gotta have one in every project!)
-node_t *nodeNew(void *data) {
-    node_t *n = RedisModule_Alloc(sizeof(node_t));
-    n->data = data;
-    n->next = NULL;
-    return n;
-}
-
-void nodeFree(node_t *n) {
-    if (n) {
-        RedisModule_Free(n);
-    }
+// A minimal intrusive doubly linked list implementation (you gotta have one in every project!)
+// Items embed their node_t, so (un)linking them is O(1) and never allocates
+void listInit(list_t *l) {
+    l->head = NULL;
+    l->tail = NULL;
+    l->len = 0;
 }
 
 list_t *listNew() {
     list_t *l = RedisModule_Alloc(sizeof(list_t));
-    l->head = NULL;
-    l->tail = NULL;
-    l->len = 0;
+    listInit(l);
     return l;
 }
 
-int listRemove(list_t *l, void *data) {
-    node_t *prev = NULL, *curr = l->head;
-    while (curr) {
-        if (curr->data == data) {
-            if (prev) {
-                prev->next = curr->next;
-            } else {
-                l->head = curr->next;
-            }
-            if (!curr->next) {
-                l->tail = prev;
-            }
-            l->len--;
-            return 1;
-        }
-        prev = curr;
-        curr = curr->next;
+// Unlinks a node, which must be in the list
+void listRemove(list_t *l, node_t *n) {
+    if (n->prev) {
+        n->prev->next = n->next;
+    } else {
+        l->head = n->next;
     }
-    return 0;
+    if (n->next) {
+        n->next->prev = n->prev;
+    } else {
+        l->tail = n->prev;
+    }
+    n->prev = NULL;
+    n->next = NULL;
+    l->len--;
 }
 
-void *listHeadPop(list_t *l) {
-    void *data = NULL;
-    if (l->len) {
-        node_t *n = l->head;
-        l->head = l->head->next;
-        if (!l->head) {
-            l->tail = NULL;
-        }
-        data = n->data;
-        nodeFree(n);
-        l->len--;
+node_t *listHeadPop(list_t *l) {
+    node_t *n = l->head;
+    if (n) {
+        listRemove(l, n);
     }
-    return data;
+    return n;
 }
 
-void listHeadPush(list_t *l, void *data) {
-    node_t *n = nodeNew(data);
+void listHeadPush(list_t *l, node_t *n) {
+    n->prev = NULL;
+    n->next = l->head;
     if (l->head) {
-        n->next = l->head;
+        l->head->prev = n;
     } else {    // empty list
         l->tail = n;
     }
@@ -69,8 +51,9 @@ void listHeadPush(list_t *l, void *data) {
     l->len++;
 }
 
-void listTailPush(list_t *l, void *data) {
-    node_t *n = nodeNew(data);
+void listTailPush(list_t *l, node_t *n) {
+    n->next = NULL;
+    n->prev = l->tail;
     if (l->tail) {
         l->tail->next = n;
     } else { //empty list
@@ -80,11 +63,9 @@ void listTailPush(list_t *l, void *data) {
     l->len++;
 }
 
+// Frees the list, but not its items - they're owned by whoever linked them
 void listFree(list_t *l) {
     if (l) {
-        while (l->len > 0) {
-            listHeadPop(l);
-        }
         RedisModule_Free(l);
     }
-}
\ No newline at end of file
+}
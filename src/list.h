@@ -1,10 +1,14 @@
+#ifndef LIST_H
+#define LIST_H
+
 #include <stdint.h>
+#include <stddef.h>
 #include <string.h>
 #include "redismodule.h"
 
+// The links that an item embeds in order to be in a list
 typedef struct node {
-    void *data;
-    struct node *next;
+    struct node *prev, *next;
 } node_t;
 
 typedef struct list {
@@ -12,11 +16,15 @@ typedef struct list {
     size_t len;
 } list_t;
 
-node_t *nodeNew(void *data);
-void nodeFree(node_t *n);
+// Gets the item of 'type' that embeds the node 'n' as its 'member'
+#define listItem(n, type, member) ((type *)((char *)(n) - offsetof(type, member)))
+
+void listInit(list_t *l);
 list_t *listNew();
-int listRemove(list_t *l, void *data);
-void *listHeadPop(list_t *l);
-void listHeadPush(list_t *l, void *data);
-void listTailPush(list_t *l, void *data);
-void listFree(list_t *l);
\ No newline at end of file
+void listRemove(list_t *l, node_t *n);
+node_t *listHeadPop(list_t *l);
+void listHeadPush(list_t *l, node_t *n);
+void listTailPush(list_t *l, node_t *n);
+void listFree(list_t *l);
+
+#endif
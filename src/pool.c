@@ -0,0 +1,85 @@
+#include "pool.h"
+
+// A minimal size class pool implementation (because the allocator is not always enough)
+// Small allocations that are made and freed at a high rate are kept on per class free
+// lists, and larger ones are passed through. Freeing requires the allocation's size.
+
+// Gets the size class of an allocation, or -1 if it is too large to be pooled
+static int poolClass(size_t size) {
+    int c = 0;
+    while (c < POOL_CLASSES && ((size_t)1 << (POOL_MIN_SHIFT + c)) < size) {
+        c++;
+    }
+    return (c < POOL_CLASSES) ? c : -1;
+}
+
+void poolInit(pool_t *p) {
+    for (int c = 0; c < POOL_CLASSES; c++) {
+        p->free[c] = NULL;
+        p->nfree[c] = 0;
+        p->inuse[c] = 0;
+    }
+    p->hits = 0;
+    p->misses = 0;
+    p->trimmed = 0;
+}
+
+void *poolAlloc(pool_t *p, size_t size) {
+    int c = poolClass(size);
+    if (-1 == c) {
+        return RedisModule_Alloc(size);
+    }
+
+    void *ptr = p->free[c];
+    if (ptr) {
+        p->free[c] = *(void **)ptr;
+        p->nfree[c]--;
+        p->hits++;
+    } else {
+        ptr = RedisModule_Alloc((size_t)1 << (POOL_MIN_SHIFT + c));
+        p->misses++;
+    }
+    p->inuse[c]++;
+    return ptr;
+}
+
+void poolFree(pool_t *p, void *ptr, size_t size) {
+    int c = poolClass(size);
+    if (-1 == c) {
+        RedisModule_Free(ptr);
+        return;
+    }
+
+    *(void **)ptr = p->free[c];
+    p->free[c] = ptr;
+    p->nfree[c]++;
+    p->inuse[c]--;
+}
+
+// Gives back the freed allocations of every class beyond the 'keep' most recent ones
+void poolTrim(pool_t *p, size_t keep) {
+    for (int c = 0; c < POOL_CLASSES; c++) {
+        void **link = &p->free[c];
+        for (size_t i = 0; i < keep && *link; i++) {
+            link = (void **)*link;
+        }
+        void *ptr = *link;
+        *link = NULL;
+        while (ptr) {
+            void *next = *(void **)ptr;
+            RedisModule_Free(ptr);
+            p->nfree[c]--;
+            p->trimmed++;
+            ptr = next;
+        }
+    }
+}
+
+// Gets the number of bytes kept for reuse
+size_t poolCachedBytes(pool_t *p) {
+    size_t bytes = 0;
+    for (int c = 0; c < POOL_CLASSES; c++) {
+        bytes += p->nfree[c] << (POOL_MIN_SHIFT + c);
+    }
+    return bytes;
+}
@@ -0,0 +1,23 @@
+#include <stdint.h>
+#include <string.h>
+#include "redismodule.h"
+
+// The pool's size classes are powers of two, from 2^POOL_MIN_SHIFT to 2^POOL_MAX_SHIFT bytes
+#define POOL_MIN_SHIFT 4
+#define POOL_MAX_SHIFT 9
+#define POOL_CLASSES (POOL_MAX_SHIFT - POOL_MIN_SHIFT + 1)
+
+typedef struct pool {
+    void *free[POOL_CLASSES];       // Freed allocations kept for reuse, linked through themselves
+    size_t nfree[POOL_CLASSES];     // The number of freed allocations kept per class
+    size_t inuse[POOL_CLASSES];     // The number of allocations in use per class
+    long long hits;                 // Allocations served by reuse
+    long long misses;               // Allocations that had to be made
+    long long trimmed;              // Freed allocations given back by trimming
+} pool_t;
+
+void poolInit(pool_t *p);
+void *poolAlloc(pool_t *p, size_t size);
+void poolFree(pool_t *p, void *ptr, size_t size);
+void poolTrim(pool_t *p, size_t keep);
+size_t poolCachedBytes(pool_t *p);
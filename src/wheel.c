@@ -0,0 +1,122 @@
+#include "wheel.h"
+
+// A minimal hierarchical timing wheel implementation (because timers are not always enough)
+// Adding and removing a timer is O(1), and so is advancing by a tick, except for the ticks
+// that complete a rotation of a level: these cascade the timers in the next slot of the
+// level above down to the levels they now belong in.
+
+#define WHEEL_L0_MASK (WHEEL_L0_SLOTS - 1)
+#define WHEEL_LN_MASK (WHEEL_LN_SLOTS - 1)
+
+// Gets the shift of a level above the first one, i.e. the log2 of its slots' span
+static int wheelShift(int level) {
+    return WHEEL_L0_BITS + WHEEL_LN_BITS * level;
+}
+
+// Puts a timer in the slot of the level that its distance from the wheel's tick falls in
+// Timers that are due are put in the current tick's slot, and ones that are too far ahead
+// in the farthest slot, so they're put back when it cascades
+static void wheelPlace(wheel_t *w, wtimer_t *t) {
+    long long delta = t->expires - w->now;
+    if (delta < WHEEL_L0_SLOTS) {
+        t->slot = &w->l0[(delta < 0 ? w->now : t->expires) & WHEEL_L0_MASK];
+    } else {
+        int level = 0;
+        while (level < WHEEL_LEVELS - 2 && delta >= (1LL << wheelShift(level + 1))) {
+            level++;
+        }
+        long long expires = t->expires;
+        if (delta >= (1LL << wheelShift(level + 1))) {
+            expires = w->now + (1LL << wheelShift(level + 1)) - 1;
+        }
+        t->slot = &w->ln[level][(expires >> wheelShift(level)) & WHEEL_LN_MASK];
+    }
+    listTailPush(t->slot, &t->node);
+}
+
+// Cascades the next slot of each level whose level below completed a rotation
+static void wheelCascade(wheel_t *w) {
+    for (int level = 0; level < WHEEL_LEVELS - 1; level++) {
+        long long idx = (w->now >> wheelShift(level)) & WHEEL_LN_MASK;
+        list_t *slot = &w->ln[level][idx];
+        node_t *n;
+        while ((n = listHeadPop(slot))) {
+            wheelPlace(w, listItem(n, wtimer_t, node));
+        }
+        if (idx) {
+            break;
+        }
+    }
+}
+
+void wheelInit(wheel_t *w, long long now) {
+    for (int i = 0; i < WHEEL_L0_SLOTS; i++) {
+        listInit(&w->l0[i]);
+    }
+    for (int level = 0; level < WHEEL_LEVELS - 1; level++) {
+        for (int i = 0; i < WHEEL_LN_SLOTS; i++) {
+            listInit(&w->ln[level][i]);
+        }
+    }
+    w->now = now;
+    w->len = 0;
+}
+
+void wheelAdd(wheel_t *w, wtimer_t *t) {
+    wheelPlace(w, t);
+    w->len++;
+}
+
+void wheelRemove(wheel_t *w, wtimer_t *t) {
+    if (t->slot) {
+        listRemove(t->slot, &t->node);
+        t->slot = NULL;
+        w->len--;
+    }
+}
+
+// Advances the wheel up to the tick 'now', stopping at the first expired timer
+// Returns: the expired timer, which is no longer in the wheel, or NULL once none is left
+wtimer_t *wheelExpire(wheel_t *w, long long now) {
+    // An empty wheel can just skip ahead
+    if (!w->len) {
+        if (now > w->now) {
+            w->now = now;
+        }
+        return NULL;
+    }
+
+    for (;;) {
+        node_t *n = listHeadPop(&w->l0[w->now & WHEEL_L0_MASK]);
+        if (n) {
+            wtimer_t *t = listItem(n, wtimer_t, node);
+            t->slot = NULL;
+            w->len--;
+            return t;
+        }
+        if (w->now >= now) {
+            return NULL;
+        }
+        w->now++;
+        if (!(w->now & WHEEL_L0_MASK)) {
+            wheelCascade(w);
+        }
+    }
+}
+
+// Gets the next tick that the wheel has to be advanced to, which is the first one with
+// timers in its slot, or the one that completes the first level's rotation, if earlier
+// Returns: the tick, or -1 if the wheel is empty
+long long wheelNextTick(wheel_t *w) {
+    if (!w->len) {
+        return -1;
+    }
+    long long tick = w->now;
+    do {
+        if (w->l0[tick & WHEEL_L0_MASK].len) {
+            return tick;
+        }
+        tick++;
+    } while (tick & WHEEL_L0_MASK);
+    return tick;
+}
@@ -0,0 +1,33 @@
+#include <stdint.h>
+#include <string.h>
+#include "redismodule.h"
+#include "list.h"
+
+// The wheel's ticks are milliseconds: its first level has 2^WHEEL_L0_BITS slots of a tick,
+// and each of the levels above it has 2^WHEEL_LN_BITS slots that each span an entire
+// rotation of the level below, so it reaches 2^32 ticks (about 49 days) ahead
+#define WHEEL_LEVELS 5
+#define WHEEL_L0_BITS 8
+#define WHEEL_LN_BITS 6
+#define WHEEL_L0_SLOTS (1 << WHEEL_L0_BITS)
+#define WHEEL_LN_SLOTS (1 << WHEEL_LN_BITS)
+
+// The links and expiry time that an item embeds in order to be in a wheel
+typedef struct wtimer {
+    node_t node;                    // The links in its slot
+    list_t *slot;                   // The slot it is in, or NULL if it isn't in the wheel
+    long long expires;              // The tick it expires at
+} wtimer_t;
+
+typedef struct wheel {
+    list_t l0[WHEEL_L0_SLOTS];                      // The first level's slots
+    list_t ln[WHEEL_LEVELS - 1][WHEEL_LN_SLOTS];    // The slots of the levels above it
+    long long now;                  // The tick that the wheel is at
+    size_t len;                     // The number of timers in the wheel
+} wheel_t;
+
+void wheelInit(wheel_t *w, long long now);
+void wheelAdd(wheel_t *w, wtimer_t *t);
+void wheelRemove(wheel_t *w, wtimer_t *t);
+wtimer_t *wheelExpire(wheel_t *w, long long now);
+long long wheelNextTick(wheel_t *w);
@@ -10,6 +10,70 @@
 #define ZPOP_LIST_HEAD 0
 #define ZPOP_LIST_TAIL 1
 
+// The orders in which the clients that block on a key are served
+#define ZPOP_WAIT_FIFO 0
+#define ZPOP_WAIT_LIFO 1
+#define ZPOP_WAIT_PRIORITY 2
+
+// The most elements a popped batch preallocates room for, it grows beyond that
+#define ZPOP_RES_PREALLOC 1024
+// The number of elements a popped batch has inline room for, so small batches don't allocate
+#define ZPOP_RES_INLINE 8
+
+// Random pops: picked ranks that are at most this far apart are fetched by the same
+// ZRANGE, and weighted pops make up to this many draws per pick before they give up on
+// rejection sampling and walk the zset instead
+#define ZPOP_RANDOM_GAP 32
+#define ZPOP_RANDOM_TRIALS 16
+
+// Leases: a key's companion set of leased elements is named '{<key>}:zpop:leases', and
+// its companion hash of the leased elements' original scores '{<key>}:zpop:scores', names
+// reserved to the module, and the reaper has a period (in milliseconds) and a maximal
+// number of expired leases it returns per tick
+#define ZPOP_LEASES_PREFIX "{"
+#define ZPOP_LEASES_SUFFIX "}:zpop:leases"
+#define ZPOP_SCORES_SUFFIX "}:zpop:scores"
+#define ZPOP_LEASES_KEYERR "ERR key must be non-empty and without a '}' to have leases"
+#define ZPOP_REAPER_PERIOD 100
+#define ZPOP_REAPER_BATCH 1000
+
+// The longest (in milliseconds) a key's due timer is armed for, when its head is due
+// later than that the timer just re-arms itself
+#define ZPOP_DUE_MAX_DELAY 86400000
+
+// The pool of blocking pop contexts and their key names: the period (in milliseconds)
+// it is trimmed at, and the number of freed allocations per size class it keeps
+#define ZPOP_POOL_TRIM_PERIOD 1000
+#define ZPOP_POOL_KEEP 1024
+
+// The length of a client id's key in the blocked clients rax
+#define ZPOP_CLIENTID_LEN 8
+
+// The size of the stack buffers that db-prefixed key names are made in, when they fit
+#define ZPOP_KEYNAME_BUF 128
+
+// The watched keys prefilter is a counting Bloom filter of the keys in gz.RK, with two
+// distinct counters per key out of 2^ZPOP_FILTER_BITS, which saturate and then stay so
+#define ZPOP_FILTER_BITS 15
+#define ZPOP_FILTER_MASK ((1 << ZPOP_FILTER_BITS) - 1)
+
+// The effects keyspace events may have on their key
+#define ZPOP_EVENT_FILLS 0      // May make the key a non-empty zset (so are unknown events)
+#define ZPOP_EVENT_ZADD 1       // Added to the key's zset
+#define ZPOP_EVENT_DRAINS 2     // Can't make the key a non-empty zset
+
+// Blocked pops' timeouts: left to the server (which checks them in its cron, so they fire
+// late by up to its period) or kept by the module in a timing wheel, by milliseconds
+#define ZPOP_TIMEOUTS_SERVER 0
+#define ZPOP_TIMEOUTS_MODULE 1
+
+// The number of keys Z.BPOPPREFIX asks SCAN for per call, when looking for keys under a prefix,
+// and the calls it makes per command or tick: a scan that doesn't finish within them goes on
+// in the ticks that follow, while the prefix's clients block, from a cursor of up to 20 digits
+#define ZPOP_PREFIX_SCAN_COUNT "100"
+#define ZPOP_PREFIX_SCAN_CALLS 10
+#define ZPOP_PREFIX_CURSOR_LEN 21
+
 // Statistics
 // CBD: average blocking time, unique keys blocked, top blocked keys, ...
 #define ZPOP_STAT_EVENTSHANDLED 0
@@ -18,15 +82,44 @@
 #define ZPOP_STAT_DISCONNECTIONS 3
 #define ZPOP_STAT_TIMEOUTS_COUNT 4
 #define ZPOP_STAT_TOTALKEYSBLOCK 5
-#define ZPOP_STAT_meta_last 6
+#define ZPOP_STAT_LEASESGRANTED 6
+#define ZPOP_STAT_LEASESACKED 7
+#define ZPOP_STAT_LEASESEXPIRED 8
+#define ZPOP_STAT_DUETIMERSFIRED 9
+#define ZPOP_STAT_READYKEYSSERVED 10
+#define ZPOP_STAT_WHEELTIMEOUTS 11
+#define ZPOP_STAT_WHEELSKEWTOTAL 12
+#define ZPOP_STAT_WHEELSKEWMAX 13
+#define ZPOP_STAT_POPREPLIES 14
+#define ZPOP_STAT_POPALLOCS 15
+#define ZPOP_STAT_EVENTSFILTERED 16
+#define ZPOP_STAT_meta_last 17
 // Add any new stats before the last
 
 // The module's global context
 // TODO: Once RedisModule_OnUnload is ready, use it on this
 typedef struct {
-    rax *RK;            // Keys->list of blocked clients
-    rax *RBC;           // Blocked clients->keys
+    rax *RK;            // Keys (prefixed by their db)->interned key with its blocked clients
+    rax *RBC;           // Blocked clients (by big endian id)->keys
+    rax *RL;            // Keys (prefixed by their db) that have leased elements
+    rax *RDT;           // Keys (prefixed by their db)->due timer
+    rax *RP;            // Key prefixes (prefixed by their db)->interned prefix with its blocked clients
+    size_t *prefixlens; // The distinct lengths of the prefixes in gz.RP, in ascending order...
+    long long *prefixlenrefs;   // ...the number of prefixes of each...
+    size_t nprefixlens;         // ...and the number of lengths
+    unsigned char *reapfrom;    // The key the lease reaper resumes from, if it ran out of budget
+    size_t reapfromlen;         // The length of that key
+    unsigned long long bpseq;   // The number of blocking pop contexts made, orders equal priorities
+    uint8_t *filter;    // The watched keys prefilter's counters
+    list_t ready;       // Interned keys that were written to, and are served once per event loop tick
+    int readyarmed;     // Is the timer that serves the ready keys armed
     long long *stats;   // Statistics
+    pool_t pool;        // Blocking pop contexts and key names
+    int dblscores;      // Reply with scores as doubles rather than as formatted strings
+    int timeouts;       // Who times blocked pops out, ZPOP_TIMEOUTS_SERVER or ZPOP_TIMEOUTS_MODULE
+    wheel_t wheel;      // The blocked pops' deadlines, when the module times them out
+    RedisModuleTimerID wheeltimer;  // The timer that advances the wheel
+    long long wheeltick;            // The tick the wheel's timer is armed for, or -1 if it isn't
 } gz_t;
 static gz_t gz;
 
@@ -37,35 +130,631 @@ static gz_t gz;
 * Credit: rax.c @antirez */
 static void *popTypeError;
 
-// BPOP's blocking client context
+// Makes a key's name that is prefixed by its db (big endian, so keys sort by db), for
+// the raxes that track keys across dbs. It is made in 'buf' if it fits its 'bufsize',
+// otherwise it is allocated and the caller should free it.
+unsigned char *dbKeyName(int db, const char *key, size_t keylen, unsigned char *buf, size_t bufsize, size_t *len) {
+    *len = sizeof(uint32_t) + keylen;
+    unsigned char *rkey = (*len <= bufsize) ? buf : RedisModule_Alloc(*len);
+    rkey[0] = (unsigned char)(db >> 24);
+    rkey[1] = (unsigned char)(db >> 16);
+    rkey[2] = (unsigned char)(db >> 8);
+    rkey[3] = (unsigned char)db;
+    memcpy(rkey + sizeof(uint32_t), key, keylen);
+    return rkey;
+}
+
+// Hashes a key in a db for the watched keys prefilter, a word at a time
+uint64_t watchHash(int db, const char *key, size_t keylen) {
+    uint64_t h = ((uint64_t)(uint32_t)db << 32 | keylen) * 0x9e3779b97f4a7c15ULL;
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= keylen; i += sizeof(uint64_t)) {
+        uint64_t w;
+        memcpy(&w, key + i, sizeof(w));
+        h = (h ^ w) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 32;
+    }
+    uint64_t w = 0;
+    for (; i < keylen; i++) {
+        w = (w << 8) | (unsigned char)key[i];
+    }
+    h = (h ^ w) * 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// Gets a hashed key's two counters in the watched keys prefilter, which are never the same
+// one, so that a key is counted in and out of each exactly once
+void watchFilterCounters(uint64_t h, uint8_t **c) {
+    size_t i0 = h & ZPOP_FILTER_MASK, i1 = (h >> 32) & ZPOP_FILTER_MASK;
+    c[0] = &gz.filter[i0];
+    c[1] = &gz.filter[(i1 == i0) ? i1 ^ 1 : i1];
+}
+
+// Counts a key in, or out of (with a negative 'delta'), the watched keys prefilter
+// A counter that saturates stays that way, as it can't tell how many keys it counts
+void watchFilterUpdate(uint64_t h, int delta) {
+    uint8_t *c[2];
+    watchFilterCounters(h, c);
+    for (int i = 0; i < 2; i++) {
+        if (UINT8_MAX != *c[i]) {
+            *c[i] = (uint8_t)(*c[i] + delta);
+        }
+    }
+}
+
+// Is a key possibly watched, i.e. in gz.RK - a false means it surely isn't
+int watchFilterMayHave(uint64_t h) {
+    uint8_t *c[2];
+    watchFilterCounters(h, c);
+    return *c[0] && *c[1];
+}
+
+// Gets the db of a db-prefixed key's name
+int dbKeyNameDb(const unsigned char *rkey) {
+    return (int)(((uint32_t)rkey[0] << 24) | ((uint32_t)rkey[1] << 16) |
+                 ((uint32_t)rkey[2] << 8) | (uint32_t)rkey[3]);
+}
+
+// A key that clients block on. It is interned, i.e. shared by all the clients that
+// block on it, and is owned by its entry in gz.RK for as long as it has any
+// Prefixes of keys that clients block on (Z.BPOPPREFIX) are interned the same, in gz.RP
 typedef struct {
-    unsigned char *key;             // The key's name
-    size_t keylen;                  // The key's name length
+    list_t waiters;                 // The blocking client contexts, in the order they're served
+    heap_t *prio;                   // The ones that gave a PRIORITY, served before them (or NULL)
+    long long refcount;             // The references: the rax entry's, each waiter's and any in use
+    int registered;                 // Is the key in gz.RK (or the prefix in gz.RP)
+    int ready;                      // Is the key in gz.ready
+    node_t readynode;               // The links in gz.ready
+    int prefix;                     // Is this a prefix of keys rather than a key
+    heap_t *bands;                  // The ones that wait for a band of scores, by the band's lower end (or NULL)
+    rax *pending;                   // The written db-prefixed keys under the prefix, yet to be served (or NULL)
+    char scancursor[ZPOP_PREFIX_CURSOR_LEN];    // The cursor of the prefix's unfinished scan (or empty)
+    int scanarmed;                  // Is the timer that goes on with the scan armed
+    size_t namelen;                 // The key's db-prefixed name length
+    unsigned char name[];           // The key's db-prefixed name, see dbKeyName
+} ZKey_t;
+
+// BPOP's blocking client context
+typedef struct BPCtx {
+    ZKey_t *zk;                     // The key
     int lend;                       // The end to POP from
-    unsigned char *id;              // The blocked client id
-    size_t idlen;                   // The blocked client id length
+    unsigned long long id;          // The blocked client id
     RedisModuleBlockedClient *bc;   // The blocked client context
+    unsigned char *dst;             // The key to store popped elements in (Z.BPOPSTORE only)
+    size_t dstlen;                  // The store key's name length
+    int keepscore;                  // Are popped elements stored with their score, or with 'newscore'
+    double newscore;                // The score to store popped elements with
+    int due;                        // Only pop elements whose score, as a Unix time in ms, is due (Z.BPOPDUE only)
+    int policy;                     // The order the client is served in among the key's clients
+    long long priority;             // The client's priority (ZPOP_WAIT_PRIORITY only)
+    unsigned long long seq;         // The order the client blocked in
+    size_t heapidx;                 // The position in the key's heap (ZPOP_WAIT_PRIORITY only), or bands
+    int banded;                     // Is the client waiting for a score in a band (Z.BPOPBYSCORE only)
+    double bandmin, bandmax;        // The band's ends
+    int bandminex, bandmaxex;       // Are the band's ends exclusive
+    double submax;                  // The highest upper end of the bands in its subtree of the key's bands
+    int submaxex;                   // Is that end exclusive (only if all those that high are)
+    long long count;                // The most elements to pop for the client
+    long long minbatch;             // The fewest elements the key should have to pop for the client...
+    long long lingeruntil;          // ...until this Unix time in milliseconds
+    node_t keynode;                 // The links in the key's list of blocking clients
+    node_t clientnode;              // The links in the client's list of keys
+    wtimer_t deadline;              // The client's deadline in gz.wheel (its first key's context only)
 } BPCtx_t;
 
+// Orders prioritized clients by their priority, highest first, then by the order they blocked in
+int bpctxPriorityCmp(const void *a, const void *b) {
+    const BPCtx_t *ba = (const BPCtx_t *)a, *bb = (const BPCtx_t *)b;
+    if (ba->priority != bb->priority) {
+        return ba->priority > bb->priority ? -1 : 1;
+    }
+    return (ba->seq < bb->seq) ? -1 : (ba->seq > bb->seq);
+}
+
+void bpctxSetHeapIdx(void *data, size_t idx) {
+    ((BPCtx_t *)data)->heapidx = idx;
+}
+
+// Orders banded clients by their band's lower end, inclusive first, then by the order they blocked in
+int bpctxBandCmp(const void *va, const void *vb) {
+    const BPCtx_t *a = (const BPCtx_t *)va, *b = (const BPCtx_t *)vb;
+    if (a->bandmin != b->bandmin) {
+        return a->bandmin < b->bandmin ? -1 : 1;
+    }
+    if (a->bandminex != b->bandminex) {
+        return a->bandminex - b->bandminex;
+    }
+    return (a->seq < b->seq) ? -1 : (a->seq > b->seq);
+}
+
+// Makes an interned record, with a reference for the rax entry it is registered in
+ZKey_t *zkeyNew(const unsigned char *key, size_t keylen, int prefix) {
+    ZKey_t *zk = poolAlloc(&gz.pool, sizeof(ZKey_t) + keylen);
+    listInit(&zk->waiters);
+    zk->prio = NULL;
+    zk->refcount = 1;
+    zk->registered = 1;
+    zk->ready = 0;
+    zk->prefix = prefix;
+    zk->pending = NULL;
+    zk->scancursor[0] = '\0';
+    zk->scanarmed = 0;
+    zk->bands = NULL;
+    zk->namelen = keylen;
+    memcpy(zk->name, key, keylen);
+    return zk;
+}
+
+// Counts a prefix's length in, or out of (with a negative 'delta'), the prefixes' lengths
+void prefixLenUpdate(size_t len, int delta) {
+    size_t i = 0;
+    while (i < gz.nprefixlens && gz.prefixlens[i] < len) {
+        i++;
+    }
+    if (i < gz.nprefixlens && gz.prefixlens[i] == len) {
+        gz.prefixlenrefs[i] += delta;
+        if (!gz.prefixlenrefs[i]) {
+            gz.nprefixlens--;
+            memmove(&gz.prefixlens[i], &gz.prefixlens[i + 1], sizeof(size_t) * (gz.nprefixlens - i));
+            memmove(&gz.prefixlenrefs[i], &gz.prefixlenrefs[i + 1], sizeof(long long) * (gz.nprefixlens - i));
+        }
+        return;
+    }
+    gz.prefixlens = RedisModule_Realloc(gz.prefixlens, sizeof(size_t) * (gz.nprefixlens + 1));
+    gz.prefixlenrefs = RedisModule_Realloc(gz.prefixlenrefs, sizeof(long long) * (gz.nprefixlens + 1));
+    memmove(&gz.prefixlens[i + 1], &gz.prefixlens[i], sizeof(size_t) * (gz.nprefixlens - i));
+    memmove(&gz.prefixlenrefs[i + 1], &gz.prefixlenrefs[i], sizeof(long long) * (gz.nprefixlens - i));
+    gz.prefixlens[i] = len;
+    gz.prefixlenrefs[i] = delta;
+    gz.nprefixlens++;
+}
+
+// Gets a prefix's interned record by its db-prefixed name, registering a new one if needed
+ZKey_t *zkeyGetPrefix(const unsigned char *prefix, size_t prefixlen) {
+    ZKey_t *zk = (ZKey_t *)raxFind(gz.RP, (unsigned char *)prefix, prefixlen);
+    if (raxNotFound == zk) {
+        zk = zkeyNew(prefix, prefixlen, 1);
+        raxInsert(gz.RP, zk->name, zk->namelen, (void *)zk, NULL);
+        prefixLenUpdate(prefixlen, 1);
+    }
+    return zk;
+}
+
+// Gets a key's interned record by its db-prefixed name, registering a new one if needed
+ZKey_t *zkeyGet(const unsigned char *key, size_t keylen) {
+    ZKey_t *zk = (ZKey_t *)raxFind(gz.RK, (unsigned char *)key, keylen);
+    if (raxNotFound == zk) {
+        zk = zkeyNew(key, keylen, 0);
+        raxInsert(gz.RK, zk->name, zk->namelen, (void *)zk, NULL);
+        watchFilterUpdate(watchHash(dbKeyNameDb(key), (const char *)key + sizeof(uint32_t),
+                                    keylen - sizeof(uint32_t)), 1);
+    }
+    return zk;
+}
+
+// Gets the number of clients that block on a key
+size_t zkeyWaiters(ZKey_t *zk) {
+    return zk->waiters.len + (zk->prio ? zk->prio->len : 0) + (zk->bands ? zk->bands->len : 0);
+}
+
+// Recomputes the highest upper ends of the bands' subtrees on the path from a position
+// in the bands' heap to its root, which are the only ones a heap operation may change
+void bandsFixPath(heap_t *bands, size_t i) {
+    while (i < bands->len) {
+        BPCtx_t *bpctx = (BPCtx_t *)bands->items[i];
+        bpctx->submax = bpctx->bandmax;
+        bpctx->submaxex = bpctx->bandmaxex;
+        for (size_t c = 2 * i + 1; c <= 2 * i + 2 && c < bands->len; c++) {
+            BPCtx_t *child = (BPCtx_t *)bands->items[c];
+            if (child->submax > bpctx->submax) {
+                bpctx->submax = child->submax;
+                bpctx->submaxex = child->submaxex;
+            } else if (child->submax == bpctx->submax) {
+                bpctx->submaxex &= child->submaxex;
+            }
+        }
+        if (!i) {
+            break;
+        }
+        i = (i - 1) / 2;
+    }
+}
+
+// Adds a client to a key's clients according to its policy: FIFO and LIFO clients are
+// kept in a deque, and prioritized ones in a heap that's made once the first one blocks
+// Banded clients are kept apart, in a heap by their bands' lower ends where every client
+// also knows the highest upper end in its subtree, so bands can be searched by interval
+void zkeyAddWaiter(ZKey_t *zk, BPCtx_t *bpctx) {
+    if (bpctx->banded) {
+        if (!zk->bands) {
+            zk->bands = heapNew(bpctxBandCmp, 4);
+            heapSetIdxFunc(zk->bands, bpctxSetHeapIdx);
+        }
+        heapPush(zk->bands, bpctx);
+        bandsFixPath(zk->bands, zk->bands->len - 1);
+    } else if (ZPOP_WAIT_PRIORITY == bpctx->policy) {
+        if (!zk->prio) {
+            zk->prio = heapNew(bpctxPriorityCmp, 4);
+            heapSetIdxFunc(zk->prio, bpctxSetHeapIdx);
+        }
+        heapPush(zk->prio, bpctx);
+    } else if (ZPOP_WAIT_LIFO == bpctx->policy) {
+        listHeadPush(&zk->waiters, &bpctx->keynode);
+    } else {
+        listTailPush(&zk->waiters, &bpctx->keynode);
+    }
+}
+
+void zkeyRemoveWaiter(ZKey_t *zk, BPCtx_t *bpctx) {
+    if (bpctx->banded) {
+        // The heap's last client fills the hole and sifts down or up from it, so the paths
+        // from where it lands, from the hole and from where it was cover the changes
+        size_t idx = bpctx->heapidx;
+        BPCtx_t *last = (BPCtx_t *)zk->bands->items[zk->bands->len - 1];
+        heapRemove(zk->bands, idx);
+        if (last != bpctx) {
+            bandsFixPath(zk->bands, last->heapidx);
+            bandsFixPath(zk->bands, idx);
+        }
+        if (zk->bands->len) {
+            bandsFixPath(zk->bands, (zk->bands->len - 1) / 2);
+        }
+    } else if (ZPOP_WAIT_PRIORITY == bpctx->policy) {
+        heapRemove(zk->prio, bpctx->heapidx);
+    } else {
+        listRemove(&zk->waiters, &bpctx->keynode);
+    }
+}
+
+// Is a client passed over for now: with 'skipdue', one that waits for due elements, and
+// one that lingers (at time 'now') for a fuller batch than the key's 'card' elements
+int zkeyWaiterPassed(BPCtx_t *bpctx, int skipdue, long long now, long long card) {
+    return (skipdue && bpctx->due) || (bpctx->lingeruntil > now && bpctx->minbatch > card);
+}
+
+// Gets the client to serve next: the highest prioritized one, or else the deque's head,
+// of those that aren't passed over (see zkeyWaiterPassed)
+BPCtx_t *zkeyNextWaiter(ZKey_t *zk, int skipdue, long long now, long long card) {
+    if (zk->prio && zk->prio->len) {
+        BPCtx_t *top = (BPCtx_t *)heapPeek(zk->prio);
+        if (!zkeyWaiterPassed(top, skipdue, now, card)) {
+            return top;
+        }
+
+        // The heap is only ordered at its top, so look through all of it
+        BPCtx_t *best = NULL;
+        for (size_t i = 0; i < zk->prio->len; i++) {
+            BPCtx_t *bpctx = (BPCtx_t *)zk->prio->items[i];
+            if (!zkeyWaiterPassed(bpctx, skipdue, now, card) && (!best || bpctxPriorityCmp(bpctx, best) < 0)) {
+                best = bpctx;
+            }
+        }
+        if (best) {
+            return best;
+        }
+    }
+    for (node_t *n = zk->waiters.head; n; n = n->next) {
+        BPCtx_t *bpctx = listItem(n, BPCtx_t, keynode);
+        if (!zkeyWaiterPassed(bpctx, skipdue, now, card)) {
+            return bpctx;
+        }
+    }
+    return NULL;
+}
+
+void zkeyRetain(ZKey_t *zk) {
+    zk->refcount++;
+}
+
+void zkeyRelease(ZKey_t *zk) {
+    if (!--zk->refcount) {
+        heapFree(zk->prio);
+        if (zk->pending) {
+            raxFree(zk->pending);
+        }
+        heapFree(zk->bands);
+        poolFree(&gz.pool, zk, sizeof(ZKey_t) + zk->namelen);
+    }
+}
+
+// Removes a key that has no more blocking clients from gz.RK (or a prefix from gz.RP)
+void zkeyUnregisterIfIdle(ZKey_t *zk) {
+    if (zk->registered && !zkeyWaiters(zk)) {
+        if (zk->prefix) {
+            raxRemove(gz.RP, zk->name, zk->namelen, NULL);
+            prefixLenUpdate(zk->namelen, -1);
+        } else {
+            raxRemove(gz.RK, zk->name, zk->namelen, NULL);
+            watchFilterUpdate(watchHash(dbKeyNameDb(zk->name), (const char *)zk->name + sizeof(uint32_t),
+                                        zk->namelen - sizeof(uint32_t)), -1);
+        }
+        zk->registered = 0;
+        zkeyRelease(zk);
+    }
+}
+
+
 void freeBPCtx(BPCtx_t *bctx) {
-        RedisModule_Free(bctx->key);
-        RedisModule_Free(bctx->id);
-        RedisModule_Free(bctx);
+        zkeyRelease(bctx->zk);
+        if (bctx->dst) {
+            poolFree(&gz.pool, bctx->dst, bctx->dstlen);
+        }
+        poolFree(&gz.pool, bctx, sizeof(BPCtx_t));
 }
 
-// Converts an unsigned long long to a C buffer
-unsigned char *ull2str(unsigned long long ull, size_t *len) {
-    char buff[128];
-    sprintf(buff, "%llu", ull);
+// The range of elements a pop operation pops from
+typedef struct {
+    int lend;                       // The end of the range to POP from
+    double min;                     // The range's minimal score
+    double max;                     // The range's maximal score
+    int minex;                      // Is the minimal score exclusive
+    int maxex;                      // Is the maximal score exclusive
+    RedisModuleString *lexmin;      // The range's minimal element, for lex ranges only
+    RedisModuleString *lexmax;      // The range's maximal element, for lex ranges only
+} ZPopRange_t;
+
+// Initializes a range that spans the entire zset
+void zpopRangeInit(ZPopRange_t *range, int lend) {
+    range->lend = lend;
+    range->min = REDISMODULE_NEGATIVE_INFINITE;
+    range->max = REDISMODULE_POSITIVE_INFINITE;
+    range->minex = 0;
+    range->maxex = 0;
+    range->lexmin = NULL;
+    range->lexmax = NULL;
+}
 
-    (*len) = strlen(buff);
-    unsigned char *s = RedisModule_Alloc(sizeof(unsigned char) * (*len));
-    memcpy(s, buff, (*len));
-    return s;
+// A batch of popped elements, in the order they were popped
+// It is meant to live on the stack, and is only moved to the heap by zpopResDetach
+typedef struct {
+    const char *key;                // The popped key (only set when replying with the key)
+    size_t keylen;                  // The popped key's length
+    long long len;                  // The number of popped elements
+    long long size;                 // The number of elements there's room for
+    double *scores;                 // The popped elements' scores
+    RedisModuleString **eles;       // The popped elements
+    double iscores[ZPOP_RES_INLINE];            // Inline room for scores
+    RedisModuleString *ieles[ZPOP_RES_INLINE];  // Inline room for elements
+} ZPopRes_t;
+
+void zpopResInit(ZPopRes_t *res) {
+    res->key = NULL;
+    res->keylen = 0;
+    res->len = 0;
+    res->size = ZPOP_RES_INLINE;
+    res->scores = res->iscores;
+    res->eles = res->ieles;
+}
+
+// Makes room in a popped batch for at least 'size' elements
+void zpopResReserve(ZPopRes_t *res, long long size) {
+    if (size <= res->size) {
+        return;
+    }
+    gz.stats[ZPOP_STAT_POPALLOCS] += 2;
+    if (res->scores == res->iscores) {
+        res->scores = RedisModule_Alloc(sizeof(double) * size);
+        res->eles = RedisModule_Alloc(sizeof(RedisModuleString *) * size);
+        memcpy(res->scores, res->iscores, sizeof(double) * res->len);
+        memcpy(res->eles, res->ieles, sizeof(RedisModuleString *) * res->len);
+    } else {
+        res->scores = RedisModule_Realloc(res->scores, sizeof(double) * size);
+        res->eles = RedisModule_Realloc(res->eles, sizeof(RedisModuleString *) * size);
+    }
+    res->size = size;
+}
+
+// Appends an element to a popped batch, making room for it as needed
+void zpopResPush(ZPopRes_t *res, RedisModuleString *ele, double score) {
+    if (res->len == res->size) {
+        zpopResReserve(res, res->size * 2);
+    }
+    res->scores[res->len] = score;
+    res->eles[res->len] = ele;
+    res->len++;
+}
+
+// Frees the popped elements, leaving an empty batch
+void zpopResReset(RedisModuleCtx *ctx, ZPopRes_t *res) {
+    for (long long i = 0; i < res->len; i++) {
+        RedisModule_FreeString(ctx, res->eles[i]);
+    }
+    if (res->scores != res->iscores) {
+        RedisModule_Free(res->scores);
+        RedisModule_Free(res->eles);
+    }
+    zpopResInit(res);
+}
+
+// Moves a popped batch, along with a copy of its key (if any), to a single heap
+// allocation that can outlive the call. The original batch is left empty.
+ZPopRes_t *zpopResDetach(ZPopRes_t *res, const char *key, size_t keylen) {
+    ZPopRes_t *hres = RedisModule_Alloc(sizeof(ZPopRes_t) + keylen);
+    gz.stats[ZPOP_STAT_POPALLOCS]++;
+    memcpy(hres, res, sizeof(ZPopRes_t));
+    if (res->scores == res->iscores) {
+        hres->scores = hres->iscores;
+        hres->eles = hres->ieles;
+    }
+    if (key) {
+        memcpy(hres + 1, key, keylen);
+        hres->key = (const char *)(hres + 1);
+        hres->keylen = keylen;
+    }
+    zpopResInit(res);
+    return hres;
+}
+
+// Adds a reply of a popped element's score, formatted as the shortest string
+// that reads back as the same double (or as a double if so configured)
+void replyWithScore(RedisModuleCtx *ctx, double score) {
+    if (gz.dblscores) {
+        RedisModule_ReplyWithDouble(ctx, score);
+        return;
+    }
+    char buff[GRISU_BUF_LEN];
+    size_t len = grisuFormat(score, buff);
+    RedisModule_ReplyWithStringBuffer(ctx, buff, len);
+}
+
+// Adds a reply of a popped batch: the key (if set), followed by score and element pairs
+void replyWithPopRes(RedisModuleCtx *ctx, ZPopRes_t *res) {
+    gz.stats[ZPOP_STAT_POPREPLIES]++;
+    RedisModule_ReplyWithArray(ctx, res->len * 2 + (res->key ? 1 : 0));
+    if (res->key) {
+        RedisModule_ReplyWithStringBuffer(ctx, res->key, res->keylen);
+    }
+    for (long long i = 0; i < res->len; i++) {
+        replyWithScore(ctx, res->scores[i]);
+        RedisModule_ReplyWithString(ctx, res->eles[i]);
+    }
+}
+
+// A key's head in Z.MPOP's k-way merge
+typedef struct {
+    int keyidx;                     // The index of the key that this is the head of
+    double score;                   // The head's score
+    RedisModuleString *ele;         // The head's element
+} MPopHead_t;
+
+// Orders heads like a single zset would order them: by score, then by element
+int mpopHeadCmp(const MPopHead_t *a, const MPopHead_t *b) {
+    if (a->score != b->score) {
+        return a->score < b->score ? -1 : 1;
+    }
+    size_t alen, blen;
+    const char *aele = RedisModule_StringPtrLen(a->ele, &alen);
+    const char *bele = RedisModule_StringPtrLen(b->ele, &blen);
+    int cmp = memcmp(aele, bele, alen < blen ? alen : blen);
+    if (cmp) {
+        return cmp;
+    }
+    if (alen != blen) {
+        return alen < blen ? -1 : 1;
+    }
+    return a->keyidx - b->keyidx;
+}
+
+int mpopHeadCmpMin(const void *a, const void *b) {
+    return mpopHeadCmp((const MPopHead_t *)a, (const MPopHead_t *)b);
+}
+
+int mpopHeadCmpMax(const void *a, const void *b) {
+    return mpopHeadCmp((const MPopHead_t *)b, (const MPopHead_t *)a);
+}
+
+// Parses an optional trailing "<name> <n>" pair of arguments, e.g. "COUNT 10"
+// Returns: REDISMODULE_OK, or REDISMODULE_ERR after replying with an error
+int parseCountArg(RedisModuleCtx *ctx, RedisModuleString **argv, int argc, const char *name, long long *count) {
+    const char *opt = RedisModule_StringPtrLen(argv[0], NULL);
+    if (2 != argc || strcasecmp(name, opt)) {
+        RedisModule_ReplyWithError(ctx, "ERR syntax error");
+        return REDISMODULE_ERR;
+    }
+    if (REDISMODULE_OK != RedisModule_StringToLongLong(argv[1], count) || *count < 1) {
+        RedisModule_ReplyWithError(ctx, "ERR count must be a positive integer");
+        return REDISMODULE_ERR;
+    }
+    return REDISMODULE_OK;
+}
+
+// Parses Z.[B]POPSTORE's "[NEWSCORE <score> | KEEPSCORE] [COUNT <n>]" options
+// A NULL 'count' means that the COUNT option isn't allowed
+// Returns: REDISMODULE_OK, or REDISMODULE_ERR after replying with an error
+int parsePopStoreArgs(RedisModuleCtx *ctx, RedisModuleString **argv, int argc, int *keepscore, double *newscore, long long *count) {
+    for (int i = 0; i < argc; i++) {
+        const char *opt = RedisModule_StringPtrLen(argv[i], NULL);
+        if (!strcasecmp("keepscore", opt)) {
+            *keepscore = 1;
+        } else if (!strcasecmp("newscore", opt) && i + 1 < argc) {
+            if (REDISMODULE_OK != RedisModule_StringToDouble(argv[++i], newscore)) {
+                RedisModule_ReplyWithError(ctx, "ERR newscore is not a valid float");
+                return REDISMODULE_ERR;
+            }
+            *keepscore = 0;
+        } else if (count && !strcasecmp("count", opt) && i + 1 < argc) {
+            if (REDISMODULE_ERR == parseCountArg(ctx, &argv[i], 2, "count", count)) {
+                return REDISMODULE_ERR;
+            }
+            i++;
+        } else {
+            RedisModule_ReplyWithError(ctx, "ERR syntax error");
+            return REDISMODULE_ERR;
+        }
+    }
+    return REDISMODULE_OK;
+}
+
+// Parses a score range item, i.e. "1.5", "(1.5", "-inf" or "+inf"
+// Returns: REDISMODULE_OK, or REDISMODULE_ERR if it isn't a valid score
+int parseScoreArg(RedisModuleString *arg, double *score, int *ex) {
+    size_t len = 0;
+    const char *s = RedisModule_StringPtrLen(arg, &len);
+    char buff[128], *eptr;
+
+    *ex = (len && '(' == s[0]);
+    if (*ex) {
+        s++;
+        len--;
+    }
+    if (!len || len >= sizeof(buff)) {
+        return REDISMODULE_ERR;
+    }
+    memcpy(buff, s, len);
+    buff[len] = '\0';
+    *score = strtod(buff, &eptr);
+    if ('\0' != *eptr || isnan(*score)) {
+        return REDISMODULE_ERR;
+    }
+    return REDISMODULE_OK;
+}
+
+// Checks a lex range item, i.e. "[a", "(a", "-" or "+"
+// Returns: REDISMODULE_OK, or REDISMODULE_ERR if it isn't a valid item
+int checkLexArg(RedisModuleString *arg) {
+    size_t len = 0;
+    const char *s = RedisModule_StringPtrLen(arg, &len);
+    if (!len) {
+        return REDISMODULE_ERR;
+    }
+    if ('[' == s[0] || '(' == s[0]) {
+        return REDISMODULE_OK;
+    }
+    return (1 == len && ('-' == s[0] || '+' == s[0])) ? REDISMODULE_OK : REDISMODULE_ERR;
+}
+
+// Encodes a client id as a fixed width (big endian, so ids sort numerically) rax key
+void clientIdKey(unsigned long long id, unsigned char *buf) {
+    for (int i = ZPOP_CLIENTID_LEN - 1; i >= 0; i--) {
+        buf[i] = (unsigned char)id;
+        id >>= 8;
+    }
+}
+
+// Decodes a client id's rax key
+unsigned long long clientIdFromKey(const unsigned char *buf) {
+    unsigned long long id = 0;
+    for (int i = 0; i < ZPOP_CLIENTID_LEN; i++) {
+        id = (id << 8) | buf[i];
+    }
+    return id;
+}
+
+// Adds a call reply of a blocking client context
+void replyWithBPCtx(RedisModuleCtx *ctx, BPCtx_t *bpctx) {
+    RedisModuleString *s = RedisModule_CreateStringPrintf(ctx,
+        "db: %d, key: %.*s, client: %llu", dbKeyNameDb(bpctx->zk->name),
+        (int)(bpctx->zk->namelen - sizeof(uint32_t)), bpctx->zk->name + sizeof(uint32_t), bpctx->id);
+    RedisModule_ReplyWithString(ctx, s);
+    RedisModule_FreeString(ctx, s);
 }
 
 // Adds a call reply of a rax data structure
-void replyWithRax(RedisModuleCtx *ctx, rax *r) {
+// Its values are keys' blocking client contexts, or clients' lists of them if 'byclient'
+void replyWithRax(RedisModuleCtx *ctx, rax *r, int byclient) {
     int arrlen = 0;
     RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
 
@@ -77,17 +766,31 @@ void replyWithRax(RedisModuleCtx *ctx, rax *r) {
     while (raxNext(&it)) {
         // Every value is a list of blocking client contexts, so dump them
         RedisModule_ReplyWithArray(ctx, 2); arrlen++;
-        RedisModule_ReplyWithStringBuffer(ctx, (const char *)it.key, it.key_len);
-        list_t *lbpctx = (list_t *)it.data;
-        if (lbpctx->len) {
-            RedisModule_ReplyWithArray(ctx, lbpctx->len);
+        if (byclient) {
+            RedisModuleString *s = RedisModule_CreateStringPrintf(ctx, "%llu", clientIdFromKey(it.key));
+            RedisModule_ReplyWithString(ctx, s);
+            RedisModule_FreeString(ctx, s);
+        } else {
+            RedisModuleString *s = RedisModule_CreateStringPrintf(ctx, "%d:%.*s", dbKeyNameDb(it.key),
+                (int)(it.key_len - sizeof(uint32_t)), it.key + sizeof(uint32_t));
+            RedisModule_ReplyWithString(ctx, s);
+            RedisModule_FreeString(ctx, s);
+        }
+        list_t *lbpctx = byclient ? (list_t *)it.data : &((ZKey_t *)it.data)->waiters;
+        heap_t *hbpctx = byclient ? NULL : ((ZKey_t *)it.data)->prio;
+        heap_t *bbpctx = byclient ? NULL : ((ZKey_t *)it.data)->bands;
+        size_t len = lbpctx->len + (hbpctx ? hbpctx->len : 0) + (bbpctx ? bbpctx->len : 0);
+        if (len) {
+            RedisModule_ReplyWithArray(ctx, len);
+            for (size_t i = 0; hbpctx && i < hbpctx->len; i++) {
+                replyWithBPCtx(ctx, (BPCtx_t *)hbpctx->items[i]);
+            }
+            for (size_t i = 0; bbpctx && i < bbpctx->len; i++) {
+                replyWithBPCtx(ctx, (BPCtx_t *)bbpctx->items[i]);
+            }
             node_t *n = lbpctx->head;
             while (n) {
-                BPCtx_t *bpctx = (BPCtx_t *)n->data;
-                RedisModuleString *s = RedisModule_CreateStringPrintf(ctx,
-                    "key: %.*s, client: %.*s", bpctx->keylen, bpctx->key, bpctx->idlen, bpctx->id);
-                RedisModule_ReplyWithString(ctx, s);
-                RedisModule_FreeString(ctx, s);
+                replyWithBPCtx(ctx, byclient ? listItem(n, BPCtx_t, clientnode) : listItem(n, BPCtx_t, keynode));
                 n = n->next;
             }
         } else {
@@ -100,70 +803,117 @@ void replyWithRax(RedisModuleCtx *ctx, rax *r) {
 }
 
 // Adds to the global raxes
-void addBlockingClientToKey(RedisModuleString *keyname, unsigned long long id, RedisModuleBlockedClient *bc, int lend) {    
+// A non-NULL 'dstname' makes the client store what's popped for it there, with 'newscore'
+// if that isn't NULL either
+// A non-zero 'due' makes the client wait for elements whose score isn't in the future
+// A non-NULL 'band' makes the client wait for an element whose score is in its range
+// The client is served by 'policy' among the key's other clients, with 'priority' if prioritized
+// Keys are told apart by the db that the client has selected
+// Returns: the client's context for the key
+BPCtx_t *addBlockingClient(ZKey_t *zk, unsigned long long id, RedisModuleBlockedClient *bc, int lend,
+                           RedisModuleString *dstname, const double *newscore, int due,
+                           const ZPopRange_t *band, int policy, long long priority) {
     // Prepeare the blocking pop context
-    BPCtx_t *bpctx = RedisModule_Alloc(sizeof(BPCtx_t));
-    const char *key = RedisModule_StringPtrLen(keyname, &bpctx->keylen);
-    bpctx->key = RedisModule_Alloc(sizeof(unsigned char) * bpctx->keylen);
-    memcpy(bpctx->key, key, bpctx->keylen);
+    BPCtx_t *bpctx = poolAlloc(&gz.pool, sizeof(BPCtx_t));
+    bpctx->zk = zk;
+    zkeyRetain(bpctx->zk);
     bpctx->lend = lend;
-    bpctx->id = ull2str(id, &bpctx->idlen);
+    bpctx->id = id;
     bpctx->bc = bc;
-
-    // Append the context to the list of blocking clients under the key
-    list_t *lbc = (list_t *) raxFind(gz.RK, bpctx->key, bpctx->keylen);
-    if (raxNotFound == lbc) {
-        lbc = listNew();
-        raxInsert(gz.RK, bpctx->key, bpctx->keylen, (void *)lbc, NULL);
+    bpctx->dst = NULL;
+    bpctx->dstlen = 0;
+    bpctx->keepscore = (NULL == newscore);
+    bpctx->newscore = newscore ? *newscore : 0;
+    bpctx->due = due;
+    bpctx->banded = (NULL != band);
+    bpctx->bandmin = band ? band->min : 0;
+    bpctx->bandmax = band ? band->max : 0;
+    bpctx->bandminex = band ? band->minex : 0;
+    bpctx->bandmaxex = band ? band->maxex : 0;
+    bpctx->policy = policy;
+    bpctx->priority = priority;
+    bpctx->seq = gz.bpseq++;
+    bpctx->deadline.slot = NULL;
+    bpctx->count = 1;
+    bpctx->minbatch = 1;
+    bpctx->lingeruntil = 0;
+    if (dstname) {
+        const char *dst = RedisModule_StringPtrLen(dstname, &bpctx->dstlen);
+        bpctx->dst = poolAlloc(&gz.pool, sizeof(unsigned char) * bpctx->dstlen);
+        memcpy(bpctx->dst, dst, bpctx->dstlen);
     }
-    listTailPush(lbc, (void *)bpctx);
+
+    // Add the context to the blocking clients under the key
+    zkeyAddWaiter(bpctx->zk, bpctx);
 
     // Append the ctx to the list of keys that the client blocks on
-    list_t *lk = (list_t *)raxFind(gz.RBC, bpctx->id, bpctx->idlen);
+    unsigned char idkey[ZPOP_CLIENTID_LEN];
+    clientIdKey(id, idkey);
+    list_t *lk = (list_t *)raxFind(gz.RBC, idkey, ZPOP_CLIENTID_LEN);
     if (raxNotFound == lk) {
         lk = listNew();
-        raxInsert(gz.RBC, bpctx->id, bpctx->idlen, (void *)lk, NULL);
+        raxInsert(gz.RBC, idkey, ZPOP_CLIENTID_LEN, (void *)lk, NULL);
+    }
+    listTailPush(lk, &bpctx->clientnode);
+
+    return bpctx;
+}
+
+// Adds a client to a key's blocking clients, see addBlockingClient
+BPCtx_t *addBlockingClientToKey(RedisModuleCtx *ctx, RedisModuleString *keyname, unsigned long long id,
+                                RedisModuleBlockedClient *bc, int lend, RedisModuleString *dstname,
+                                const double *newscore, int due, const ZPopRange_t *band, int policy,
+                                long long priority) {
+    size_t keylen = 0, rkeylen = 0;
+    const char *key = RedisModule_StringPtrLen(keyname, &keylen);
+    unsigned char buf[ZPOP_KEYNAME_BUF];
+    unsigned char *rkey = dbKeyName(RedisModule_GetSelectedDb(ctx), key, keylen, buf, sizeof(buf), &rkeylen);
+    ZKey_t *zk = zkeyGet(rkey, rkeylen);
+    if (rkey != buf) {
+        RedisModule_Free(rkey);
     }
-    listTailPush(lk, (void *)bpctx);
+    return addBlockingClient(zk, id, bc, lend, dstname, newscore, due, band, policy, priority);
+}
+
+// Adds a client to the blocking clients of a prefix of keys, see addBlockingClient
+BPCtx_t *addBlockingClientToPrefix(RedisModuleCtx *ctx, RedisModuleString *prefixname, unsigned long long id,
+                                   RedisModuleBlockedClient *bc, int policy, long long priority) {
+    size_t prefixlen = 0, rprefixlen = 0;
+    const char *prefix = RedisModule_StringPtrLen(prefixname, &prefixlen);
+    unsigned char buf[ZPOP_KEYNAME_BUF];
+    unsigned char *rprefix = dbKeyName(RedisModule_GetSelectedDb(ctx), prefix, prefixlen, buf, sizeof(buf), &rprefixlen);
+    ZKey_t *zk = zkeyGetPrefix(rprefix, rprefixlen);
+    if (rprefix != buf) {
+        RedisModule_Free(rprefix);
+    }
+    return addBlockingClient(zk, id, bc, ZPOP_LIST_HEAD, NULL, NULL, 0, NULL, policy, priority);
 }
 
 // Removes from global raxes
-void removeBlockingClientFromAllKeys(unsigned char *id, size_t idlen) {    
+void removeBlockingClientFromAllKeys(unsigned long long id) {
     // Get the list of keys that the client blocks on
-    list_t *lk = (list_t *)raxFind(gz.RBC, id, idlen);
+    unsigned char idkey[ZPOP_CLIENTID_LEN];
+    clientIdKey(id, idkey);
+    list_t *lk = (list_t *)raxFind(gz.RBC, idkey, ZPOP_CLIENTID_LEN);
     if (raxNotFound == lk) {
         return;
     }
 
-    // Copy the arguments... we may be freeing the context they're from
-    unsigned char *lid = RedisModule_Alloc(sizeof(unsigned char *) * idlen);
-    size_t lidlen = idlen;
-    memcpy(lid, id, idlen);
-
     // Iterate these keys, removing the client from each
     while (lk->len) {
-        BPCtx_t *bpctx = listHeadPop(lk);
-
-        // Get the iteration's key list of blocking clients
-        list_t *lkbc = (list_t *)raxFind(gz.RK, bpctx->key, bpctx->keylen);
-        if (raxNotFound == lkbc) {
-            continue;
-        }
-
-        // Remove current bc from iteration's key
-        listRemove(lkbc, bpctx);
+        BPCtx_t *bpctx = listItem(listHeadPop(lk), BPCtx_t, clientnode);
 
-        // If the list is now empty, remove it entirely
-        if (!lkbc->len) {
-            raxRemove(gz.RK, bpctx->key, bpctx->keylen, NULL);
-            listFree(lkbc);
-        }
+        // Unlink the current bc from the iteration's key, and forget the key if it was the last
+        // The client's deadline, if the module keeps it, goes with it
+        wheelRemove(&gz.wheel, &bpctx->deadline);
+        zkeyRemoveWaiter(bpctx->zk, bpctx);
+        zkeyUnregisterIfIdle(bpctx->zk);
 
         // Free the current bc
         freeBPCtx(bpctx);
     }
 
-    raxRemove(gz.RBC, lid, lidlen, NULL);
+    raxRemove(gz.RBC, idkey, ZPOP_CLIENTID_LEN, NULL);
     listFree(lk);
 }
 
@@ -213,202 +963,1958 @@ RedisModuleString **ZPop_GenericHighLevelAPI(RedisModuleCtx *ctx, RedisModuleStr
     return rep;
 }
 
-// Generic ZPOP implemented for production with the low level API
-// Returns: array made of two RedisModuleString - the score and the element
-// If there's a type error, the array's first item is a 'popTypeError'
-RedisModuleString **ZPop_GenericLowLevelAPI(RedisModuleCtx *ctx, RedisModuleString *keyname, int lend) {
-    // Open the key
-    RedisModuleKey *key = RedisModule_OpenKey(ctx, keyname, REDISMODULE_READ | REDISMODULE_WRITE);
-    
-    // Check that the key exists, if not then break early
-    int type = RedisModule_KeyType(key);
-    if (REDISMODULE_KEYTYPE_EMPTY == type) {
-        RedisModule_CloseKey(key);
-        return NULL;
-    }
-
-    RedisModuleString **rep = RedisModule_Alloc(sizeof(RedisModuleString *) * 2);
-    // Verify that the key's type is indeed a zset, or return an error
-    if (REDISMODULE_KEYTYPE_ZSET != type)
-    {
-        RedisModule_CloseKey(key);
-        rep[0] = popTypeError;
-        return rep;
+// Pops up to 'count' elements in the range from its 'lend' end of an open zset,
+// with a single seek and walk, into 'res'. Neither deletes an emptied key nor replicates.
+void zpopFromKey(RedisModuleKey *key, ZPopRange_t *range, long long count, ZPopRes_t *res) {
+    // Never walk (or allocate for) more than what the zset holds
+    size_t card = RedisModule_ValueLength(key);
+    if ((size_t)count > card) {
+        count = (long long)card;
     }
+    zpopResReserve(res, count < ZPOP_RES_PREALLOC ? count : ZPOP_RES_PREALLOC);
 
-    // Perform the requested zrange operation, and get the first element
-    if (ZPOP_LIST_HEAD == lend) {
-        RedisModule_ZsetFirstInScoreRange(key, REDISMODULE_NEGATIVE_INFINITE, REDISMODULE_POSITIVE_INFINITE, 0, 0);
+    // Seek once to the requested end of the range, then walk from it collecting elements
+    if (range->lexmin) {
+        if (ZPOP_LIST_HEAD == range->lend) {
+            RedisModule_ZsetFirstInLexRange(key, range->lexmin, range->lexmax);
+        } else {
+            RedisModule_ZsetLastInLexRange(key, range->lexmin, range->lexmax);
+        }
+    } else if (ZPOP_LIST_HEAD == range->lend) {
+        RedisModule_ZsetFirstInScoreRange(key, range->min, range->max, range->minex, range->maxex);
     }
     else {
-        RedisModule_ZsetLastInScoreRange(key, REDISMODULE_NEGATIVE_INFINITE, REDISMODULE_POSITIVE_INFINITE, 0, 0);
+        RedisModule_ZsetLastInScoreRange(key, range->min, range->max, range->minex, range->maxex);
+    }
+    while (res->len < count && !RedisModule_ZsetRangeEndReached(key)) {
+        double score;
+        RedisModuleString *ele = RedisModule_ZsetRangeCurrentElement(key, &score);
+        zpopResPush(res, ele, score);
+        if (ZPOP_LIST_HEAD == range->lend) {
+            RedisModule_ZsetRangeNext(key);
+        } else {
+            RedisModule_ZsetRangePrev(key);
+        }
     }
-    double score;
-    RedisModuleString *ele = RedisModule_ZsetRangeCurrentElement(key, &score);
     RedisModule_ZsetRangeStop(key);
 
-    // Remove the element
-    int deleted;
-    RedisModule_ZsetRem(key, ele, &deleted);
-    // ASSERT - 1 == deleted ;)
-
-    // The following is a temp workaround for https://github.com/antirez/redis/issues/4859
-    if (RedisModule_ValueLength(key) == 0) {
-        RedisModule_DeleteKey(key);
+    // Remove the elements - only after the walk, as removal invalidates the range iterator
+    for (long long i = 0; i < res->len; i++) {
+        int deleted;
+        RedisModule_ZsetRem(key, res->eles[i], &deleted);
+        // ASSERT - 1 == deleted ;)
     }
+}
 
-    // Lastly, we want to replicate the command's effect
-    RedisModule_Replicate(ctx, "ZREM", "ss", keyname, ele);
+// A weighted random pick, ranked by log(u)/weight with u uniform in (0,1]
+typedef struct {
+    double rank;                    // The pick's random rank, the highest ones are kept
+    double score;                   // The picked element's score, which is its weight
+    RedisModuleString *ele;         // The picked element
+} RandomPick_t;
+
+// Keeps the lowest ranking pick at the heap's top, as it is the first to be replaced
+int randomPickCmp(const void *a, const void *b) {
+    double ra = ((const RandomPick_t *)a)->rank, rb = ((const RandomPick_t *)b)->rank;
+    return (ra < rb) ? -1 : (ra > rb);
+}
 
-    // Houskeeping
-    RedisModule_CloseKey(key);
+int rankCmp(const void *a, const void *b) {
+    long long ra = *(const long long *)a, rb = *(const long long *)b;
+    return (ra < rb) ? -1 : (ra > rb);
+}
 
-    // Prepare and return the reply
-    rep[0] = RedisModule_CreateStringPrintf(ctx, "%f", score);
-    rep[1] = ele;
-    return rep;
+// Encodes a rank as a rax key, big endian so that keys sort like ranks
+void rankToKey(long long rank, unsigned char *key) {
+    for (int i = 7; i >= 0; i--) {
+        key[i] = (unsigned char)(rank & 0xff);
+        rank >>= 8;
+    }
 }
 
-// A callback to be used when a blocking client is disconnected
-void BPop_Disconnected(RedisModuleCtx *ctx, RedisModuleBlockedClient *bc) {
-    REDISMODULE_NOT_USED(bc);
-    size_t idlen = 0;
-    unsigned char *id = ull2str(RedisModule_GetClientId(ctx), &idlen);
-    removeBlockingClientFromAllKeys(id, idlen);
-    gz.stats[ZPOP_STAT_DISCONNECTIONS]++;
+// Draws 'count' distinct ranks in [0,'card') into 'ranks', sorted, with Floyd's algorithm
+void sampleRanks(long long card, long long count, long long *ranks) {
+    rax *set = raxNew();
+    unsigned char key[8];
+    for (long long j = card - count; j < card; j++) {
+        long long t = (long long)(drand48() * (double)(j + 1));
+        rankToKey(t > j ? j : t, key);
+        if (!raxInsert(set, key, sizeof(key), NULL, NULL)) {
+            rankToKey(j, key);
+            raxInsert(set, key, sizeof(key), NULL, NULL);
+        }
+    }
+    raxIterator it;
+    raxStart(&it, set);
+    raxSeek(&it, "^", NULL, 0);
+    for (long long i = 0; raxNext(&it); i++) {
+        ranks[i] = 0;
+        for (size_t k = 0; k < it.key_len; k++) {
+            ranks[i] = (ranks[i] << 8) | it.key[k];
+        }
+    }
+    raxStop(&it);
+    raxFree(set);
 }
 
-// A callback to be used when a blocking client times out
-int BPop_Timeout(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    REDISMODULE_NOT_USED(argv);
-    REDISMODULE_NOT_USED(argc);
+// Fetches the elements at sorted, distinct ranks of a zset into 'eles', with a ZRANGE (as
+// the low level API can't seek by rank) per run of ranks that are at most ZPOP_RANDOM_GAP
+// apart, so close picks share a call and far ones don't pay for what's between them.
+// Elements that are missing are left NULL
+void fetchRanks(RedisModuleCtx *ctx, RedisModuleString *keyname, const long long *ranks, long long n,
+                RedisModuleString **eles) {
+    long long i = 0;
+    while (i < n) {
+        long long j = i;
+        while (j + 1 < n && ranks[j + 1] - ranks[j] <= ZPOP_RANDOM_GAP) {
+            j++;
+        }
+        RedisModuleCallReply *reply = RedisModule_Call(ctx, "ZRANGE", "sll", keyname, ranks[i], ranks[j]);
+        size_t len = reply ? RedisModule_CallReplyLength(reply) : 0;
+        for (long long k = i; k <= j; k++) {
+            size_t off = (size_t)(ranks[k] - ranks[i]);
+            eles[k] = (off < len) ?
+                RedisModule_CreateStringFromCallReply(RedisModule_CallReplyArrayElement(reply, off)) : NULL;
+        }
+        if (reply) {
+            RedisModule_FreeCallReply(reply);
+        }
+        i = j + 1;
+    }
+}
 
-    size_t idlen = 0;
-    unsigned char *id = ull2str(RedisModule_GetClientId(ctx), &idlen);
-    removeBlockingClientFromAllKeys(id, idlen);
-    gz.stats[ZPOP_STAT_TIMEOUTS_COUNT]++;
+// Pops up to 'count' weighted random elements from an open zset into 'res', sampled
+// without replacement (Efraimidis-Spirakis) in a single walk over the elements with a
+// positive score, keeping the best 'count' in a heap
+void zpopWeightedWalk(RedisModuleCtx *ctx, RedisModuleKey *key, long long count, ZPopRes_t *res) {
+    // Walk the elements that have weight, replacing the lowest ranking pick when outranked
+    RandomPick_t *picks = RedisModule_Alloc(sizeof(RandomPick_t) * count);
+    heap_t *h = heapNew(randomPickCmp, (size_t)count);
+    long long npicks = 0;
+    RedisModule_ZsetFirstInScoreRange(key, 0, REDISMODULE_POSITIVE_INFINITE, 1, 0);
+    while (!RedisModule_ZsetRangeEndReached(key)) {
+        double score;
+        RedisModuleString *ele = RedisModule_ZsetRangeCurrentElement(key, &score);
+        double rank = log(1.0 - drand48()) / score;
+        RandomPick_t *pick = NULL;
+        if (npicks < count) {
+            pick = &picks[npicks++];
+        } else if (rank > ((RandomPick_t *)heapPeek(h))->rank) {
+            pick = heapPop(h);
+            RedisModule_FreeString(ctx, pick->ele);
+        }
+        if (pick) {
+            pick->rank = rank;
+            pick->score = score;
+            pick->ele = ele;
+            heapPush(h, pick);
+        } else {
+            RedisModule_FreeString(ctx, ele);
+        }
+        RedisModule_ZsetRangeNext(key);
+    }
+    RedisModule_ZsetRangeStop(key);
 
-    RedisModule_ReplyWithNull(ctx);
-    return REDISMODULE_OK;
+    // Remove the picks - only after the walk, as removal invalidates the range iterator
+    RandomPick_t *pick;
+    while ((pick = heapPop(h))) {
+        int deleted;
+        RedisModule_ZsetRem(key, pick->ele, &deleted);
+        zpopResPush(res, pick->ele, pick->score);
+    }
+    heapFree(h);
+    RedisModule_Free(picks);
 }
 
-// A callback to be used for freeing the private data of a blocking client after sending a reply
-void BPop_FreeData(RedisModuleCtx *ctx, void *privdata) {
-    REDISMODULE_NOT_USED(ctx);
-    RedisModuleString **reply = (RedisModuleString **) privdata;
-    RedisModule_FreeString(ctx, reply[0]);
-    RedisModule_FreeString(ctx, reply[1]);
-    RedisModule_Free(privdata);
+// Pops up to 'count' weighted random elements from an open zset into 'res' by rejection
+// sampling: a uniformly drawn rank is accepted with a probability of its score over the
+// highest one, and rejected if it was already accepted, which picks each element with a
+// probability proportional to its score among those left, as a walk would. Draws are
+// made and fetched in rounds, and evaluated in the order they were made.
+// Returns: the number of draws that were made, which stops at 'maxtrials'
+long long zpopWeightedRejection(RedisModuleCtx *ctx, RedisModuleKey *key, RedisModuleString *keyname,
+                                long long count, double wmax, long long maxtrials, ZPopRes_t *res) {
+    long long card = (long long)RedisModule_ValueLength(key);
+    long long trials = 0;
+    rax *accepted = raxNew();
+    unsigned char rkey[8];
+    while (res->len < count && trials < maxtrials) {
+        long long ndraws = (count - res->len) * 2;
+        if (ndraws > maxtrials - trials) {
+            ndraws = maxtrials - trials;
+        }
+        long long *draws = RedisModule_Alloc(sizeof(long long) * ndraws * 2);
+        long long *ranks = draws + ndraws;
+        for (long long i = 0; i < ndraws; i++) {
+            draws[i] = (long long)(drand48() * (double)card);
+            if (draws[i] >= card) {
+                draws[i] = card - 1;
+            }
+            ranks[i] = draws[i];
+        }
+
+        // Fetch the distinct ranks that were drawn, in order
+        qsort(ranks, (size_t)ndraws, sizeof(long long), rankCmp);
+        long long nranks = 0;
+        for (long long i = 0; i < ndraws; i++) {
+            if (!nranks || ranks[i] != ranks[nranks - 1]) {
+                ranks[nranks++] = ranks[i];
+            }
+        }
+        RedisModuleString **eles = RedisModule_Alloc(sizeof(RedisModuleString *) * nranks);
+        fetchRanks(ctx, keyname, ranks, nranks, eles);
+
+        for (long long i = 0; i < ndraws && res->len < count; i++) {
+            trials++;
+            long long *at = bsearch(&draws[i], ranks, (size_t)nranks, sizeof(long long), rankCmp);
+            RedisModuleString *ele = eles[at - ranks];
+            double score = 0;
+            if (!ele || REDISMODULE_OK != RedisModule_ZsetScore(key, ele, &score) || !(score > 0) ||
+                drand48() * wmax >= score) {
+                continue;
+            }
+            rankToKey(draws[i], rkey);
+            if (raxInsert(accepted, rkey, sizeof(rkey), NULL, NULL)) {
+                zpopResPush(res, ele, score);
+                eles[at - ranks] = NULL;
+            }
+        }
+
+        for (long long i = 0; i < nranks; i++) {
+            if (eles[i]) {
+                RedisModule_FreeString(ctx, eles[i]);
+            }
+        }
+        RedisModule_Free(eles);
+        RedisModule_Free(draws);
+    }
+    raxFree(accepted);
+
+    // Remove the picks - only after drawing, as removal shifts the ranks
+    for (long long i = 0; i < res->len; i++) {
+        int deleted;
+        RedisModule_ZsetRem(key, res->eles[i], &deleted);
+    }
+    return trials;
+}
+
+// Pops up to 'count' random elements from an open zset into 'res', uniformly or weighted
+// by their scores. Uniform picks are distinct ranks, drawn at once and fetched by runs, in
+// O(M*log(N)). Weighted picks are rejection sampled in expected O(M*log(N)*max/mean) for
+// the scores' maximum and mean, as long as that takes at most ZPOP_RANDOM_TRIALS draws per
+// pick, and are otherwise completed by a walk over the elements in O(N*log(M)).
+void zpopRandomFromKey(RedisModuleCtx *ctx, RedisModuleKey *key, RedisModuleString *keyname,
+                       long long count, int weighted, ZPopRes_t *res) {
+    size_t card = RedisModule_ValueLength(key);
+    if ((size_t)count > card) {
+        count = (long long)card;
+    }
+    zpopResReserve(res, count < ZPOP_RES_PREALLOC ? count : ZPOP_RES_PREALLOC);
+
+    if (!weighted) {
+        long long *ranks = RedisModule_Alloc(sizeof(long long) * count);
+        RedisModuleString **eles = RedisModule_Alloc(sizeof(RedisModuleString *) * count);
+        sampleRanks((long long)card, count, ranks);
+        fetchRanks(ctx, keyname, ranks, count, eles);
+        for (long long i = 0; i < count; i++) {
+            if (eles[i]) {
+                double score = 0;
+                RedisModule_ZsetScore(key, eles[i], &score);
+                zpopResPush(res, eles[i], score);
+            }
+        }
+        RedisModule_Free(eles);
+        RedisModule_Free(ranks);
+
+        // Remove the picks - only after fetching them, as removal shifts the ranks - and
+        // shuffle them, as they were fetched in order
+        for (long long i = res->len - 1; i >= 0; i--) {
+            long long j = (long long)(drand48() * (double)(i + 1));
+            if (j < i) {
+                RedisModuleString *ele = res->eles[i];
+                double score = res->scores[i];
+                res->eles[i] = res->eles[j];
+                res->scores[i] = res->scores[j];
+                res->eles[j] = ele;
+                res->scores[j] = score;
+            }
+            int deleted;
+            RedisModule_ZsetRem(key, res->eles[i], &deleted);
+        }
+        return;
+    }
+
+    // The highest score bounds the weights, and an infinite one leaves only the walk
+    double wmax = 0;
+    RedisModule_ZsetLastInScoreRange(key, 0, REDISMODULE_POSITIVE_INFINITE, 1, 0);
+    if (!RedisModule_ZsetRangeEndReached(key)) {
+        RedisModule_FreeString(ctx, RedisModule_ZsetRangeCurrentElement(key, &wmax));
+    }
+    RedisModule_ZsetRangeStop(key);
+    if (!(wmax > 0)) {
+        return;
+    }
+    if (!isinf(wmax)) {
+        zpopWeightedRejection(ctx, key, keyname, count, wmax, count * ZPOP_RANDOM_TRIALS, res);
+    }
+
+    // Whatever rejection sampling didn't pick, a walk over what's left does
+    if (res->len < count) {
+        zpopWeightedWalk(ctx, key, count - res->len, res);
+    }
+}
+
+// Replicates the addition of a popped batch to a zset as a single ZADD, with the scores
+// formatted so that they read back the same (or with 'newscore', unless NULL)
+void replicateZAdd(RedisModuleCtx *ctx, RedisModuleString *keyname, ZPopRes_t *res, const double *newscore) {
+    RedisModuleString **zargv = RedisModule_Alloc(sizeof(RedisModuleString *) * res->len * 2);
+    char buff[GRISU_BUF_LEN];
+    for (long long i = 0; i < res->len; i++) {
+        size_t len = grisuFormat(newscore ? *newscore : res->scores[i], buff);
+        zargv[i * 2] = RedisModule_CreateString(ctx, buff, len);
+        zargv[i * 2 + 1] = res->eles[i];
+    }
+    RedisModule_Replicate(ctx, "ZADD", "sv", keyname, zargv, (size_t)res->len * 2);
+    for (long long i = 0; i < res->len; i++) {
+        RedisModule_FreeString(ctx, zargv[i * 2]);
+    }
+    RedisModule_Free(zargv);
+}
+
+// Generic ZPOP implemented for production with the low level API
+// Pops up to 'count' elements in the range from its 'lend' end with a single
+// seek and walk, removes them and replicates the effect as a single variadic ZREM.
+// The popped batch is stored in the caller's 'res', which needs no initialization
+// Returns: 'res', or NULL if the key doesn't exist
+// If there's a type error, the returned pointer is 'popTypeError'
+ZPopRes_t *ZPop_GenericLowLevelAPI(RedisModuleCtx *ctx, RedisModuleString *keyname, ZPopRange_t *range, long long count, ZPopRes_t *res) {
+    zpopResInit(res);
+
+    // Open the key
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, keyname, REDISMODULE_READ | REDISMODULE_WRITE);
+
+    // Check that the key exists, if not then break early
+    int type = RedisModule_KeyType(key);
+    if (REDISMODULE_KEYTYPE_EMPTY == type) {
+        RedisModule_CloseKey(key);
+        return NULL;
+    }
+
+    // Verify that the key's type is indeed a zset, or return an error
+    if (REDISMODULE_KEYTYPE_ZSET != type)
+    {
+        RedisModule_CloseKey(key);
+        return popTypeError;
+    }
+
+    // Pop, then unless nothing was in the range, delete an emptied key and replicate
+    zpopFromKey(key, range, count, res);
+    if (!res->len) {
+        RedisModule_CloseKey(key);
+        return res;
+    }
+
+    // The following is a temp workaround for https://github.com/antirez/redis/issues/4859
+    if (RedisModule_ValueLength(key) == 0) {
+        RedisModule_DeleteKey(key);
+    }
+
+    // Lastly, we want to replicate the command's effect - once for the entire batch
+    RedisModule_Replicate(ctx, "ZREM", "sv", keyname, res->eles, (size_t)res->len);
+
+    // Houskeeping
+    RedisModule_CloseKey(key);
+
+    return res;
+}
+
+// Checks if a key can be stored popped elements in, i.e. is either empty or a zset
+int keyIsZSetOrEmpty(RedisModuleCtx *ctx, RedisModuleString *keyname) {
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, keyname, REDISMODULE_READ);
+    int type = RedisModule_KeyType(key);
+    RedisModule_CloseKey(key);
+    return REDISMODULE_KEYTYPE_EMPTY == type || REDISMODULE_KEYTYPE_ZSET == type;
+}
+
+// Pops like ZPop_GenericLowLevelAPI, and adds the popped elements to another zset
+// with their score (or with 'newscore', unless NULL). Both keys are opened once,
+// and the effect is replicated as a ZREM and a ZADD.
+// The popped batch is stored in the caller's 'res', which needs no initialization
+// Returns: 'res', or NULL if the source key doesn't exist
+// If either key is of the wrong type, the returned pointer is 'popTypeError'
+ZPopRes_t *ZPopStore_GenericLowLevelAPI(RedisModuleCtx *ctx, RedisModuleString *srcname, RedisModuleString *dstname,
+                                        ZPopRange_t *range, long long count, const double *newscore, ZPopRes_t *res) {
+    zpopResInit(res);
+
+    // Open the source key, and check that it exists and is a zset
+    RedisModuleKey *src = RedisModule_OpenKey(ctx, srcname, REDISMODULE_READ | REDISMODULE_WRITE);
+    int type = RedisModule_KeyType(src);
+    if (REDISMODULE_KEYTYPE_EMPTY == type) {
+        RedisModule_CloseKey(src);
+        return NULL;
+    }
+    if (REDISMODULE_KEYTYPE_ZSET != type) {
+        RedisModule_CloseKey(src);
+        return popTypeError;
+    }
+
+    // Open the destination key (unless it's the same one), which may be empty or a zset
+    int samekey = !RedisModule_StringCompare(srcname, dstname);
+    RedisModuleKey *dst = samekey ? src : RedisModule_OpenKey(ctx, dstname, REDISMODULE_READ | REDISMODULE_WRITE);
+    type = RedisModule_KeyType(dst);
+    if (REDISMODULE_KEYTYPE_EMPTY != type && REDISMODULE_KEYTYPE_ZSET != type) {
+        RedisModule_CloseKey(src);
+        RedisModule_CloseKey(dst);
+        return popTypeError;
+    }
+
+    // Pop and store
+    zpopFromKey(src, range, count, res);
+    for (long long i = 0; i < res->len; i++) {
+        int flags = 0;
+        RedisModule_ZsetAdd(dst, newscore ? *newscore : res->scores[i], res->eles[i], &flags);
+    }
+
+    if (res->len) {
+        // The following is a temp workaround for https://github.com/antirez/redis/issues/4859
+        if (!samekey && RedisModule_ValueLength(src) == 0) {
+            RedisModule_DeleteKey(src);
+        }
+
+        // Lastly, we want to replicate the command's effect
+        RedisModule_Replicate(ctx, "ZREM", "sv", srcname, res->eles, (size_t)res->len);
+        replicateZAdd(ctx, dstname, res, newscore);
+    }
+
+    // Houskeeping
+    RedisModule_CloseKey(src);
+    if (!samekey) {
+        RedisModule_CloseKey(dst);
+    }
+
+    return res;
+}
+
+// Pops random elements like zpopRandomFromKey, otherwise like ZPop_GenericLowLevelAPI
+// Returns: 'res', or NULL if the key doesn't exist
+// If there's a type error, the returned pointer is 'popTypeError'
+ZPopRes_t *ZPopRandom_GenericLowLevelAPI(RedisModuleCtx *ctx, RedisModuleString *keyname, long long count,
+                                         int weighted, ZPopRes_t *res) {
+    zpopResInit(res);
+
+    // Open the key, and verify that it exists and is indeed a zset
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, keyname, REDISMODULE_READ | REDISMODULE_WRITE);
+    int type = RedisModule_KeyType(key);
+    if (REDISMODULE_KEYTYPE_ZSET != type) {
+        RedisModule_CloseKey(key);
+        return (REDISMODULE_KEYTYPE_EMPTY == type) ? NULL : popTypeError;
+    }
+
+    // Pop, then unless nothing was picked, delete an emptied key and replicate
+    zpopRandomFromKey(ctx, key, keyname, count, weighted, res);
+    if (res->len) {
+        // The following is a temp workaround for https://github.com/antirez/redis/issues/4859
+        if (RedisModule_ValueLength(key) == 0) {
+            RedisModule_DeleteKey(key);
+        }
+        RedisModule_Replicate(ctx, "ZREM", "sv", keyname, res->eles, (size_t)res->len);
+    }
+
+    // Houskeeping
+    RedisModule_CloseKey(key);
+
+    return res;
+}
+
+// A callback to be used when a blocking client is disconnected
+void BPop_Disconnected(RedisModuleCtx *ctx, RedisModuleBlockedClient *bc) {
+    REDISMODULE_NOT_USED(bc);
+    removeBlockingClientFromAllKeys(RedisModule_GetClientId(ctx));
+    gz.stats[ZPOP_STAT_DISCONNECTIONS]++;
+}
+
+// A callback to be used when a blocking client times out
+int BPop_Timeout(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    REDISMODULE_NOT_USED(argv);
+    REDISMODULE_NOT_USED(argc);
+
+    removeBlockingClientFromAllKeys(RedisModule_GetClientId(ctx));
+    gz.stats[ZPOP_STAT_TIMEOUTS_COUNT]++;
+
+    RedisModule_ReplyWithNull(ctx);
+    return REDISMODULE_OK;
+}
+
+// A callback to be used for freeing the private data of a blocking client after sending a reply
+void BPop_FreeData(RedisModuleCtx *ctx, void *privdata) {
+    if (!privdata || popTypeError == privdata) {
+        return;
+    }
+    zpopResReset(ctx, (ZPopRes_t *) privdata);
+    RedisModule_Free(privdata);
 }
 
 // A callback to be used for sending a reply to the client after unblocking it
+// A client that the module timed out is unblocked without a popped batch, and one that
+// can't be served due to a key of the wrong type is unblocked with a 'popTypeError'
 int BPop_ReturnReply(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     REDISMODULE_NOT_USED(argv);
     REDISMODULE_NOT_USED(argc);
 
-    RedisModuleString **reply = RedisModule_GetBlockedClientPrivateData(ctx);
-    RedisModule_ReplyWithArray(ctx, 3);
-    RedisModule_ReplyWithString(ctx, reply[0]);
-    RedisModule_ReplyWithString(ctx, reply[1]);
-    RedisModule_ReplyWithString(ctx, reply[2]);
+    ZPopRes_t *res = RedisModule_GetBlockedClientPrivateData(ctx);
+    if (popTypeError == res) {
+        RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+        return REDISMODULE_OK;
+    }
+    if (!res) {
+        gz.stats[ZPOP_STAT_TIMEOUTS_COUNT]++;
+        RedisModule_ReplyWithNull(ctx);
+        return REDISMODULE_OK;
+    }
+    replyWithPopRes(ctx, res);
     gz.stats[ZPOP_STAT_BLOCKEDREPLIES]++;
     return REDISMODULE_OK;
 }
-// The keyspace events handler for the module
-int keySpaceEventsHandler(RedisModuleCtx *ctx, int type, const char *event, RedisModuleString *keyname) {
+
+void armWheelTimer(RedisModuleCtx *ctx);
+
+// A callback to be used when the wheel's timer fires, that times out the blocked clients
+// whose deadlines passed, in bulk, and keeps track of how late that is
+void wheelTimerFired(RedisModuleCtx *ctx, void *data) {
+    REDISMODULE_NOT_USED(data);
+    gz.wheeltick = -1;
+
+    long long now = (long long)RedisModule_Milliseconds();
+    wtimer_t *t;
+    while ((t = wheelExpire(&gz.wheel, now))) {
+        BPCtx_t *bpctx = listItem(t, BPCtx_t, deadline);
+        RedisModuleBlockedClient *bc = bpctx->bc;
+        long long skew = now - t->expires;
+        gz.stats[ZPOP_STAT_WHEELTIMEOUTS]++;
+        gz.stats[ZPOP_STAT_WHEELSKEWTOTAL] += skew;
+        if (skew > gz.stats[ZPOP_STAT_WHEELSKEWMAX]) {
+            gz.stats[ZPOP_STAT_WHEELSKEWMAX] = skew;
+        }
+
+        // The context is freed with the others, so it goes after everything's taken from it
+        removeBlockingClientFromAllKeys(bpctx->id);
+        RedisModule_UnblockClient(bc, NULL);
+    }
+
+    armWheelTimer(ctx);
+}
+
+// Arms the wheel's timer for the next tick it has to be advanced to, unless it is already
+// armed for sooner
+void armWheelTimer(RedisModuleCtx *ctx) {
+    long long tick = wheelNextTick(&gz.wheel);
+    if (-1 == tick || (-1 != gz.wheeltick && gz.wheeltick <= tick)) {
+        return;
+    }
+    if (-1 != gz.wheeltick) {
+        RedisModule_StopTimer(ctx, gz.wheeltimer, NULL);
+    }
+    long long delay = tick - (long long)RedisModule_Milliseconds();
+    gz.wheeltick = tick;
+    gz.wheeltimer = RedisModule_CreateTimer(ctx, (mstime_t)(delay > 0 ? delay : 0), wheelTimerFired, NULL);
+}
+
+// Has the module time a blocked client out after 'timeout' milliseconds, by the deadline
+// of its context for the first key it blocks on. A zero timeout never times out.
+void addBlockingClientDeadline(RedisModuleCtx *ctx, BPCtx_t *bpctx, long long timeout) {
+    if (!timeout) {
+        return;
+    }
+
+    // An idle wheel is behind, so it is moved to the present before it's used
+    long long now = (long long)RedisModule_Milliseconds();
+    if (!gz.wheel.len) {
+        wheelExpire(&gz.wheel, now);
+    }
+    bpctx->deadline.expires = now + timeout;
+    wheelAdd(&gz.wheel, &bpctx->deadline);
+    armWheelTimer(ctx);
+}
+// Makes the name of one of a key's companions: '{<key>' followed by a suffix
+RedisModuleString *companionKeyName(RedisModuleCtx *ctx, RedisModuleString *keyname, const char *suffix, size_t sufflen) {
     size_t keylen = 0;
     const char *key = RedisModule_StringPtrLen(keyname, &keylen);
-    gz.stats[ZPOP_STAT_EVENTSHANDLED]++;
+    RedisModuleString *name = RedisModule_CreateString(ctx, ZPOP_LEASES_PREFIX, sizeof(ZPOP_LEASES_PREFIX) - 1);
+    RedisModule_StringAppendBuffer(ctx, name, key, keylen);
+    RedisModule_StringAppendBuffer(ctx, name, suffix, sufflen);
+    return name;
+}
 
-    // Is there a key name?
-    if (!keylen) {
+// Makes the name of a key's companion set of leased elements
+RedisModuleString *leasesKeyName(RedisModuleCtx *ctx, RedisModuleString *keyname) {
+    return companionKeyName(ctx, keyname, ZPOP_LEASES_SUFFIX, sizeof(ZPOP_LEASES_SUFFIX) - 1);
+}
+
+// Makes the name of a key's companion hash of its leased elements' original scores
+RedisModuleString *scoresKeyName(RedisModuleCtx *ctx, RedisModuleString *keyname) {
+    return companionKeyName(ctx, keyname, ZPOP_SCORES_SUFFIX, sizeof(ZPOP_SCORES_SUFFIX) - 1);
+}
+
+// Tells if a key can have a companion set of leases, whose name then hashes to the key's
+// own cluster slot: the key's whole name is the companion's hash tag, so it can't be
+// empty nor have a '}'
+int leasesKeyAllowed(RedisModuleString *keyname) {
+    size_t keylen = 0;
+    const char *key = RedisModule_StringPtrLen(keyname, &keylen);
+    return keylen && NULL == memchr(key, '}', keylen);
+}
+
+// Tells if a key's name is that of a companion set of leased elements, and if so gets
+// the name of the key it is the companion of (a key with a '}' can't have one)
+int leasesKeyOf(const char *name, size_t namelen, const char **key, size_t *keylen) {
+    size_t prefixlen = sizeof(ZPOP_LEASES_PREFIX) - 1, sufflen = sizeof(ZPOP_LEASES_SUFFIX) - 1;
+    if (namelen <= prefixlen + sufflen ||
+        memcmp(name, ZPOP_LEASES_PREFIX, prefixlen) ||
+        memcmp(name + namelen - sufflen, ZPOP_LEASES_SUFFIX, sufflen)) {
         return 0;
     }
+    *key = name + prefixlen;
+    *keylen = namelen - prefixlen - sufflen;
+    return NULL == memchr(*key, '}', *keylen);
+}
+
+// Registers a key that has leased elements, so that the reaper looks at it
+void registerLeasedKey(int db, const char *key, size_t keylen) {
+    size_t len = 0;
+    unsigned char *rkey = dbKeyName(db, key, keylen, NULL, 0, &len);
+    raxInsert(gz.RL, rkey, len, NULL, NULL);
+    RedisModule_Free(rkey);
+}
 
-    // Some commands never create keys, we can break early on them
-    // WIP: gotta to map 'em all! (e.g. not SORT, RESTORE, ...) as an optimization
-    char *cmdexc[] = {  "del", "exists", "type", // generic commands...
-                        "zcard", "zcount", "zlexcount", "zrange",
-                        "zrangebylex", "zrangebyscore", "zrank",
-                        "zrem", "zremrangebylex", "zremrangebyrank",
-                        "zremrangebyscore", "zrevrange", "zrevrangebylex",
-                        "zrevrangebyscore", "zrevrank", "zscan", "zscore",
-                        NULL};
-    int i = 0;
-    while (cmdexc[i]) {
-        if (!strcmp(event, cmdexc[i])) {
-            return 0;
+// Keeps the original scores of elements that were just leased in the key's companion hash,
+// so they're returned with them if their leases expire, and replicates that as an HSET
+void keepLeasedScores(RedisModuleCtx *ctx, RedisModuleString *keyname, ZPopRes_t *res) {
+    RedisModuleString *scoresname = scoresKeyName(ctx, keyname);
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, scoresname, REDISMODULE_READ | REDISMODULE_WRITE);
+    int type = RedisModule_KeyType(key);
+    if (REDISMODULE_KEYTYPE_EMPTY == type || REDISMODULE_KEYTYPE_HASH == type) {
+        RedisModuleString **hargv = RedisModule_Alloc(sizeof(RedisModuleString *) * res->len * 2);
+        char buff[GRISU_BUF_LEN];
+        for (long long i = 0; i < res->len; i++) {
+            size_t len = grisuFormat(res->scores[i], buff);
+            hargv[i * 2] = res->eles[i];
+            hargv[i * 2 + 1] = RedisModule_CreateString(ctx, buff, len);
+            RedisModule_HashSet(key, REDISMODULE_HASH_NONE, res->eles[i], hargv[i * 2 + 1], NULL);
         }
-        i++;
+        RedisModule_Replicate(ctx, "HSET", "sv", scoresname, hargv, (size_t)res->len * 2);
+        for (long long i = 0; i < res->len; i++) {
+            RedisModule_FreeString(ctx, hargv[i * 2 + 1]);
+        }
+        RedisModule_Free(hargv);
     }
+    RedisModule_CloseKey(key);
+    RedisModule_FreeString(ctx, scoresname);
+}
 
-    // Check if there are any clients blocking on the key
-    list_t *lbc = (list_t *) raxFind(gz.RK, (unsigned char *)key, keylen);
+// Forgets the original scores of leased elements that were acknowledged, and replicates
+// that as an HDEL
+void forgetLeasedScores(RedisModuleCtx *ctx, RedisModuleString *keyname, RedisModuleString **eles, size_t len) {
+    RedisModuleString *scoresname = scoresKeyName(ctx, keyname);
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, scoresname, REDISMODULE_READ | REDISMODULE_WRITE);
+    if (REDISMODULE_KEYTYPE_HASH == RedisModule_KeyType(key)) {
+        int deleted = 0;
+        for (size_t i = 0; i < len; i++) {
+            deleted += RedisModule_HashSet(key, REDISMODULE_HASH_NONE, eles[i], REDISMODULE_HASH_DELETE, NULL);
+        }
+        if (RedisModule_ValueLength(key) == 0) {
+            RedisModule_DeleteKey(key);
+        }
+        if (deleted) {
+            RedisModule_Replicate(ctx, "HDEL", "sv", scoresname, eles, len);
+        }
+    }
+    RedisModule_CloseKey(key);
+    RedisModule_FreeString(ctx, scoresname);
+}
 
-    // As long as the key exists and has blocking clients, we pop for each one
-    while (raxNotFound != lbc && lbc->len) {
-        // Get the context of the first blocking client on the key
-        BPCtx_t *bpctx = (BPCtx_t *)listHeadPop(lbc);
+// Returns a key's expired leases to it with their original scores, or with their deadline
+// if the original is missing, e.g. for leases granted before scores were kept. The effect is
+// replicated as a ZREM from the leases, an HDEL of the original scores and a ZADD.
+// The returned batch is stored in the caller's 'res', which needs no initialization
+// Returns: 'res', or NULL if the key has no leases
+// If either key is of the wrong type, the returned pointer is 'popTypeError'
+ZPopRes_t *returnExpiredLeases(RedisModuleCtx *ctx, RedisModuleString *keyname, RedisModuleString *leasesname,
+                               ZPopRange_t *range, long long count, ZPopRes_t *res) {
+    if (!keyIsZSetOrEmpty(ctx, keyname)) {
+        zpopResInit(res);
+        return popTypeError;
+    }
+    ZPopRes_t *rep = ZPop_GenericLowLevelAPI(ctx, leasesname, range, count, res);
+    if (NULL == rep || popTypeError == rep || !res->len) {
+        return rep;
+    }
 
-        // ZPop something
-        RedisModuleString **rep = ZPop_GenericLowLevelAPI(ctx, keyname, bpctx->lend);
+    // Swap the deadlines for the original scores
+    RedisModuleString *scoresname = scoresKeyName(ctx, keyname);
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, scoresname, REDISMODULE_READ | REDISMODULE_WRITE);
+    if (REDISMODULE_KEYTYPE_HASH == RedisModule_KeyType(key)) {
+        for (long long i = 0; i < res->len; i++) {
+            RedisModuleString *orig = NULL;
+            RedisModule_HashGet(key, REDISMODULE_HASH_NONE, res->eles[i], &orig, NULL);
+            if (orig) {
+                RedisModule_StringToDouble(orig, &res->scores[i]);
+                RedisModule_FreeString(ctx, orig);
+                RedisModule_HashSet(key, REDISMODULE_HASH_NONE, res->eles[i], REDISMODULE_HASH_DELETE, NULL);
+            }
+        }
+        if (RedisModule_ValueLength(key) == 0) {
+            RedisModule_DeleteKey(key);
+        }
+        RedisModule_Replicate(ctx, "HDEL", "sv", scoresname, res->eles, (size_t)res->len);
+    }
+    RedisModule_CloseKey(key);
+    RedisModule_FreeString(ctx, scoresname);
 
-        // The key doesn't actually exist after all, go an block again
-        if (NULL == rep) {
-            listHeadPush(lbc, (void *)bpctx);
-            return 0;
+    // Add the elements back
+    key = RedisModule_OpenKey(ctx, keyname, REDISMODULE_READ | REDISMODULE_WRITE);
+    for (long long i = 0; i < res->len; i++) {
+        int flags = 0;
+        RedisModule_ZsetAdd(key, res->scores[i], res->eles[i], &flags);
+    }
+    RedisModule_CloseKey(key);
+    replicateZAdd(ctx, keyname, res, NULL);
+
+    return res;
+}
+
+// A key's due timer, that wakes up the clients that block on it with Z.BPOPDUE once its
+// head is due. There's at most one per key, armed for the earliest head seen.
+typedef struct {
+    RedisModuleTimerID id;          // The timer
+    mstime_t when;                  // When the timer fires
+    unsigned char *key;             // The key's db-prefixed name
+    size_t keylen;                  // The key's db-prefixed name length
+} DueTimer_t;
+
+int keySpaceEventsHandler(RedisModuleCtx *ctx, int type, const char *event, RedisModuleString *keyname);
+
+// A callback to be used when a key's due timer fires
+void dueTimerFired(RedisModuleCtx *ctx, void *data) {
+    DueTimer_t *dt = (DueTimer_t *)data;
+    raxRemove(gz.RDT, dt->key, dt->keylen, NULL);
+    gz.stats[ZPOP_STAT_DUETIMERSFIRED]++;
+
+    // Serve the key's clients as if it was just added to, which re-arms the timer if needed
+    RedisModule_SelectDb(ctx, dbKeyNameDb(dt->key));
+    RedisModuleString *keyname = RedisModule_CreateString(ctx,
+        (const char *)dt->key + sizeof(uint32_t), dt->keylen - sizeof(uint32_t));
+    keySpaceEventsHandler(ctx, REDISMODULE_NOTIFY_ZSET, "zadd", keyname);
+
+    // Houskeeping
+    RedisModule_FreeString(ctx, keyname);
+    RedisModule_Free(dt->key);
+    RedisModule_Free(dt);
+}
+
+// Arms a key's due timer for when its head is due, unless it is already armed for sooner
+// It is meant to be called when nothing in the key is due yet
+void armDueTimer(RedisModuleCtx *ctx, RedisModuleString *keyname) {
+    // Get the head's score, if there's one
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, keyname, REDISMODULE_READ);
+    if (REDISMODULE_KEYTYPE_ZSET != RedisModule_KeyType(key)) {
+        RedisModule_CloseKey(key);
+        return;
+    }
+    double score = 0;
+    RedisModule_ZsetFirstInScoreRange(key, REDISMODULE_NEGATIVE_INFINITE, REDISMODULE_POSITIVE_INFINITE, 0, 0);
+    RedisModuleString *ele = RedisModule_ZsetRangeCurrentElement(key, &score);
+    RedisModule_ZsetRangeStop(key);
+    RedisModule_CloseKey(key);
+    if (!ele) {
+        return;
+    }
+    RedisModule_FreeString(NULL, ele);
+
+    // Scores are fractional and timers aren't, so round up to not fire too early
+    mstime_t now = RedisModule_Milliseconds();
+    double delay = ceil(score - (double)now);
+    mstime_t period = (delay < 1) ? 1 : (delay > ZPOP_DUE_MAX_DELAY) ? ZPOP_DUE_MAX_DELAY : (mstime_t)delay;
+
+    // Keep a sooner timer, or replace a later one
+    size_t keylen = 0;
+    const char *k = RedisModule_StringPtrLen(keyname, &keylen);
+    size_t rkeylen = 0;
+    unsigned char *rkey = dbKeyName(RedisModule_GetSelectedDb(ctx), k, keylen, NULL, 0, &rkeylen);
+    DueTimer_t *dt = (DueTimer_t *)raxFind(gz.RDT, rkey, rkeylen);
+    if (raxNotFound != dt) {
+        RedisModule_Free(rkey);
+        if (dt->when <= now + period) {
+            return;
         }
+        RedisModule_StopTimer(ctx, dt->id, NULL);
+    } else {
+        dt = RedisModule_Alloc(sizeof(DueTimer_t));
+        dt->key = rkey;
+        dt->keylen = rkeylen;
+        raxInsert(gz.RDT, rkey, rkeylen, (void *)dt, NULL);
+    }
+    dt->when = now + period;
+    dt->id = RedisModule_CreateTimer(ctx, period, dueTimerFired, (void *)dt);
+}
 
-        // The key exists, but is of the wrong type, back to the block
-        if (popTypeError == rep) {
-            listHeadPush(lbc, (void *)bpctx);
-            RedisModule_Free(rep);
-            return 0;
+// Gets the number of elements of a key for comparing with a MINBATCH, which is LLONG_MAX
+// if it isn't a zset at all so that popping from it can tell what's what
+long long keyCard(RedisModuleCtx *ctx, RedisModuleString *keyname) {
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, keyname, REDISMODULE_READ);
+    long long card = (REDISMODULE_KEYTYPE_ZSET != RedisModule_KeyType(key)) ? LLONG_MAX :
+                     (long long)RedisModule_ValueLength(key);
+    RedisModule_CloseKey(key);
+    return card;
+}
+
+// Serves a batch of the clients that block on a key, starting with 'first': the key is
+// opened and seeked once for as many of the clients in the deque after it that pop from
+// the same end as it has elements, and the effect is replicated as a single ZREM.
+// Prioritized clients are served one per batch, as the heap keeps no order to walk.
+// Returns: the number of served clients, which is 0 if the key is empty or not a zset
+long long serveWaitersBatch(RedisModuleCtx *ctx, RedisModuleString *keyname, BPCtx_t *first) {
+    // Open the key, and verify that it exists and is indeed a zset
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, keyname, REDISMODULE_READ | REDISMODULE_WRITE);
+    if (REDISMODULE_KEYTYPE_ZSET != RedisModule_KeyType(key)) {
+        RedisModule_CloseKey(key);
+        return 0;
+    }
+
+    // Gather the batch, up to the first client that pops differently
+    size_t card = RedisModule_ValueLength(key);
+    BPCtx_t *ibatch[ZPOP_RES_INLINE], **batch = ibatch;
+    size_t len = 0, size = ZPOP_RES_INLINE;
+    batch[len++] = first;
+    if (ZPOP_WAIT_PRIORITY != first->policy) {
+        for (node_t *n = first->keynode.next; n && len < card; n = n->next) {
+            BPCtx_t *bpctx = listItem(n, BPCtx_t, keynode);
+            if (bpctx->dst || bpctx->due || bpctx->count != 1 || bpctx->lend != first->lend) {
+                break;
+            }
+
+            // A client that blocks on the key more than once is only served once
+            if (bpctx->id == batch[len - 1]->id) {
+                continue;
+            }
+            if (len == size) {
+                size *= 2;
+                if (batch == ibatch) {
+                    batch = RedisModule_Alloc(sizeof(BPCtx_t *) * size);
+                    memcpy(batch, ibatch, sizeof(ibatch));
+                } else {
+                    batch = RedisModule_Realloc(batch, sizeof(BPCtx_t *) * size);
+                }
+            }
+            batch[len++] = bpctx;
+        }
+    }
+
+    // Pop for the entire batch with a single walk, then replicate once
+    ZPopRange_t range;
+    zpopRangeInit(&range, first->lend);
+    ZPopRes_t res;
+    zpopResInit(&res);
+    zpopFromKey(key, &range, (long long)len, &res);
+    if (res.len) {
+        // The following is a temp workaround for https://github.com/antirez/redis/issues/4859
+        if (RedisModule_ValueLength(key) == 0) {
+            RedisModule_DeleteKey(key);
+        }
+        RedisModule_Replicate(ctx, "ZREM", "sv", keyname, res.eles, (size_t)res.len);
+    }
+    RedisModule_CloseKey(key);
+
+    // Hand every client its element, then unblock it and remove it from all its mapped keys
+    // The key is the one popped from, as the clients may block on a prefix of it
+    size_t rkeylen = 0;
+    const char *rkey = RedisModule_StringPtrLen(keyname, &rkeylen);
+    for (long long i = 0; i < res.len; i++) {
+        ZPopRes_t one;
+        zpopResInit(&one);
+        zpopResPush(&one, res.eles[i], res.scores[i]);
+        RedisModule_UnblockClient(batch[i]->bc, zpopResDetach(&one, rkey, rkeylen));
+        removeBlockingClientFromAllKeys(batch[i]->id);
+    }
+
+    // Houskeeping - the elements are the clients' now
+    long long served = res.len;
+    res.len = 0;
+    zpopResReset(ctx, &res);
+    if (batch != ibatch) {
+        RedisModule_Free(batch);
+    }
+
+    return served;
+}
+
+// The banded clients that a search found, with inline room so a few don't allocate
+typedef struct {
+    BPCtx_t **items;
+    size_t len, size;
+    BPCtx_t *inl[ZPOP_RES_INLINE];
+} BandsFound_t;
+
+// Collects the banded clients whose bands overlap the scores from 'head' to 'tail', in the
+// subtree of a position in a key's bands. Subtrees whose lowest lower end is above 'tail',
+// or whose highest upper end is below 'head', are skipped whole.
+void bandsOverlapping(heap_t *bands, size_t i, double head, double tail, BandsFound_t *found) {
+    if (i >= bands->len) {
+        return;
+    }
+    BPCtx_t *bpctx = (BPCtx_t *)bands->items[i];
+    if (bpctx->bandmin > tail || (bpctx->bandminex && bpctx->bandmin == tail)) {
+        return;
+    }
+    if (bpctx->submax < head || (bpctx->submaxex && bpctx->submax == head)) {
+        return;
+    }
+    if (!(bpctx->bandmax < head || (bpctx->bandmaxex && bpctx->bandmax == head))) {
+        if (found->len == found->size) {
+            found->size *= 2;
+            if (found->items == found->inl) {
+                found->items = RedisModule_Alloc(sizeof(BPCtx_t *) * found->size);
+                memcpy(found->items, found->inl, sizeof(found->inl));
+            } else {
+                found->items = RedisModule_Realloc(found->items, sizeof(BPCtx_t *) * found->size);
+            }
         }
+        found->items[found->len++] = bpctx;
+    }
+    bandsOverlapping(bands, 2 * i + 1, head, tail, found);
+    bandsOverlapping(bands, 2 * i + 2, head, tail, found);
+}
+
+int bpctxBandSortCmp(const void *a, const void *b) {
+    return bpctxBandCmp(*(BPCtx_t * const *)a, *(BPCtx_t * const *)b);
+}
 
-        // Unblock the client with the reply
-        RedisModuleString **reply = RedisModule_Alloc(sizeof(RedisModuleString *)*3);
-        reply[0] = RedisModule_CreateString(ctx, (const char *)bpctx->key, bpctx->keylen);
-        reply[1] = rep[0];
-        reply[2] = rep[1];
-        RedisModule_UnblockClient(bpctx->bc, reply);
-        RedisModule_Free(rep);
+// Serves the clients that wait for elements in bands of scores from a key. Only the bands
+// that overlap the key's scores are looked at, in the order of their lower ends, and
+// those of them that have no element are passed over.
+void serveBands(RedisModuleCtx *ctx, ZKey_t *zk, RedisModuleString *keyname) {
+    // Get the key's lowest and highest scores, if it has any
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, keyname, REDISMODULE_READ);
+    if (REDISMODULE_KEYTYPE_ZSET != RedisModule_KeyType(key)) {
+        RedisModule_CloseKey(key);
+        return;
+    }
+    double head = 0, tail = 0;
+    RedisModule_ZsetFirstInScoreRange(key, REDISMODULE_NEGATIVE_INFINITE, REDISMODULE_POSITIVE_INFINITE, 0, 0);
+    RedisModuleString *first = RedisModule_ZsetRangeCurrentElement(key, &head);
+    RedisModule_ZsetRangeStop(key);
+    RedisModule_ZsetLastInScoreRange(key, REDISMODULE_NEGATIVE_INFINITE, REDISMODULE_POSITIVE_INFINITE, 0, 0);
+    RedisModuleString *last = RedisModule_ZsetRangeCurrentElement(key, &tail);
+    RedisModule_ZsetRangeStop(key);
+    RedisModule_CloseKey(key);
+    if (first) {
+        RedisModule_FreeString(NULL, first);
+    }
+    if (last) {
+        RedisModule_FreeString(NULL, last);
+    }
+    if (!first || !last) {
+        return;
+    }
+
+    // Popping only raises the lowest score and lowers the highest one, so the scores that
+    // were read stay safe bounds, and the clients found stay blocked until they're served
+    BandsFound_t found;
+    found.items = found.inl;
+    found.len = 0;
+    found.size = ZPOP_RES_INLINE;
+    bandsOverlapping(zk->bands, 0, head, tail, &found);
+    qsort(found.items, found.len, sizeof(BPCtx_t *), bpctxBandSortCmp);
+
+    size_t keylen = 0;
+    const char *k = RedisModule_StringPtrLen(keyname, &keylen);
+    for (size_t i = 0; i < found.len; i++) {
+        BPCtx_t *bpctx = found.items[i];
+
+        // Pop the band's lowest element, if there's one
+        ZPopRange_t range;
+        zpopRangeInit(&range, ZPOP_LIST_HEAD);
+        range.min = bpctx->bandmin;
+        range.max = bpctx->bandmax;
+        range.minex = bpctx->bandminex;
+        range.maxex = bpctx->bandmaxex;
+        ZPopRes_t res, *rep = ZPop_GenericLowLevelAPI(ctx, keyname, &range, 1, &res);
+        if (NULL == rep || popTypeError == rep) {
+            break;
+        }
+        if (!res.len) {
+            continue;
+        }
+        RedisModule_UnblockClient(bpctx->bc, zpopResDetach(&res, k, keylen));
+        removeBlockingClientFromAllKeys(bpctx->id);
+    }
+    if (found.items != found.inl) {
+        RedisModule_Free(found.items);
+    }
+}
+
+// Serves the clients that block on a key, in the key's db which should be selected
+// The clients may block on a prefix of the key, in which case 'zk' is the prefix's
+// Banded clients are served first, as they only take the elements in their bands.
+void serveKey(RedisModuleCtx *ctx, ZKey_t *zk, RedisModuleString *keyname) {
+    if (zk->bands && zk->bands->len) {
+        serveBands(ctx, zk, keyname);
+    }
+
+    // As long as the key exists and has blocking clients, we pop for each one
+    // Clients that wait for due elements are passed over while nothing is due, and ones
+    // that linger for a fuller batch while the key doesn't have it, in which case the ones
+    // after them are served, and they keep their place until it does or their timer fires
+    // The key's cardinality is read once, and then kept track of as elements are popped.
+    double now = (double)RedisModule_Milliseconds();
+    int notdue = 0;
+    long long card = keyCard(ctx, keyname);
+    BPCtx_t *bpctx;
+    while ((bpctx = zkeyNextWaiter(zk, notdue, (long long)now, card))) {
+        // Plain pops are served in batches, until the key is emptied
+        if (!bpctx->dst && !bpctx->due && 1 == bpctx->count) {
+            long long served = serveWaitersBatch(ctx, keyname, bpctx);
+            if (!served) {
+                break;
+            }
+            card -= served;
+            continue;
+        }
+
+        // ZPop something
+        ZPopRange_t range;
+        zpopRangeInit(&range, bpctx->lend);
+        if (bpctx->due) {
+            range.max = now;
+        }
+        ZPopRes_t res, *rep;
+        RedisModuleString *dstname = NULL;
+        if (bpctx->dst) {
+            dstname = RedisModule_CreateString(ctx, (const char *)bpctx->dst, bpctx->dstlen);
+
+            // A store key that became of the wrong type fails this client alone, rather
+            // than keep it at the head of the key's clients for good
+            if (!keyIsZSetOrEmpty(ctx, dstname)) {
+                RedisModule_FreeString(ctx, dstname);
+                RedisModule_UnblockClient(bpctx->bc, popTypeError);
+                removeBlockingClientFromAllKeys(bpctx->id);
+                continue;
+            }
+            rep = ZPopStore_GenericLowLevelAPI(ctx, keyname, dstname, &range, 1,
+                                               bpctx->keepscore ? NULL : &bpctx->newscore, &res);
+        } else {
+            rep = ZPop_GenericLowLevelAPI(ctx, keyname, &range, bpctx->count, &res);
+        }
+
+        // The key doesn't actually exist after all, or it is of the wrong type, so go an
+        // block again
+        if (NULL == rep || popTypeError == rep) {
+            if (dstname) {
+                RedisModule_FreeString(ctx, dstname);
+            }
+            break;
+        }
+
+        // Nothing is due yet, so keep waiting until the key's head is
+        if (!res.len) {
+            notdue = 1;
+            armDueTimer(ctx, keyname);
+            continue;
+        }
+
+        // Unblock the client with the reply, which is the only thing that outlives the call
+        // A stored pop replies like BRPOPLPUSH does, i.e. without the key
+        if (!dstname || RedisModule_StringCompare(dstname, keyname)) {
+            card -= res.len;
+        }
+        if (dstname) {
+            RedisModule_UnblockClient(bpctx->bc, zpopResDetach(&res, NULL, 0));
+        } else {
+            size_t rkeylen = 0;
+            const char *rkey = RedisModule_StringPtrLen(keyname, &rkeylen);
+            RedisModule_UnblockClient(bpctx->bc, zpopResDetach(&res, rkey, rkeylen));
+        }
+
+        // Remove the unblocked context from all its mapped keys
+        removeBlockingClientFromAllKeys(bpctx->id);
+
+        // The stored element may serve clients that block on the store key
+        if (dstname) {
+            keySpaceEventsHandler(ctx, REDISMODULE_NOTIFY_ZSET, "zadd", dstname);
+            RedisModule_FreeString(ctx, dstname);
+        }
+    }
+}
+
+// Serves the clients that block on a prefix from the keys under it that were written to
+// since the last tick, in the prefix's db which should be selected
+void servePrefix(RedisModuleCtx *ctx, ZKey_t *zk) {
+    rax *pending = zk->pending;
+    zk->pending = NULL;
+    if (!pending) {
+        return;
+    }
+
+    raxIterator it;
+    raxStart(&it, pending);
+    raxSeek(&it, "^", NULL, 0);
+    while (zkeyWaiters(zk) && raxNext(&it)) {
+        RedisModuleString *keyname = RedisModule_CreateString(ctx,
+            (const char *)it.key + sizeof(uint32_t), it.key_len - sizeof(uint32_t));
+        serveKey(ctx, zk, keyname);
+        RedisModule_FreeString(ctx, keyname);
+        gz.stats[ZPOP_STAT_READYKEYSSERVED]++;
+    }
+    raxStop(&it);
+    raxFree(pending);
+}
+
+// A timer callback that serves the keys that were written to since the last tick
+// Keys that become ready meanwhile, e.g. the store keys of Z.BPOPSTORE, are served too
+void serveReadyKeys(RedisModuleCtx *ctx, void *data) {
+    REDISMODULE_NOT_USED(data);
+    gz.readyarmed = 0;
+
+    node_t *n;
+    while ((n = listHeadPop(&gz.ready))) {
+        // The key is held on to while its clients are served, as unblocking the last one
+        // unregisters it
+        ZKey_t *zk = listItem(n, ZKey_t, readynode);
+        zk->ready = 0;
+        if (zk->registered && zk->prefix) {
+            RedisModule_SelectDb(ctx, dbKeyNameDb(zk->name));
+            servePrefix(ctx, zk);
+        } else if (zk->registered) {
+            RedisModule_SelectDb(ctx, dbKeyNameDb(zk->name));
+            RedisModuleString *keyname = RedisModule_CreateString(ctx,
+                (const char *)zk->name + sizeof(uint32_t), zk->namelen - sizeof(uint32_t));
+            serveKey(ctx, zk, keyname);
+            RedisModule_FreeString(ctx, keyname);
+            gz.stats[ZPOP_STAT_READYKEYSSERVED]++;
+        }
+        zkeyRelease(zk);
+    }
+}
+
+// Defers serving a key's clients to the next event loop tick, so that however many
+// times it is marked until then, they're served once (like Redis' own ready keys)
+void zkeyMarkReady(RedisModuleCtx *ctx, ZKey_t *zk) {
+    if (!zk->ready) {
+        zk->ready = 1;
+        zkeyRetain(zk);
+        listTailPush(&gz.ready, &zk->readynode);
+    }
+    if (!gz.readyarmed) {
+        gz.readyarmed = 1;
+        RedisModule_CreateTimer(ctx, 0, serveReadyKeys, NULL);
+    }
+}
+
+// Serves the clients that block on a key that was written to since the last tick, be they
+// the key's own or those of prefixes of it, right away rather than on the next tick
+// Commands call this before popping from a key, so that they don't take its elements from
+// under the clients that were already waiting for them.
+void serveReadyWaiters(RedisModuleCtx *ctx, RedisModuleString *keyname) {
+    if (!gz.ready.len) {
+        return;
+    }
+    size_t keylen = 0, rkeylen = 0;
+    const char *key = RedisModule_StringPtrLen(keyname, &keylen);
+    unsigned char buf[ZPOP_KEYNAME_BUF];
+    unsigned char *rkey = dbKeyName(RedisModule_GetSelectedDb(ctx), key, keylen, buf, sizeof(buf), &rkeylen);
+
+    // The key's own clients, which are then no longer due to be served on the next tick
+    ZKey_t *zk = raxSize(gz.RK) ? (ZKey_t *)raxFind(gz.RK, rkey, rkeylen) : raxNotFound;
+    if (raxNotFound != zk && zk->ready) {
+        listRemove(&gz.ready, &zk->readynode);
+        zk->ready = 0;
+        serveKey(ctx, zk, keyname);
+        gz.stats[ZPOP_STAT_READYKEYSSERVED]++;
+        zkeyRelease(zk);
+    }
+
+    // The clients of the prefixes that the key is pending for
+    for (size_t i = 0; i < gz.nprefixlens && gz.prefixlens[i] <= rkeylen; i++) {
+        zk = (ZKey_t *)raxFind(gz.RP, rkey, gz.prefixlens[i]);
+        if (raxNotFound == zk || !zk->pending || !raxRemove(zk->pending, rkey, rkeylen, NULL)) {
+            continue;
+        }
+        if (zkeyWaiters(zk)) {
+            zkeyRetain(zk);
+            serveKey(ctx, zk, keyname);
+            gz.stats[ZPOP_STAT_READYKEYSSERVED]++;
+            zkeyRelease(zk);
+        }
+    }
+
+    if (rkey != buf) {
+        RedisModule_Free(rkey);
+    }
+}
+
+// A callback to be used when a client's linger timer fires, that serves the keys it
+// blocks on with what they have. The client may have been served already.
+void lingerTimerFired(RedisModuleCtx *ctx, void *data) {
+    unsigned char idkey[ZPOP_CLIENTID_LEN];
+    clientIdKey(*(unsigned long long *)data, idkey);
+    RedisModule_Free(data);
+    list_t *lk = (list_t *)raxFind(gz.RBC, idkey, ZPOP_CLIENTID_LEN);
+    if (raxNotFound == lk) {
+        return;
+    }
+    for (node_t *n = lk->head; n; n = n->next) {
+        zkeyMarkReady(ctx, listItem(n, BPCtx_t, clientnode)->zk);
+    }
+}
+
+// Marks the prefixes of a written db-prefixed key that clients block on as ready, along
+// with the key. Only the lengths that prefixes have are looked up.
+void markPrefixesReady(RedisModuleCtx *ctx, const unsigned char *rkey, size_t rkeylen) {
+    for (size_t i = 0; i < gz.nprefixlens && gz.prefixlens[i] <= rkeylen; i++) {
+        ZKey_t *zk = (ZKey_t *)raxFind(gz.RP, (unsigned char *)rkey, gz.prefixlens[i]);
+        if (raxNotFound == zk) {
+            continue;
+        }
+        if (!zk->pending) {
+            zk->pending = raxNew();
+        }
+        raxInsert(zk->pending, (unsigned char *)rkey, rkeylen, NULL, NULL);
+        zkeyMarkReady(ctx, zk);
+    }
+}
+
+// Classifies the events of the GENERIC and ZSET classes by their effect on their key,
+// with a switch on their length and then on a distinct character of theirs
+int classifyEvent(const char *event) {
+    #define ZPOP_EVENT_IS(name) (!memcmp(event, name, sizeof(name)))
+    switch (strlen(event)) {
+    case 3:
+        return ZPOP_EVENT_IS("del") ? ZPOP_EVENT_DRAINS : ZPOP_EVENT_FILLS;
+    case 4:
+        if (ZPOP_EVENT_IS("zadd")) return ZPOP_EVENT_ZADD;
+        return ZPOP_EVENT_IS("zrem") ? ZPOP_EVENT_DRAINS : ZPOP_EVENT_FILLS;
+    case 6:
+        return ZPOP_EVENT_IS("expire") ? ZPOP_EVENT_DRAINS : ZPOP_EVENT_FILLS;
+    case 7:
+        switch (event[0]) {
+        case 'e': return ZPOP_EVENT_IS("expired") ? ZPOP_EVENT_DRAINS : ZPOP_EVENT_FILLS;
+        case 'p': return ZPOP_EVENT_IS("persist") ? ZPOP_EVENT_DRAINS : ZPOP_EVENT_FILLS;
+        case 'z': return (ZPOP_EVENT_IS("zpopmin") || ZPOP_EVENT_IS("zpopmax")) ? ZPOP_EVENT_DRAINS : ZPOP_EVENT_FILLS;
+        default: return ZPOP_EVENT_FILLS;   // restore, move_to, copy_to
+        }
+    case 9:
+        return (ZPOP_EVENT_IS("move_from") || ZPOP_EVENT_IS("sortstore")) ? ZPOP_EVENT_DRAINS : ZPOP_EVENT_FILLS;
+    case 11:
+        return ZPOP_EVENT_IS("rename_from") ? ZPOP_EVENT_DRAINS : ZPOP_EVENT_FILLS;
+    case 14:
+        return ZPOP_EVENT_IS("zremrangebylex") ? ZPOP_EVENT_DRAINS : ZPOP_EVENT_FILLS;
+    case 15:
+        return ZPOP_EVENT_IS("zremrangebyrank") ? ZPOP_EVENT_DRAINS : ZPOP_EVENT_FILLS;
+    case 16:
+        return ZPOP_EVENT_IS("zremrangebyscore") ? ZPOP_EVENT_DRAINS : ZPOP_EVENT_FILLS;
+    default:
+        return ZPOP_EVENT_FILLS;    // zincr, rename_to, zdiffstore, z*store, ...
+    }
+    #undef ZPOP_EVENT_IS
+}
+
+// The keyspace events handler for the module
+int keySpaceEventsHandler(RedisModuleCtx *ctx, int type, const char *event, RedisModuleString *keyname) {
+    size_t keylen = 0;
+    const char *key = RedisModule_StringPtrLen(keyname, &keylen);
+    gz.stats[ZPOP_STAT_EVENTSHANDLED]++;
+
+    // Is there a key name?
+    if (!keylen) {
+        return 0;
+    }
+
+    // Leases are granted by Z.POPLEASE, but may also be added by replication (to a replica
+    // that may be promoted) or when loading the AOF, so the registry is rebuilt from these.
+    // Only the module's reserved names are taken as companion sets of leases.
+    int effect = classifyEvent(event);
+    const char *leasedkey = NULL;
+    size_t leasedkeylen = 0;
+    if (ZPOP_EVENT_ZADD == effect && leasesKeyOf(key, keylen, &leasedkey, &leasedkeylen)) {
+        registerLeasedKey(RedisModule_GetSelectedDb(ctx), leasedkey, leasedkeylen);
+    }
+
+    // Events that can't fill a key can't serve its clients, we can break early on them
+    if (ZPOP_EVENT_DRAINS == effect) {
+        return 0;
+    }
+
+    // Clients that block on prefixes of the key are served along with the key's own
+    int db = RedisModule_GetSelectedDb(ctx);
+    if (raxSize(gz.RP)) {
+        size_t rkeylen = 0;
+        unsigned char buf[ZPOP_KEYNAME_BUF];
+        unsigned char *rkey = dbKeyName(db, key, keylen, buf, sizeof(buf), &rkeylen);
+        markPrefixesReady(ctx, rkey, rkeylen);
+        if (rkey != buf) {
+            RedisModule_Free(rkey);
+        }
+    }
+
+    // Unless no key is watched, or the prefilter rules the key out, check if there are any
+    // clients blocking on the key in the event's db
+    if (!raxSize(gz.RK)) {
+        return 0;
+    }
+    if (!watchFilterMayHave(watchHash(db, key, keylen))) {
+        gz.stats[ZPOP_STAT_EVENTSFILTERED]++;
+        return 0;
+    }
+    size_t rkeylen = 0;
+    unsigned char buf[ZPOP_KEYNAME_BUF];
+    unsigned char *rkey = dbKeyName(db, key, keylen, buf, sizeof(buf), &rkeylen);
+    ZKey_t *zk = (ZKey_t *)raxFind(gz.RK, rkey, rkeylen);
+    if (rkey != buf) {
+        RedisModule_Free(rkey);
+    }
+    if (raxNotFound == zk) {
+        return 0;
+    }
+
+    zkeyMarkReady(ctx, zk);
+
+    return 0;
+}
+
+// Lets clients that block on a key know that it was written to by the module itself,
+// as the low level API's writes don't trigger keyspace notifications
+void signalKeyAsReady(RedisModuleCtx *ctx, RedisModuleString *keyname) {
+    keySpaceEventsHandler(ctx, REDISMODULE_NOTIFY_ZSET, "zadd", keyname);
+}
+
+/* Z.[REV]POP <key> [COUNT <n>]
+ * Pops the lowest (or highest) ranking member(s) in a single zset, similar to LPOP.
+ * Reply: array, or nil when key doesn't exist. The array consists of the popped
+ * elements' score and the popped element itself, for each popped element.
+ */
+int Pop_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    // Verify that the number of arguments is correct
+    if (argc != 2 && argc != 4) {
+        RedisModule_WrongArity(ctx);
+        return REDISMODULE_OK;
+    }
+
+    // Get the optional count
+    long long count = 1;
+    if (argc > 2 && REDISMODULE_ERR == parseCountArg(ctx, &argv[2], argc - 2, "count", &count)) {
+        return REDISMODULE_OK;
+    }
+
+    // Deduce the the end to pop from by examining the command's name
+    size_t cmdlen = 0;
+    const char *cmd = RedisModule_StringPtrLen(argv[0], &cmdlen);
+    int cmdend = (!strcasecmp("z.pop", cmd)) ? ZPOP_LIST_HEAD : ZPOP_LIST_TAIL;
+
+    // Call a generic zpop function, after the key's blocked clients had their turn
+    serveReadyWaiters(ctx, argv[1]);
+    ZPopRange_t range;
+    zpopRangeInit(&range, cmdend);
+    ZPopRes_t res, *rep = ZPop_GenericLowLevelAPI(ctx, argv[1], &range, count, &res);
+
+    // A null means that the key didn't exists, so we reply with null
+    if (NULL == rep) {
+        RedisModule_ReplyWithNull(ctx);
+        return REDISMODULE_OK;
+    }
+
+    // Check for key type errors
+    if (popTypeError == rep) {
+        RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    } else {
+        // Reply with a an array consisting of the elements and their scores
+        replyWithPopRes(ctx, &res);
+        zpopResReset(ctx, &res);
+    }
+    return REDISMODULE_OK;
+}
+
+/* Z.[REV]POPBYSCORE <key> <min> <max> [LIMIT <n>]
+ * Pops the members in a score range of a single zset, lowest (or highest) first.
+ * The reversed variant expects <max> before <min>, similar to ZREVRANGEBYSCORE.
+ * Reply: array, or nil when key doesn't exist. The array consists of the popped
+ * elements' score and the popped element itself, for each popped element.
+ */
+int PopByScore_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    // Verify that the number of arguments is correct
+    if (argc != 4 && argc != 6) {
+        RedisModule_WrongArity(ctx);
+        return REDISMODULE_OK;
+    }
+
+    // Deduce the the end to pop from by examining the command's name
+    size_t cmdlen = 0;
+    const char *cmd = RedisModule_StringPtrLen(argv[0], &cmdlen);
+    int cmdend = (!strcasecmp("z.popbyscore", cmd)) ? ZPOP_LIST_HEAD : ZPOP_LIST_TAIL;
+
+    // Get the range, which is given reversed for the reversed variant
+    ZPopRange_t range;
+    zpopRangeInit(&range, cmdend);
+    RedisModuleString *min = (ZPOP_LIST_HEAD == cmdend) ? argv[2] : argv[3];
+    RedisModuleString *max = (ZPOP_LIST_HEAD == cmdend) ? argv[3] : argv[2];
+    if (REDISMODULE_ERR == parseScoreArg(min, &range.min, &range.minex) ||
+        REDISMODULE_ERR == parseScoreArg(max, &range.max, &range.maxex)) {
+        RedisModule_ReplyWithError(ctx, "ERR min or max is not a float");
+        return REDISMODULE_OK;
+    }
+
+    // Get the optional limit, or pop everything in the range
+    long long limit = LLONG_MAX;
+    if (argc > 4 && REDISMODULE_ERR == parseCountArg(ctx, &argv[4], argc - 4, "limit", &limit)) {
+        return REDISMODULE_OK;
+    }
+
+    // Call a generic zpop function, after the key's blocked clients had their turn
+    serveReadyWaiters(ctx, argv[1]);
+    ZPopRes_t res, *rep = ZPop_GenericLowLevelAPI(ctx, argv[1], &range, limit, &res);
+
+    // A null means that the key didn't exists, so we reply with null
+    if (NULL == rep) {
+        RedisModule_ReplyWithNull(ctx);
+        return REDISMODULE_OK;
+    }
+
+    // Check for key type errors
+    if (popTypeError == rep) {
+        RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    } else {
+        replyWithPopRes(ctx, &res);
+        zpopResReset(ctx, &res);
+    }
+    return REDISMODULE_OK;
+}
+
+/* Z.[REV]POPBYLEX <key> <min> <max> [LIMIT <n>]
+ * Pops the members in a lexicographical range of a single zset, lowest (or
+ * highest) first. It is meant for zsets where all members have the same score.
+ * The reversed variant expects <max> before <min>, similar to ZREVRANGEBYLEX.
+ * Reply: array, or nil when key doesn't exist. The array consists of the popped
+ * elements' score and the popped element itself, for each popped element.
+ */
+int PopByLex_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    // Verify that the number of arguments is correct
+    if (argc != 4 && argc != 6) {
+        RedisModule_WrongArity(ctx);
+        return REDISMODULE_OK;
+    }
+
+    // Deduce the the end to pop from by examining the command's name
+    size_t cmdlen = 0;
+    const char *cmd = RedisModule_StringPtrLen(argv[0], &cmdlen);
+    int cmdend = (!strcasecmp("z.popbylex", cmd)) ? ZPOP_LIST_HEAD : ZPOP_LIST_TAIL;
+
+    // Get the range, which is given reversed for the reversed variant
+    ZPopRange_t range;
+    zpopRangeInit(&range, cmdend);
+    range.lexmin = (ZPOP_LIST_HEAD == cmdend) ? argv[2] : argv[3];
+    range.lexmax = (ZPOP_LIST_HEAD == cmdend) ? argv[3] : argv[2];
+    if (REDISMODULE_ERR == checkLexArg(range.lexmin) ||
+        REDISMODULE_ERR == checkLexArg(range.lexmax)) {
+        RedisModule_ReplyWithError(ctx, "ERR min or max not valid string range item");
+        return REDISMODULE_OK;
+    }
+
+    // Get the optional limit, or pop everything in the range
+    long long limit = LLONG_MAX;
+    if (argc > 4 && REDISMODULE_ERR == parseCountArg(ctx, &argv[4], argc - 4, "limit", &limit)) {
+        return REDISMODULE_OK;
+    }
+
+    // Call a generic zpop function, after the key's blocked clients had their turn
+    serveReadyWaiters(ctx, argv[1]);
+    ZPopRes_t res, *rep = ZPop_GenericLowLevelAPI(ctx, argv[1], &range, limit, &res);
+
+    // A null means that the key didn't exists, so we reply with null
+    if (NULL == rep) {
+        RedisModule_ReplyWithNull(ctx);
+        return REDISMODULE_OK;
+    }
+
+    // Check for key type errors
+    if (popTypeError == rep) {
+        RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    } else {
+        replyWithPopRes(ctx, &res);
+        zpopResReset(ctx, &res);
+    }
+    return REDISMODULE_OK;
+}
+
+/* Z.POPRANDOM <key> [COUNT <n>] [WEIGHTED]
+ * Pops random member(s) of a single zset, uniformly or weighted by their scores.
+ * Reply: array, or nil when key doesn't exist. The array consists of the popped
+ * elements' score and the popped element itself, for each popped element.
+ */
+int PopRandom_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    // Verify that the number of arguments is correct
+    if (argc < 2 || argc > 5) {
+        RedisModule_WrongArity(ctx);
+        return REDISMODULE_OK;
+    }
+
+    // Get the options
+    long long count = 1;
+    int weighted = 0;
+    for (int i = 2; i < argc; i++) {
+        const char *opt = RedisModule_StringPtrLen(argv[i], NULL);
+        if (!strcasecmp("weighted", opt)) {
+            weighted = 1;
+        } else if (!strcasecmp("count", opt) && i + 1 < argc) {
+            if (REDISMODULE_OK != RedisModule_StringToLongLong(argv[++i], &count) || count < 1) {
+                RedisModule_ReplyWithError(ctx, "ERR count must be a positive integer");
+                return REDISMODULE_OK;
+            }
+        } else {
+            RedisModule_ReplyWithError(ctx, "ERR syntax error");
+            return REDISMODULE_OK;
+        }
+    }
+
+    // Call a generic zpop function, after the key's blocked clients had their turn
+    serveReadyWaiters(ctx, argv[1]);
+    ZPopRes_t res, *rep = ZPopRandom_GenericLowLevelAPI(ctx, argv[1], count, weighted, &res);
+
+    // A null means that the key didn't exists, so we reply with null
+    if (NULL == rep) {
+        RedisModule_ReplyWithNull(ctx);
+        return REDISMODULE_OK;
+    }
+
+    // Check for key type errors
+    if (popTypeError == rep) {
+        RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    } else {
+        replyWithPopRes(ctx, &res);
+        zpopResReset(ctx, &res);
+    }
+    return REDISMODULE_OK;
+}
+
+/* Z.DRAIN <key> [CHUNK <n>]
+ * Pops all the members of a single zset, lowest ranking first, and deletes it.
+ * Reply: array, or nil when key doesn't exist. The array consists of the popped
+ * elements' score and the popped element itself, for each popped element. With
+ * CHUNK, it is an array of such arrays, each of up to <n> elements.
+ */
+int Drain_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    // Verify that the number of arguments is correct
+    if (argc != 2 && argc != 4) {
+        RedisModule_WrongArity(ctx);
+        return REDISMODULE_OK;
+    }
+
+    // Get the optional chunk size
+    long long chunk = 0;
+    if (argc > 2 && REDISMODULE_ERR == parseCountArg(ctx, &argv[2], argc - 2, "chunk", &chunk)) {
+        return REDISMODULE_OK;
+    }
+
+    // Open the key, after its blocked clients had their turn, and verify that it exists and
+    // is indeed a zset
+    serveReadyWaiters(ctx, argv[1]);
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE);
+    int type = RedisModule_KeyType(key);
+    if (REDISMODULE_KEYTYPE_ZSET != type) {
+        if (REDISMODULE_KEYTYPE_EMPTY == type) {
+            RedisModule_ReplyWithNull(ctx);
+        } else {
+            RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+        }
+        RedisModule_CloseKey(key);
+        return REDISMODULE_OK;
+    }
+
+    // Reply while walking the zset, so no more than the current element is materialized
+    long long card = (long long)RedisModule_ValueLength(key);
+    RedisModule_ReplyWithArray(ctx, chunk ? (card + chunk - 1) / chunk : card * 2);
+    long long i = 0;
+    RedisModule_ZsetFirstInScoreRange(key, REDISMODULE_NEGATIVE_INFINITE, REDISMODULE_POSITIVE_INFINITE, 0, 0);
+    while (!RedisModule_ZsetRangeEndReached(key)) {
+        if (chunk && !(i % chunk)) {
+            RedisModule_ReplyWithArray(ctx, (card - i < chunk ? card - i : chunk) * 2);
+        }
+        double score;
+        RedisModuleString *ele = RedisModule_ZsetRangeCurrentElement(key, &score);
+        replyWithScore(ctx, score);
+        RedisModule_ReplyWithString(ctx, ele);
+        RedisModule_FreeString(ctx, ele);
+        RedisModule_ZsetRangeNext(key);
+        i++;
+    }
+    RedisModule_ZsetRangeStop(key);
+
+    // Delete the key in O(1), leaving freeing its elements to the background, and
+    // replicate that rather than every removal
+    RedisModule_UnlinkKey(key);
+    RedisModule_Replicate(ctx, "UNLINK", "s", argv[1]);
+    RedisModule_CloseKey(key);
+
+    return REDISMODULE_OK;
+}
+
+/* Z.MPOP MIN|MAX COUNT <n> <key> [<key> ...]
+ * Pops the lowest (or highest) ranking members across multiple zsets, in the
+ * same order they'd have been popped from a single zset that has them all.
+ * Only the head of every key is peeked at, and these are merged with a heap.
+ * Reply: array, or nil when no key exists. The array consists of the popped
+ * key, the popped element's score and the popped element itself, for each
+ * popped element.
+ */
+int MPop_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    // Verify that the number of arguments is correct
+    if (argc < 5) {
+        RedisModule_WrongArity(ctx);
+        return REDISMODULE_OK;
+    }
+
+    // Get the end to pop from
+    const char *end = RedisModule_StringPtrLen(argv[1], NULL);
+    int cmdend;
+    if (!strcasecmp("min", end)) {
+        cmdend = ZPOP_LIST_HEAD;
+    } else if (!strcasecmp("max", end)) {
+        cmdend = ZPOP_LIST_TAIL;
+    } else {
+        RedisModule_ReplyWithError(ctx, "ERR syntax error");
+        return REDISMODULE_OK;
+    }
+
+    // Get the count
+    long long count = 0;
+    if (REDISMODULE_ERR == parseCountArg(ctx, &argv[2], 2, "count", &count)) {
+        return REDISMODULE_OK;
+    }
+
+    // The keys' blocked clients have their turn first, as serving them writes to the keys
+    int numkeys = argc - 4;
+    RedisModuleString **keynames = &argv[4];
+    for (int i = 0; i < numkeys; i++) {
+        serveReadyWaiters(ctx, keynames[i]);
+    }
+    RedisModuleKey **keys = RedisModule_Calloc(numkeys, sizeof(RedisModuleKey *));
+    ZPopRes_t *res = RedisModule_Alloc(sizeof(ZPopRes_t) * numkeys);
+    MPopHead_t *heads = RedisModule_Alloc(sizeof(MPopHead_t) * numkeys);
+    heap_t *h = heapNew(ZPOP_LIST_HEAD == cmdend ? mpopHeadCmpMin : mpopHeadCmpMax, numkeys);
+
+    // Open every key and seek to its head
+    int i, wrongtype = 0;
+    long long card = 0;
+    for (i = 0; i < numkeys; i++) {
+        zpopResInit(&res[i]);
+    }
+    for (i = 0; i < numkeys; i++) {
+        // A repeated key would yield the same elements twice, so skip it
+        int j = 0;
+        while (j < i && RedisModule_StringCompare(keynames[i], keynames[j])) {
+            j++;
+        }
+        if (j < i) {
+            continue;
+        }
+
+        keys[i] = RedisModule_OpenKey(ctx, keynames[i], REDISMODULE_READ | REDISMODULE_WRITE);
+        int type = RedisModule_KeyType(keys[i]);
+        if (REDISMODULE_KEYTYPE_EMPTY == type) {
+            continue;
+        }
+        if (REDISMODULE_KEYTYPE_ZSET != type) {
+            wrongtype = 1;
+            break;
+        }
+        card += (long long)RedisModule_ValueLength(keys[i]);
+
+        if (ZPOP_LIST_HEAD == cmdend) {
+            RedisModule_ZsetFirstInScoreRange(keys[i], REDISMODULE_NEGATIVE_INFINITE, REDISMODULE_POSITIVE_INFINITE, 0, 0);
+        } else {
+            RedisModule_ZsetLastInScoreRange(keys[i], REDISMODULE_NEGATIVE_INFINITE, REDISMODULE_POSITIVE_INFINITE, 0, 0);
+        }
+        heads[i].keyidx = i;
+        heads[i].ele = RedisModule_ZsetRangeCurrentElement(keys[i], &heads[i].score);
+        heapPush(h, &heads[i]);
+    }
+
+    // Merge: pop the best head, then replace it with the next element of its key
+    long long popped = 0;
+    int *order = NULL;
+    if (!wrongtype) {
+        order = RedisModule_Alloc(sizeof(int) * (count < card ? count : card));
+        while (popped < count && h->len) {
+            MPopHead_t *head = heapPop(h);
+            RedisModuleKey *key = keys[head->keyidx];
+            zpopResPush(&res[head->keyidx], head->ele, head->score);
+            order[popped++] = head->keyidx;
+
+            if (ZPOP_LIST_HEAD == cmdend) {
+                RedisModule_ZsetRangeNext(key);
+            } else {
+                RedisModule_ZsetRangePrev(key);
+            }
+            if (!RedisModule_ZsetRangeEndReached(key)) {
+                head->ele = RedisModule_ZsetRangeCurrentElement(key, &head->score);
+                heapPush(h, head);
+            }
+        }
+    }
+
+    // Remove the popped elements, replicating a single ZREM per key
+    for (i = 0; i < numkeys; i++) {
+        if (!keys[i]) {
+            continue;
+        }
+        RedisModule_ZsetRangeStop(keys[i]);
+        if (res[i].len) {
+            for (long long j = 0; j < res[i].len; j++) {
+                int deleted;
+                RedisModule_ZsetRem(keys[i], res[i].eles[j], &deleted);
+            }
+            if (RedisModule_ValueLength(keys[i]) == 0) {
+                RedisModule_DeleteKey(keys[i]);
+            }
+            RedisModule_Replicate(ctx, "ZREM", "sv", keynames[i], res[i].eles, (size_t)res[i].len);
+        }
+        RedisModule_CloseKey(keys[i]);
+    }
+
+    // Reply in the order of the merge
+    if (wrongtype) {
+        RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    } else if (!popped) {
+        RedisModule_ReplyWithNull(ctx);
+    } else {
+        long long *pos = RedisModule_Calloc(numkeys, sizeof(long long));
+        RedisModule_ReplyWithArray(ctx, popped * 3);
+        for (long long j = 0; j < popped; j++) {
+            ZPopRes_t *r = &res[order[j]];
+            long long p = pos[order[j]]++;
+            RedisModule_ReplyWithString(ctx, keynames[order[j]]);
+            replyWithScore(ctx, r->scores[p]);
+            RedisModule_ReplyWithString(ctx, r->eles[p]);
+        }
+        RedisModule_Free(pos);
+    }
+
+    // Housekeeping
+    MPopHead_t *head;
+    while ((head = heapPop(h))) {
+        RedisModule_FreeString(ctx, head->ele);
+    }
+    for (i = 0; i < numkeys; i++) {
+        zpopResReset(ctx, &res[i]);
+    }
+    if (order) {
+        RedisModule_Free(order);
+    }
+    heapFree(h);
+    RedisModule_Free(heads);
+    RedisModule_Free(res);
+    RedisModule_Free(keys);
+
+    return REDISMODULE_OK;
+}
+
+/* Z.POPLEASE <key> <leasems>
+ * Pops the lowest ranking member of a zset for at-least-once processing: the
+ * member is moved to the key's companion set of leases ('{<key>}:zpop:leases'), scored
+ * by its lease's deadline, until it is acknowledged with Z.ACK. Unacknowledged
+ * members are returned to the key, with their original score, once their lease expires.
+ * Reply: array, or nil when key doesn't exist. The array consists of the popped
+ * element's score and the popped element itself.
+ */
+int PopLease_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    // Verify that the number of arguments is correct
+    if (argc != 3) {
+        RedisModule_WrongArity(ctx);
+        return REDISMODULE_OK;
+    }
+
+    // Get the lease's duration
+    long long leasems = 0;
+    if (REDISMODULE_OK != RedisModule_StringToLongLong(argv[2], &leasems) || leasems < 1) {
+        RedisModule_ReplyWithError(ctx, "ERR lease must be a positive integer");
+        return REDISMODULE_OK;
+    }
+    if (!leasesKeyAllowed(argv[1])) {
+        RedisModule_ReplyWithError(ctx, ZPOP_LEASES_KEYERR);
+        return REDISMODULE_OK;
+    }
+    double deadline = (double)(RedisModule_Milliseconds() + leasems);
+
+    // Move the head to the leases, after the key's blocked clients had their turn
+    serveReadyWaiters(ctx, argv[1]);
+    RedisModuleString *leasesname = leasesKeyName(ctx, argv[1]);
+    ZPopRange_t range;
+    zpopRangeInit(&range, ZPOP_LIST_HEAD);
+    ZPopRes_t res, *rep = ZPopStore_GenericLowLevelAPI(ctx, argv[1], leasesname, &range, 1, &deadline, &res);
+    RedisModule_FreeString(ctx, leasesname);
+
+    if (NULL == rep) {
+        RedisModule_ReplyWithNull(ctx);
+    } else if (popTypeError == rep) {
+        RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    } else {
+        size_t keylen = 0;
+        const char *key = RedisModule_StringPtrLen(argv[1], &keylen);
+        registerLeasedKey(RedisModule_GetSelectedDb(ctx), key, keylen);
+        keepLeasedScores(ctx, argv[1], &res);
+        gz.stats[ZPOP_STAT_LEASESGRANTED] += res.len;
+        replyWithPopRes(ctx, &res);
+        zpopResReset(ctx, &res);
+    }
+    return REDISMODULE_OK;
+}
+
+/* Z.ACK <key> <member> [<member> ...]
+ * Acknowledges the processing of leased members, removing them from the key's
+ * companion set of leases (and their original scores) so they're never returned to the key.
+ * Reply: integer, the number of acknowledged members.
+ */
+int Ack_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    // Verify that the number of arguments is correct
+    if (argc < 3) {
+        RedisModule_WrongArity(ctx);
+        return REDISMODULE_OK;
+    }
+    if (!leasesKeyAllowed(argv[1])) {
+        RedisModule_ReplyWithError(ctx, ZPOP_LEASES_KEYERR);
+        return REDISMODULE_OK;
+    }
+
+    RedisModuleString *leasesname = leasesKeyName(ctx, argv[1]);
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, leasesname, REDISMODULE_READ | REDISMODULE_WRITE);
+    int type = RedisModule_KeyType(key);
+    long long acked = 0;
+    if (REDISMODULE_KEYTYPE_ZSET == type) {
+        for (int i = 2; i < argc; i++) {
+            int deleted = 0;
+            RedisModule_ZsetRem(key, argv[i], &deleted);
+            acked += deleted;
+        }
+        if (acked) {
+            // The following is a temp workaround for https://github.com/antirez/redis/issues/4859
+            if (RedisModule_ValueLength(key) == 0) {
+                RedisModule_DeleteKey(key);
+            }
+            RedisModule_Replicate(ctx, "ZREM", "sv", leasesname, &argv[2], (size_t)(argc - 2));
+            forgetLeasedScores(ctx, argv[1], &argv[2], (size_t)(argc - 2));
+        }
+    }
+    RedisModule_CloseKey(key);
+    RedisModule_FreeString(ctx, leasesname);
+
+    if (REDISMODULE_KEYTYPE_EMPTY != type && REDISMODULE_KEYTYPE_ZSET != type) {
+        RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    } else {
+        gz.stats[ZPOP_STAT_LEASESACKED] += acked;
+        RedisModule_ReplyWithLongLong(ctx, acked);
+    }
+    return REDISMODULE_OK;
+}
+
+/* The lease reaper's timer callback
+ * Returns expired leases to their keys, with their original scores, in bounded
+ * batches so that a wave of expirations doesn't stall the server. When a tick
+ * runs out of budget, the next one is due right away and resumes where it was.
+ */
+void leaseReaper(RedisModuleCtx *ctx, void *data) {
+    REDISMODULE_NOT_USED(data);
+    long long budget = ZPOP_REAPER_BATCH;
+
+    // Replicas get their leases returned by their master
+    if (raxSize(gz.RL) && !(RedisModule_GetContextFlags(ctx) & REDISMODULE_CTX_FLAGS_SLAVE)) {
+        double now = (double)RedisModule_Milliseconds();
+        int resumed = 0;
+
+        raxIterator it;
+        raxStart(&it, gz.RL);
+        if (gz.reapfrom) {
+            raxSeek(&it, ">=", gz.reapfrom, gz.reapfromlen);
+            RedisModule_Free(gz.reapfrom);
+            gz.reapfrom = NULL;
+        } else {
+            raxSeek(&it, "^", NULL, 0);
+        }
+        while (budget && (resumed = raxNext(&it))) {
+            RedisModule_SelectDb(ctx, dbKeyNameDb(it.key));
+            RedisModuleString *keyname = RedisModule_CreateString(ctx,
+                (const char *)it.key + sizeof(uint32_t), it.key_len - sizeof(uint32_t));
+            RedisModuleString *leasesname = leasesKeyName(ctx, keyname);
+
+            // Return whatever expired, with its original score
+            ZPopRange_t range;
+            zpopRangeInit(&range, ZPOP_LIST_HEAD);
+            range.max = now;
+            ZPopRes_t res, *rep = returnExpiredLeases(ctx, keyname, leasesname, &range, budget, &res);
+            if (NULL == rep || popTypeError == rep) {
+                // No more leases (or the keys were overwritten), stop looking at them
+                // The iterator has to be re-seeked after the rax is modified
+                size_t rkeylen = it.key_len;
+                unsigned char *rkey = RedisModule_Alloc(rkeylen);
+                memcpy(rkey, it.key, rkeylen);
+                raxRemove(gz.RL, rkey, rkeylen, NULL);
+                raxSeek(&it, ">", rkey, rkeylen);
+                RedisModule_Free(rkey);
+            } else {
+                budget -= res.len;
+                if (res.len) {
+                    gz.stats[ZPOP_STAT_LEASESEXPIRED] += res.len;
+                    signalKeyAsReady(ctx, keyname);
+                }
+                zpopResReset(ctx, &res);
+            }
 
-        // Remove the unblocked context from all its mapped keys
-        removeBlockingClientFromAllKeys(bpctx->id, bpctx->idlen);
+            RedisModule_FreeString(ctx, leasesname);
+            RedisModule_FreeString(ctx, keyname);
+        }
 
-        // Get the list of blocking clients again
-        lbc = (list_t *) raxFind(gz.RK, (unsigned char *)key, keylen);
+        // Out of budget, so the next tick resumes from the last key
+        if (!budget && resumed) {
+            gz.reapfrom = RedisModule_Alloc(it.key_len);
+            memcpy(gz.reapfrom, it.key, it.key_len);
+            gz.reapfromlen = it.key_len;
+        }
+        raxStop(&it);
     }
 
-    // If the list is empty, we can free it and remove the key
-    if(raxNotFound != lbc && !lbc->len) {
-        raxRemove(gz.RK, (unsigned char *)key, keylen, NULL);
-        listFree(lbc);
-    }
+    RedisModule_CreateTimer(ctx, budget ? ZPOP_REAPER_PERIOD : 1, leaseReaper, NULL);
+}
 
-    return 0;
+// A timer callback that gives back what the pool keeps beyond its needs after a burst
+void poolTrimmer(RedisModuleCtx *ctx, void *data) {
+    REDISMODULE_NOT_USED(data);
+    poolTrim(&gz.pool, ZPOP_POOL_KEEP);
+    RedisModule_CreateTimer(ctx, ZPOP_POOL_TRIM_PERIOD, poolTrimmer, NULL);
 }
 
-/* Z.[REV]POP <key>
- * Pops the lowest (or highest) ranking member in a single zset, similar to LPOP.
- * Reply: array, or nil when key doesn't exist. The array consists of the popped
- * element's score and the popped element itself.
+/* Z.POPSTORE <src> <dst> [NEWSCORE <score> | KEEPSCORE] [COUNT <n>]
+ * Pops the lowest ranking member(s) of a zset and adds them to another one,
+ * similar to RPOPLPUSH. The members keep their scores, unless NEWSCORE is given.
+ * Reply: array, or nil when src doesn't exist. The array consists of the popped
+ * elements' score and the popped element itself, for each popped element.
  */
-int Pop_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+int PopStore_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     // Verify that the number of arguments is correct
-    if (argc != 2) {
+    if (argc < 3) {
         RedisModule_WrongArity(ctx);
         return REDISMODULE_OK;
     }
 
-    // Deduce the the end to pop from by examining the command's name
-    size_t cmdlen = 0;
-    const char *cmd = RedisModule_StringPtrLen(argv[0], &cmdlen);
-    int cmdend = (!strcasecmp("z.pop", cmd)) ? ZPOP_LIST_HEAD : ZPOP_LIST_TAIL;
+    // Get the options
+    int keepscore = 1;
+    double newscore = 0;
+    long long count = 1;
+    if (REDISMODULE_ERR == parsePopStoreArgs(ctx, &argv[3], argc - 3, &keepscore, &newscore, &count)) {
+        return REDISMODULE_OK;
+    }
 
-    // Call a generic zpop function
-    RedisModuleString **rep = ZPop_GenericLowLevelAPI(ctx, argv[1], cmdend);
+    // Call a generic zpop function, after the key's blocked clients had their turn
+    serveReadyWaiters(ctx, argv[1]);
+    ZPopRange_t range;
+    zpopRangeInit(&range, ZPOP_LIST_HEAD);
+    ZPopRes_t res, *rep = ZPopStore_GenericLowLevelAPI(ctx, argv[1], argv[2], &range, count,
+                                                       keepscore ? NULL : &newscore, &res);
 
     // A null means that the key didn't exists, so we reply with null
     if (NULL == rep) {
@@ -417,26 +2923,104 @@ int Pop_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     }
 
     // Check for key type errors
-    if (popTypeError == rep[0]) {
+    if (popTypeError == rep) {
         RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
-        RedisModule_Free(rep);
     } else {
-        // Reply with a an array consisting of the element and its score
-        RedisModule_ReplyWithArray(ctx, 2);
-        RedisModule_ReplyWithString(ctx, rep[0]);
-        RedisModule_ReplyWithString(ctx, rep[1]);
-        RedisModule_FreeString(ctx, rep[0]);
-        RedisModule_FreeString(ctx, rep[1]);
-        RedisModule_Free(rep);
+        replyWithPopRes(ctx, &res);
+        zpopResReset(ctx, &res);
+        signalKeyAsReady(ctx, argv[2]);
+    }
+    return REDISMODULE_OK;
+}
+
+/* Z.BPOPSTORE <src> <dst> <timeout> [NEWSCORE <score> | KEEPSCORE]
+ * The blocking variant, similar to BRPOPLPUSH.
+ * Reply: array, or nil when the timeout is met. The array consists of the popped
+ * element's score and the popped element itself.
+ */
+int BPopStore_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    // Verify that the number of arguments is correct
+    if (argc < 4) {
+        RedisModule_WrongArity(ctx);
+        return REDISMODULE_OK;
+    }
+
+    // Get the timeout from the arguments, and validate it
+    long long timeout = 0;
+    if (REDISMODULE_OK != RedisModule_StringToLongLong(argv[3], &timeout) || timeout < 0) {
+        RedisModule_ReplyWithError(ctx, "timeout must be a positive integer");
+        return REDISMODULE_OK;
+    }
+
+    // Get the options
+    int keepscore = 1;
+    double newscore = 0;
+    if (REDISMODULE_ERR == parsePopStoreArgs(ctx, &argv[4], argc - 4, &keepscore, &newscore, NULL)) {
+        return REDISMODULE_OK;
+    }
+
+    // The store key is checked up front, as there's no popping to check it when blocking
+    if (!keyIsZSetOrEmpty(ctx, argv[2])) {
+        RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+        return REDISMODULE_OK;
+    }
+
+    // Try popping, after the key's blocked clients had their turn
+    serveReadyWaiters(ctx, argv[1]);
+    ZPopRange_t range;
+    zpopRangeInit(&range, ZPOP_LIST_HEAD);
+    ZPopRes_t res, *rep = ZPopStore_GenericLowLevelAPI(ctx, argv[1], argv[2], &range, 1,
+                                                       keepscore ? NULL : &newscore, &res);
+    if (popTypeError == rep) {
+        RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+        return REDISMODULE_OK;
+    }
+
+    // Popped an element, can return with a reply
+    if (rep) {
+        replyWithPopRes(ctx, &res);
+        zpopResReset(ctx, &res);
+        signalKeyAsReady(ctx, argv[2]);
+        return REDISMODULE_OK;
+    }
+
+    // Nothing was popped, so go and block
+    unsigned long long id = RedisModule_GetClientId(ctx);
+    RedisModuleBlockedClient *bc = RedisModule_BlockClient(ctx, BPop_ReturnReply, BPop_Timeout, BPop_FreeData,
+                                                           ZPOP_TIMEOUTS_MODULE == gz.timeouts ? 0 : timeout);
+    RedisModule_SetDisconnectCallback(bc, BPop_Disconnected);
+    BPCtx_t *bpctx = addBlockingClientToKey(ctx, argv[1], id, bc, ZPOP_LIST_HEAD, argv[2],
+                                            keepscore ? NULL : &newscore, 0, NULL, ZPOP_WAIT_FIFO, 0);
+    if (ZPOP_TIMEOUTS_MODULE == gz.timeouts) {
+        addBlockingClientDeadline(ctx, bpctx, timeout);
     }
+    gz.stats[ZPOP_STAT_BLOCKEDCLIENTS]++;
+    gz.stats[ZPOP_STAT_TOTALKEYSBLOCK]++;
+
     return REDISMODULE_OK;
 }
 
+// Tells if an argument can come right before an option of Z.BPOP, i.e. is either the
+// timeout, an option's value, or an option that has none
+int bpopOptionFollows(RedisModuleString *arg) {
+    long long ll;
+    const char *str = RedisModule_StringPtrLen(arg, NULL);
+    return REDISMODULE_OK == RedisModule_StringToLongLong(arg, &ll) ||
+           !strcasecmp("fifo", str) || !strcasecmp("lifo", str);
+}
 
-/* Z.B[REV]POP <key> [<key> ...] <timeout>
+/* Z.B[REV]POP <key> [<key> ...] <timeout> [COUNT <n> [MINBATCH <m> LINGER <ms>]]
+ *                [FIFO | LIFO | PRIORITY <p>]
  * The blocking variant, similar to BLPOP.
+ * Z.BPOPDUE <key> [<key> ...] <timeout> [COUNT <n>] [FIFO | LIFO | PRIORITY <p>]
+ * Blocks until the lowest score in a zset, taken as a Unix time in milliseconds, is due.
+ * Up to COUNT elements are popped from a key at once. With MINBATCH, a key is only popped
+ * from once it has at least that many elements, or once LINGER milliseconds have passed
+ * since blocking, after which whatever it has is popped.
+ * A blocked client is served after those that blocked before it (FIFO), before them (LIFO),
+ * or before all clients without a PRIORITY and after those with a higher one.
  * Reply: array, or nil when key doesn't exist. The array consists of the popped
- * key, the popped element's score and the popped element itself.
+ * key, followed by the popped elements' scores and the popped elements themselves.
  */
 int BPop_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     // Verify that the number of arguments is correct
@@ -445,71 +3029,421 @@ int BPop_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
         return REDISMODULE_OK;
     }
 
+    // Get the options, that come after the timeout, and leave out their arguments
+    // An option follows the timeout or another option, so a word that doesn't is a key,
+    // e.g. 'Z.BPOP a count 100' blocks on 'a' and 'count' for 100 milliseconds
+    int policy = ZPOP_WAIT_FIFO;
+    long long priority = 0, count = 1, minbatch = 0, linger = -1;
+    for (;;) {
+        const char *opt = RedisModule_StringPtrLen(argv[argc - 1], NULL);
+        if (argc > 3 && bpopOptionFollows(argv[argc - 2]) &&
+            (!strcasecmp("fifo", opt) || !strcasecmp("lifo", opt))) {
+            policy = strcasecmp("fifo", opt) ? ZPOP_WAIT_LIFO : ZPOP_WAIT_FIFO;
+            argc--;
+            continue;
+        }
+        const char *name = (argc > 4 && bpopOptionFollows(argv[argc - 3])) ?
+                           RedisModule_StringPtrLen(argv[argc - 2], NULL) : "";
+        long long *val = NULL;
+        if (!strcasecmp("priority", name)) {
+            val = &priority;
+            policy = ZPOP_WAIT_PRIORITY;
+        } else if (!strcasecmp("count", name)) {
+            val = &count;
+        } else if (!strcasecmp("minbatch", name)) {
+            val = &minbatch;
+        } else if (!strcasecmp("linger", name)) {
+            val = &linger;
+        } else {
+            break;
+        }
+        if (REDISMODULE_OK != RedisModule_StringToLongLong(argv[argc - 1], val)) {
+            RedisModule_ReplyWithError(ctx, (val == &priority) ? "ERR priority must be an integer" :
+                                            "ERR count, minbatch and linger must be integers");
+            return REDISMODULE_OK;
+        }
+        argc -= 2;
+    }
+
     // Handle a "getkey-api" request
     if (RedisModule_IsKeysPositionRequest(ctx)) {
         int i;
         for (i = 1; i < argc - 1; i++) {
-            RedisModule_KeyAtPos(ctx, 2);
+            RedisModule_KeyAtPos(ctx, i);
         }
         return REDISMODULE_OK;
     }
 
+    // Deduce the the end to pop from by examining the command's name
+    size_t cmdlen = 0;
+    const char *cmd = RedisModule_StringPtrLen(argv[0], &cmdlen);
+    int cmdend = (!strcasecmp("z.brevpop", cmd)) ? ZPOP_LIST_TAIL : ZPOP_LIST_HEAD;
+    int due = !strcasecmp("z.bpopdue", cmd);
+
+    // MINBATCH and LINGER go together, and a batch can't be more than COUNT
+    if ((0 == minbatch) != (-1 == linger)) {
+        RedisModule_ReplyWithError(ctx, "ERR MINBATCH and LINGER must be given together");
+        return REDISMODULE_OK;
+    }
+    if (due && minbatch) {
+        RedisModule_ReplyWithError(ctx, "ERR MINBATCH and LINGER are not supported by Z.BPOPDUE");
+        return REDISMODULE_OK;
+    }
+    if (!minbatch) {
+        minbatch = 1;
+        linger = 0;
+    }
+    if (count < 1 || minbatch < 1 || minbatch > count || linger < 0) {
+        RedisModule_ReplyWithError(ctx, "ERR count must be positive, minbatch between 1 and count, and linger not negative");
+        return REDISMODULE_OK;
+    }
+
     // Get the timeout from the arguments, and validate it
     long long timeout = 0;
-    RedisModule_StringToLongLong(argv[argc-1], &timeout);
-    if (timeout < 0) {
+    if (REDISMODULE_OK != RedisModule_StringToLongLong(argv[argc-1], &timeout) || timeout < 0) {
         RedisModule_ReplyWithError(ctx, "timeout must be a positive integer");
         return REDISMODULE_OK;
     }
 
-    // Deduce the the end to pop from by examining the command's name
-    size_t cmdlen = 0;
-    const char *cmd = RedisModule_StringPtrLen(argv[0], &cmdlen);
-    int cmdend = (!strcasecmp("z.bpop", cmd)) ? ZPOP_LIST_HEAD : ZPOP_LIST_TAIL;
-    
-    // Try popping until something happens
-    RedisModuleString **rep = NULL;
+    // Try popping until something happens, from keys with enough elements unless the client
+    // doesn't linger for them, after the keys' blocked clients had their turn
+    ZPopRange_t range;
+    zpopRangeInit(&range, cmdend);
+    if (due) {
+        range.max = (double)RedisModule_Milliseconds();
+    }
+    ZPopRes_t res, *rep = NULL;
     int keypos = 1;
     while (keypos < argc - 1) {
-        rep = ZPop_GenericLowLevelAPI(ctx, argv[keypos++], cmdend);
+        serveReadyWaiters(ctx, argv[keypos]);
+        if (linger && keyCard(ctx, argv[keypos]) < minbatch) {
+            keypos++;
+            continue;
+        }
+        rep = ZPop_GenericLowLevelAPI(ctx, argv[keypos++], &range, count, &res);
         if (NULL == rep) {
             continue;
         }
-        if (popTypeError == rep[0]) {
+        if (popTypeError == rep) {
             RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
-            RedisModule_Free(rep);
             return REDISMODULE_OK;
         }
 
-        // Popped an element, can return with a reply
-        RedisModule_ReplyWithArray(ctx, 2);
-        RedisModule_ReplyWithString(ctx, rep[0]);
-        RedisModule_ReplyWithString(ctx, rep[1]);
+        // Nothing in the key is due yet
+        if (!res.len) {
+            continue;
+        }
+
+        // Popped an element, can return with a reply that includes the key
+        res.key = RedisModule_StringPtrLen(argv[keypos - 1], &res.keylen);
+        replyWithPopRes(ctx, &res);
         goto ok;
         
     }
 
-    // Nothing was popped, so go and block
-    if (NULL == rep) {
-        keypos = 1;
-        unsigned long long id = RedisModule_GetClientId(ctx);
-        RedisModuleBlockedClient *bc = RedisModule_BlockClient(ctx, BPop_ReturnReply, BPop_Timeout, BPop_FreeData, timeout);
-        RedisModule_SetDisconnectCallback(bc, BPop_Disconnected);
-        while (keypos < argc - 1) {
-            addBlockingClientToKey(argv[keypos], id, bc, cmdend);
-            keypos++;
+    // Nothing was popped, so go and block, and have keys with elements that aren't due
+    // yet wake the client up when they are
+    keypos = 1;
+    unsigned long long id = RedisModule_GetClientId(ctx);
+    RedisModuleBlockedClient *bc = RedisModule_BlockClient(ctx, BPop_ReturnReply, BPop_Timeout, BPop_FreeData,
+                                                           ZPOP_TIMEOUTS_MODULE == gz.timeouts ? 0 : timeout);
+    RedisModule_SetDisconnectCallback(bc, BPop_Disconnected);
+    BPCtx_t *first = NULL;
+    while (keypos < argc - 1) {
+        BPCtx_t *bpctx = addBlockingClientToKey(ctx, argv[keypos], id, bc, cmdend, NULL, NULL, due, NULL,
+                                                policy, priority);
+        bpctx->count = count;
+        bpctx->minbatch = minbatch;
+        bpctx->lingeruntil = linger ? (long long)RedisModule_Milliseconds() + linger : 0;
+        if (!first) {
+            first = bpctx;
         }
-        gz.stats[ZPOP_STAT_BLOCKEDCLIENTS]++;
-        gz.stats[ZPOP_STAT_TOTALKEYSBLOCK] += (long long)(argc - 1);
+        if (due) {
+            armDueTimer(ctx, argv[keypos]);
+        }
+        keypos++;
+    }
+    if (ZPOP_TIMEOUTS_MODULE == gz.timeouts) {
+        addBlockingClientDeadline(ctx, first, timeout);
+    }
+
+    // Once the client is done lingering, its keys are served with whatever they have
+    if (linger) {
+        unsigned long long *lid = RedisModule_Alloc(sizeof(unsigned long long));
+        *lid = id;
+        RedisModule_CreateTimer(ctx, linger, lingerTimerFired, (void *)lid);
     }
+    gz.stats[ZPOP_STAT_BLOCKEDCLIENTS]++;
+    gz.stats[ZPOP_STAT_TOTALKEYSBLOCK] += (long long)(argc - 1);
 
 ok:
     // Housekeeping
     if (rep) {
-        RedisModule_FreeString(ctx, rep[0]);
-        RedisModule_FreeString(ctx, rep[1]);
-        RedisModule_Free(rep);
+        zpopResReset(ctx, &res);
+    }
+
+    return REDISMODULE_OK;
+}
+
+// Makes a SCAN pattern that matches the keys under a prefix, escaping its glob characters
+RedisModuleString *prefixPattern(RedisModuleCtx *ctx, RedisModuleString *prefixname) {
+    size_t prefixlen = 0;
+    const char *prefix = RedisModule_StringPtrLen(prefixname, &prefixlen);
+    char *pattern = RedisModule_Alloc(prefixlen * 2 + 1);
+    size_t len = 0;
+    for (size_t i = 0; i < prefixlen; i++) {
+        if (prefix[i] && strchr("*?[]\\", prefix[i])) {
+            pattern[len++] = '\\';
+        }
+        pattern[len++] = prefix[i];
+    }
+    pattern[len++] = '*';
+    RedisModuleString *s = RedisModule_CreateString(ctx, pattern, len);
+    RedisModule_Free(pattern);
+    return s;
+}
+
+// SCANs for a batch of the keys under a prefix from a cursor, which is updated to the next
+// one, i.e. "0" once the scan is done (or failed)
+// Returns: the SCAN's reply, with the keys as its second element, or NULL if it failed
+RedisModuleCallReply *scanPrefix(RedisModuleCtx *ctx, RedisModuleString *pattern, char *cursor) {
+    RedisModuleCallReply *reply = RedisModule_Call(ctx, "SCAN", "ccscc", cursor, "MATCH", pattern,
+                                                   "COUNT", ZPOP_PREFIX_SCAN_COUNT);
+    size_t len = 0;
+    const char *next = NULL;
+    if (reply && RedisModule_CallReplyLength(reply) == 2) {
+        next = RedisModule_CallReplyStringPtr(RedisModule_CallReplyArrayElement(reply, 0), &len);
+    }
+    if (!next || !len || len >= ZPOP_PREFIX_CURSOR_LEN) {
+        if (reply) {
+            RedisModule_FreeCallReply(reply);
+        }
+        strcpy(cursor, "0");
+        return NULL;
+    }
+    memcpy(cursor, next, len);
+    cursor[len] = '\0';
+    return reply;
+}
+
+void prefixScanFired(RedisModuleCtx *ctx, void *data);
+
+// Has a prefix's unfinished scan go on in the next tick
+void armPrefixScan(RedisModuleCtx *ctx, ZKey_t *zk) {
+    if (!zk->scanarmed) {
+        zk->scanarmed = 1;
+        zkeyRetain(zk);
+        RedisModule_CreateTimer(ctx, 0, prefixScanFired, (void *)zk);
+    }
+}
+
+// A timer callback that goes on with a prefix's unfinished scan for up to
+// ZPOP_PREFIX_SCAN_CALLS calls, serving its clients from the keys it finds
+void prefixScanFired(RedisModuleCtx *ctx, void *data) {
+    ZKey_t *zk = (ZKey_t *)data;
+    zk->scanarmed = 0;
+    if (zk->registered && zk->scancursor[0]) {
+        RedisModule_SelectDb(ctx, dbKeyNameDb(zk->name));
+        RedisModuleString *prefixname = RedisModule_CreateString(ctx,
+            (const char *)zk->name + sizeof(uint32_t), zk->namelen - sizeof(uint32_t));
+        RedisModuleString *pattern = prefixPattern(ctx, prefixname);
+        int calls = 0;
+        while (zkeyWaiters(zk) && strcmp("0", zk->scancursor) && calls++ < ZPOP_PREFIX_SCAN_CALLS) {
+            RedisModuleCallReply *reply = scanPrefix(ctx, pattern, zk->scancursor);
+            if (!reply) {
+                break;
+            }
+            RedisModuleCallReply *keys = RedisModule_CallReplyArrayElement(reply, 1);
+            size_t nkeys = RedisModule_CallReplyLength(keys);
+            for (size_t i = 0; i < nkeys && zkeyWaiters(zk); i++) {
+                RedisModuleString *keyname = RedisModule_CreateStringFromCallReply(RedisModule_CallReplyArrayElement(keys, i));
+                serveKey(ctx, zk, keyname);
+                RedisModule_FreeString(ctx, keyname);
+            }
+            RedisModule_FreeCallReply(reply);
+        }
+
+        // The scan is over once it's done or has no clients left to serve
+        if (zkeyWaiters(zk) && strcmp("0", zk->scancursor)) {
+            armPrefixScan(ctx, zk);
+        } else {
+            zk->scancursor[0] = '\0';
+        }
+        RedisModule_FreeString(ctx, pattern);
+        RedisModule_FreeString(ctx, prefixname);
+    }
+    zkeyRelease(zk);
+}
+
+// Pops from the first non-empty zset under a prefix, found by SCANning for the keys under it
+// from a cursor, for up to ZPOP_PREFIX_SCAN_CALLS calls. Keys that aren't zsets are passed over.
+// Returns: the popped key, with the popped element in 'res', or NULL if nothing was popped,
+// in which case the cursor is "0" if the scan is done
+RedisModuleString *zpopFromPrefix(RedisModuleCtx *ctx, RedisModuleString *prefixname, char *cursor, ZPopRes_t *res) {
+    RedisModuleString *pattern = prefixPattern(ctx, prefixname);
+    RedisModuleString *popped = NULL;
+    ZPopRange_t range;
+    zpopRangeInit(&range, ZPOP_LIST_HEAD);
+    int calls = 0;
+    do {
+        RedisModuleCallReply *reply = scanPrefix(ctx, pattern, cursor);
+        if (!reply) {
+            break;
+        }
+        RedisModuleCallReply *keys = RedisModule_CallReplyArrayElement(reply, 1);
+        size_t nkeys = RedisModule_CallReplyLength(keys);
+        for (size_t i = 0; i < nkeys && !popped; i++) {
+            RedisModuleString *keyname = RedisModule_CreateStringFromCallReply(RedisModule_CallReplyArrayElement(keys, i));
+            serveReadyWaiters(ctx, keyname);
+            ZPopRes_t *rep = ZPop_GenericLowLevelAPI(ctx, keyname, &range, 1, res);
+            if (NULL != rep && popTypeError != rep && res->len) {
+                popped = keyname;
+            } else {
+                RedisModule_FreeString(ctx, keyname);
+            }
+        }
+        RedisModule_FreeCallReply(reply);
+    } while (!popped && strcmp("0", cursor) && ++calls < ZPOP_PREFIX_SCAN_CALLS);
+
+    // Houskeeping
+    RedisModule_FreeString(ctx, pattern);
+
+    return popped;
+}
+
+/* Z.BPOPPREFIX <prefix> <timeout> [FIFO | LIFO | PRIORITY <p>]
+ * Blocks until any zset whose name starts with the prefix, in the selected db, has an element.
+ * The keys it writes to aren't known in advance, so it is not supported in cluster mode.
+ * Reply: array, or nil when the timeout is met. The array consists of the popped
+ * key, the popped element's score and the popped element itself.
+ */
+int BPopPrefix_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    // Verify that the number of arguments is correct
+    if (argc < 3 || argc > 5) {
+        RedisModule_WrongArity(ctx);
+        return REDISMODULE_OK;
+    }
+    if (RedisModule_GetContextFlags(ctx) & REDISMODULE_CTX_FLAGS_CLUSTER) {
+        RedisModule_ReplyWithError(ctx, "ERR Z.BPOPPREFIX is not supported in cluster mode");
+        return REDISMODULE_OK;
+    }
+
+    // Get the waiting policy, that comes after the timeout
+    int policy = ZPOP_WAIT_FIFO;
+    long long priority = 0;
+    if (argc > 3) {
+        const char *opt = RedisModule_StringPtrLen(argv[3], NULL);
+        if (4 == argc && (!strcasecmp("fifo", opt) || !strcasecmp("lifo", opt))) {
+            policy = strcasecmp("fifo", opt) ? ZPOP_WAIT_LIFO : ZPOP_WAIT_FIFO;
+        } else if (5 == argc && !strcasecmp("priority", opt)) {
+            if (REDISMODULE_OK != RedisModule_StringToLongLong(argv[4], &priority)) {
+                RedisModule_ReplyWithError(ctx, "ERR priority must be an integer");
+                return REDISMODULE_OK;
+            }
+            policy = ZPOP_WAIT_PRIORITY;
+        } else {
+            RedisModule_ReplyWithError(ctx, "ERR syntax error");
+            return REDISMODULE_OK;
+        }
+    }
+
+    // Get the timeout from the arguments, and validate it
+    long long timeout = 0;
+    if (REDISMODULE_OK != RedisModule_StringToLongLong(argv[2], &timeout) || timeout < 0) {
+        RedisModule_ReplyWithError(ctx, "timeout must be a positive integer");
+        return REDISMODULE_OK;
+    }
+
+    // Try popping from the keys that already exist, as far as the scan gets
+    ZPopRes_t res;
+    zpopResInit(&res);
+    char cursor[ZPOP_PREFIX_CURSOR_LEN] = "0";
+    RedisModuleString *keyname = zpopFromPrefix(ctx, argv[1], cursor, &res);
+    if (keyname) {
+        res.key = RedisModule_StringPtrLen(keyname, &res.keylen);
+        replyWithPopRes(ctx, &res);
+        zpopResReset(ctx, &res);
+        RedisModule_FreeString(ctx, keyname);
+        return REDISMODULE_OK;
+    }
+
+    // Nothing was popped, so go and block
+    unsigned long long id = RedisModule_GetClientId(ctx);
+    RedisModuleBlockedClient *bc = RedisModule_BlockClient(ctx, BPop_ReturnReply, BPop_Timeout, BPop_FreeData,
+                                                           ZPOP_TIMEOUTS_MODULE == gz.timeouts ? 0 : timeout);
+    RedisModule_SetDisconnectCallback(bc, BPop_Disconnected);
+    BPCtx_t *bpctx = addBlockingClientToPrefix(ctx, argv[1], id, bc, policy, priority);
+
+    // A scan that didn't finish goes on from where it stopped, replacing the prefix's
+    // unfinished one, as the keys it passed are known to be empty
+    if (strcmp("0", cursor)) {
+        memcpy(bpctx->zk->scancursor, cursor, sizeof(cursor));
+        armPrefixScan(ctx, bpctx->zk);
+    }
+    if (ZPOP_TIMEOUTS_MODULE == gz.timeouts) {
+        addBlockingClientDeadline(ctx, bpctx, timeout);
+    }
+    gz.stats[ZPOP_STAT_BLOCKEDCLIENTS]++;
+
+    return REDISMODULE_OK;
+}
+
+/* Z.BPOPBYSCORE <key> <min> <max> <timeout>
+ * Blocks until the zset has an element with a score between min and max.
+ * Reply: array, or nil when the timeout is met. The array consists of the popped
+ * key, the popped element's score and the popped element itself.
+ */
+int BPopByScore_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    // Verify that the number of arguments is correct
+    if (argc != 5) {
+        RedisModule_WrongArity(ctx);
+        return REDISMODULE_OK;
+    }
+
+    // Get the band
+    ZPopRange_t range;
+    zpopRangeInit(&range, ZPOP_LIST_HEAD);
+    if (REDISMODULE_ERR == parseScoreArg(argv[2], &range.min, &range.minex) ||
+        REDISMODULE_ERR == parseScoreArg(argv[3], &range.max, &range.maxex)) {
+        RedisModule_ReplyWithError(ctx, "ERR min or max is not a float");
+        return REDISMODULE_OK;
+    }
+
+    // Get the timeout from the arguments, and validate it
+    long long timeout = 0;
+    if (REDISMODULE_OK != RedisModule_StringToLongLong(argv[4], &timeout) || timeout < 0) {
+        RedisModule_ReplyWithError(ctx, "timeout must be a positive integer");
+        return REDISMODULE_OK;
+    }
+
+    // Try popping from the band, after the key's blocked clients had their turn
+    serveReadyWaiters(ctx, argv[1]);
+    ZPopRes_t res, *rep = ZPop_GenericLowLevelAPI(ctx, argv[1], &range, 1, &res);
+    if (popTypeError == rep) {
+        RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+        return REDISMODULE_OK;
+    }
+
+    // Popped an element, can return with a reply that includes the key
+    if (rep && res.len) {
+        res.key = RedisModule_StringPtrLen(argv[1], &res.keylen);
+        replyWithPopRes(ctx, &res);
+        zpopResReset(ctx, &res);
+        return REDISMODULE_OK;
+    }
+
+    // Nothing was popped, so go and block
+    unsigned long long id = RedisModule_GetClientId(ctx);
+    RedisModuleBlockedClient *bc = RedisModule_BlockClient(ctx, BPop_ReturnReply, BPop_Timeout, BPop_FreeData,
+                                                           ZPOP_TIMEOUTS_MODULE == gz.timeouts ? 0 : timeout);
+    RedisModule_SetDisconnectCallback(bc, BPop_Disconnected);
+    BPCtx_t *bpctx = addBlockingClientToKey(ctx, argv[1], id, bc, ZPOP_LIST_HEAD, NULL, NULL, 0, &range,
+                                            ZPOP_WAIT_FIFO, 0);
+    if (ZPOP_TIMEOUTS_MODULE == gz.timeouts) {
+        addBlockingClientDeadline(ctx, bpctx, timeout);
     }
+    gz.stats[ZPOP_STAT_BLOCKEDCLIENTS]++;
+    gz.stats[ZPOP_STAT_TOTALKEYSBLOCK]++;
 
     return REDISMODULE_OK;
 }
@@ -525,13 +3459,29 @@ int Info_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
     int arrlen = 0;
 
-    replyWithRax(ctx, gz.RK); arrlen++;
-    replyWithRax(ctx, gz.RBC); arrlen++;
+    replyWithRax(ctx, gz.RK, 0); arrlen++;
+    replyWithRax(ctx, gz.RBC, 1); arrlen++;
 
     RedisModule_ReplyWithArray(ctx, 2); arrlen++;
     RedisModule_ReplyWithSimpleString(ctx, "total number of events Z handled");
     RedisModule_ReplyWithLongLong(ctx, gz.stats[ZPOP_STAT_EVENTSHANDLED]);
 
+    RedisModule_ReplyWithArray(ctx, 2); arrlen++;
+    RedisModule_ReplyWithSimpleString(ctx, "total number of events Z's prefilter ruled out");
+    RedisModule_ReplyWithLongLong(ctx, gz.stats[ZPOP_STAT_EVENTSFILTERED]);
+
+    RedisModule_ReplyWithArray(ctx, 2); arrlen++;
+    RedisModule_ReplyWithSimpleString(ctx, "total number of blocked clients Z timed out");
+    RedisModule_ReplyWithLongLong(ctx, gz.stats[ZPOP_STAT_WHEELTIMEOUTS]);
+
+    RedisModule_ReplyWithArray(ctx, 2); arrlen++;
+    RedisModule_ReplyWithSimpleString(ctx, "total timeout skew (in milliseconds) of the blocked clients Z timed out");
+    RedisModule_ReplyWithLongLong(ctx, gz.stats[ZPOP_STAT_WHEELSKEWTOTAL]);
+
+    RedisModule_ReplyWithArray(ctx, 2); arrlen++;
+    RedisModule_ReplyWithSimpleString(ctx, "maximal timeout skew (in milliseconds) of the blocked clients Z timed out");
+    RedisModule_ReplyWithLongLong(ctx, gz.stats[ZPOP_STAT_WHEELSKEWMAX]);
+
     RedisModule_ReplyWithArray(ctx, 2); arrlen++;
     RedisModule_ReplyWithSimpleString(ctx, "total number of clients Z blocked");
     RedisModule_ReplyWithLongLong(ctx, gz.stats[ZPOP_STAT_BLOCKEDCLIENTS]);
@@ -552,19 +3502,95 @@ int Info_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     RedisModule_ReplyWithSimpleString(ctx, "total number of keys Z watched");
     RedisModule_ReplyWithLongLong(ctx, gz.stats[ZPOP_STAT_TOTALKEYSBLOCK]);
 
+    RedisModule_ReplyWithArray(ctx, 2); arrlen++;
+    RedisModule_ReplyWithSimpleString(ctx, "total number of leases Z granted");
+    RedisModule_ReplyWithLongLong(ctx, gz.stats[ZPOP_STAT_LEASESGRANTED]);
+
+    RedisModule_ReplyWithArray(ctx, 2); arrlen++;
+    RedisModule_ReplyWithSimpleString(ctx, "total number of leases Z had acknowledged");
+    RedisModule_ReplyWithLongLong(ctx, gz.stats[ZPOP_STAT_LEASESACKED]);
+
+    RedisModule_ReplyWithArray(ctx, 2); arrlen++;
+    RedisModule_ReplyWithSimpleString(ctx, "total number of expired leases Z returned");
+    RedisModule_ReplyWithLongLong(ctx, gz.stats[ZPOP_STAT_LEASESEXPIRED]);
+
+    RedisModule_ReplyWithArray(ctx, 2); arrlen++;
+    RedisModule_ReplyWithSimpleString(ctx, "total number of due timers Z fired");
+    RedisModule_ReplyWithLongLong(ctx, gz.stats[ZPOP_STAT_DUETIMERSFIRED]);
+
+    RedisModule_ReplyWithArray(ctx, 2); arrlen++;
+    RedisModule_ReplyWithSimpleString(ctx, "total number of times Z served a ready key");
+    RedisModule_ReplyWithLongLong(ctx, gz.stats[ZPOP_STAT_READYKEYSSERVED]);
+
+    RedisModule_ReplyWithArray(ctx, 2); arrlen++;
+    RedisModule_ReplyWithSimpleString(ctx, "total number of popped batches Z replied with");
+    RedisModule_ReplyWithLongLong(ctx, gz.stats[ZPOP_STAT_POPREPLIES]);
+
+    RedisModule_ReplyWithArray(ctx, 2); arrlen++;
+    RedisModule_ReplyWithSimpleString(ctx, "total number of allocations Z made for popped batches");
+    RedisModule_ReplyWithLongLong(ctx, gz.stats[ZPOP_STAT_POPALLOCS]);
+
+    RedisModule_ReplyWithArray(ctx, 2); arrlen++;
+    RedisModule_ReplyWithSimpleString(ctx, "total number of pooled allocations Z reused");
+    RedisModule_ReplyWithLongLong(ctx, gz.pool.hits);
+
+    RedisModule_ReplyWithArray(ctx, 2); arrlen++;
+    RedisModule_ReplyWithSimpleString(ctx, "total number of pooled allocations Z made");
+    RedisModule_ReplyWithLongLong(ctx, gz.pool.misses);
+
+    RedisModule_ReplyWithArray(ctx, 2); arrlen++;
+    RedisModule_ReplyWithSimpleString(ctx, "total number of pooled allocations Z trimmed");
+    RedisModule_ReplyWithLongLong(ctx, gz.pool.trimmed);
+
+    long long inuse = 0;
+    for (int i = 0; i < POOL_CLASSES; i++) {
+        inuse += (long long)gz.pool.inuse[i];
+    }
+    RedisModule_ReplyWithArray(ctx, 2); arrlen++;
+    RedisModule_ReplyWithSimpleString(ctx, "number of pooled allocations Z has in use");
+    RedisModule_ReplyWithLongLong(ctx, inuse);
+
+    RedisModule_ReplyWithArray(ctx, 2); arrlen++;
+    RedisModule_ReplyWithSimpleString(ctx, "number of bytes Z keeps pooled for reuse");
+    RedisModule_ReplyWithLongLong(ctx, (long long)poolCachedBytes(&gz.pool));
+
     RedisModule_ReplySetArrayLength(ctx, arrlen);
 
     return REDISMODULE_OK;
 }
 
 int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    REDISMODULE_NOT_USED(argv);
-    REDISMODULE_NOT_USED(argc);
-
     // Register the module
     if (RedisModule_Init(ctx,"ZePOP", 1, REDISMODULE_APIVER_1)
         == REDISMODULE_ERR) return REDISMODULE_ERR;
 
+    // Parse the module's arguments
+    gz.dblscores = 0;
+    gz.timeouts = ZPOP_TIMEOUTS_SERVER;
+    for (int i = 0; i < argc; i++) {
+        const char *arg = RedisModule_StringPtrLen(argv[i], NULL);
+        if (!strcasecmp("scores", arg) && i + 1 < argc) {
+            const char *val = RedisModule_StringPtrLen(argv[++i], NULL);
+            if (!strcasecmp("double", val)) {
+                gz.dblscores = 1;
+            } else if (strcasecmp("shortest", val)) {
+                RedisModule_Log(ctx, "warning", "Ze POP module: invalid SCORES value '%s'", val);
+                return REDISMODULE_ERR;
+            }
+        } else if (!strcasecmp("timeouts", arg) && i + 1 < argc) {
+            const char *val = RedisModule_StringPtrLen(argv[++i], NULL);
+            if (!strcasecmp("module", val)) {
+                gz.timeouts = ZPOP_TIMEOUTS_MODULE;
+            } else if (strcasecmp("server", val)) {
+                RedisModule_Log(ctx, "warning", "Ze POP module: invalid TIMEOUTS value '%s'", val);
+                return REDISMODULE_ERR;
+            }
+        } else {
+            RedisModule_Log(ctx, "warning", "Ze POP module: unknown argument '%s'", arg);
+            return REDISMODULE_ERR;
+        }
+    }
+
     // Register the commands
     if (RedisModule_CreateCommand(ctx,"z.info",
         Info_RedisCommand,"readonly",0,0,0) == REDISMODULE_ERR)
@@ -578,6 +3604,50 @@ int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
         Pop_RedisCommand,"write",1,1,1) == REDISMODULE_ERR)
         return REDISMODULE_ERR;
 
+    if (RedisModule_CreateCommand(ctx,"z.popbyscore",
+        PopByScore_RedisCommand,"write",1,1,1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx,"z.revpopbyscore",
+        PopByScore_RedisCommand,"write",1,1,1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx,"z.popbylex",
+        PopByLex_RedisCommand,"write",1,1,1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx,"z.revpopbylex",
+        PopByLex_RedisCommand,"write",1,1,1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx,"z.poprandom",
+        PopRandom_RedisCommand,"write random",1,1,1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx,"z.drain",
+        Drain_RedisCommand,"write",1,1,1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx,"z.mpop",
+        MPop_RedisCommand,"write",4,-1,1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx,"z.poplease",
+        PopLease_RedisCommand,"write",1,1,1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx,"z.ack",
+        Ack_RedisCommand,"write",1,1,1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx,"z.popstore",
+        PopStore_RedisCommand,"write",1,2,1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx,"z.bpopstore",
+        BPopStore_RedisCommand,"write",1,2,1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
     if (RedisModule_CreateCommand(ctx,"z.bpop",
         BPop_RedisCommand,"write getkeys-api",1,1,1) == REDISMODULE_ERR)
         return REDISMODULE_ERR;
@@ -586,15 +3656,47 @@ int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
         BPop_RedisCommand,"write getkeys-api",1,1,1) == REDISMODULE_ERR)
         return REDISMODULE_ERR;
 
+    if (RedisModule_CreateCommand(ctx,"z.bpopdue",
+        BPop_RedisCommand,"write getkeys-api",1,1,1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx,"z.bpopbyscore",
+        BPopByScore_RedisCommand,"write",1,1,1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx,"z.bpopprefix",
+        BPopPrefix_RedisCommand,"write",0,0,0) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
     // Initialize the globals
     popTypeError = (void*)"ze-pop-type-error-special-pointer-426144";
     gz.RK = raxNew();
     gz.RBC = raxNew();
+    gz.RL = raxNew();
+    gz.RDT = raxNew();
+    gz.RP = raxNew();
+    gz.prefixlens = NULL;
+    gz.prefixlenrefs = NULL;
+    gz.nprefixlens = 0;
+    gz.reapfrom = NULL;
+    gz.reapfromlen = 0;
+    gz.bpseq = 0;
+    gz.filter = RedisModule_Calloc(1 << ZPOP_FILTER_BITS, sizeof(uint8_t));
+    listInit(&gz.ready);
+    wheelInit(&gz.wheel, (long long)RedisModule_Milliseconds());
+    gz.wheeltick = -1;
+    gz.readyarmed = 0;
+    poolInit(&gz.pool);
+    srand48((long)RedisModule_Milliseconds());
     gz.stats = RedisModule_Alloc(sizeof(long long) * ZPOP_STAT_meta_last);
     for (int i = 0; i < ZPOP_STAT_meta_last; i++) {
         gz.stats[i] = 0;
     }
 
+    // Start reaping expired leases, and trimming the pool
+    RedisModule_CreateTimer(ctx, ZPOP_REAPER_PERIOD, leaseReaper, NULL);
+    RedisModule_CreateTimer(ctx, ZPOP_POOL_TRIM_PERIOD, poolTrimmer, NULL);
+
     // Register the keyspace notifications handler
     int mask = (REDISMODULE_NOTIFY_GENERIC | REDISMODULE_NOTIFY_ZSET);
     RedisModule_SubscribeToKeyspaceEvents(ctx, mask, keySpaceEventsHandler);
@@ -1,7 +1,14 @@
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <math.h>
 
 #define REDISMODULE_EXPERIMENTAL_API 3 
 #include "redismodule.h"
 #include "rax.h"
-#include "list.h"
\ No newline at end of file
+#include "list.h"
+#include "heap.h"
+#include "pool.h"
+#include "wheel.h"
+#include "grisu.h"
\ No newline at end of file
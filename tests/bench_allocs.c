@@ -0,0 +1,61 @@
+#include "host.h"
+#include <stdio.h>
+
+// Measures the module's allocations per pop, for comparing revisions of it: the same
+// program is linked with each revision's sources, see the Makefile's bench target
+
+#define OPS 10000
+
+static void fill(const char *key, int n) {
+    char score[32], member[32];
+    for (int i = 0; i < n; i++) {
+        snprintf(score, sizeof(score), "%d", i);
+        snprintf(member, sizeof(member), "m%d", i);
+        hostReplyFree(hostRun(1, "ZADD", key, score, member, NULL));
+    }
+}
+
+// Z.POP of a single element
+static double benchPop(void) {
+    fill("q", OPS);
+    long long before = hostModuleAllocs;
+    for (int i = 0; i < OPS; i++) {
+        hostReplyFree(hostRun(2, "Z.POP", "q", NULL));
+    }
+    return (double)(hostModuleAllocs - before) / OPS;
+}
+
+// Z.BPOP of a key that has elements, so it pops right away
+static double benchBPopNow(void) {
+    fill("q", OPS);
+    long long before = hostModuleAllocs;
+    for (int i = 0; i < OPS; i++) {
+        hostReplyFree(hostRun(2, "Z.BPOP", "q", "0", NULL));
+    }
+    return (double)(hostModuleAllocs - before) / OPS;
+}
+
+// Z.BPOP of an empty key, that blocks and is served once an element is added
+// The count takes in everything: blocking, the add's event, serving and replying.
+static double benchBPopBlocked(void) {
+    long long allocs = 0;
+    for (int i = 0; i < OPS; i++) {
+        long long before = hostModuleAllocs;
+        hostRun(2, "Z.BPOP", "q", "0", NULL);
+        hostReplyFree(hostRun(1, "ZADD", "q", "1", "m", NULL));
+        hostAdvance(0);
+        allocs += hostModuleAllocs - before;
+        hostReplyFree(hostTakeReply(2));
+    }
+    return (double)allocs / OPS;
+}
+
+int main(int argc, char **argv) {
+    hostLoad(NULL);
+    const char *name = argc > 1 ? argv[1] : "module";
+    printf("%s: allocations per op (%d ops each)\n", name, OPS);
+    printf("  Z.POP:                      %.2f\n", benchPop());
+    printf("  Z.BPOP, popped right away:  %.2f\n", benchBPopNow());
+    printf("  Z.BPOP, served after block: %.2f\n", benchBPopBlocked());
+    return 0;
+}
@@ -0,0 +1,91 @@
+#include "host.h"
+#include <stdio.h>
+#include <time.h>
+
+// Measures the cost of a keyspace event of a write to a key that no client blocks on,
+// without and with the module loaded, for comparing revisions of it: the same program is
+// linked with each revision's sources, see the Makefile's bench target
+
+#define EVENTS 1000000
+#define KEYS 4096
+#define WATCHED 1000
+#define RUNS 11
+
+static char keys[KEYS][32];
+
+static double nowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+// Names the keys that events are fired for, e.g. "cache:%d" from 'first' on
+static void nameKeys(const char *fmt, int first) {
+    for (int i = 0; i < KEYS; i++) {
+        snprintf(keys[i], sizeof(keys[i]), fmt, first + i);
+    }
+}
+
+// Fires zadd events for the keys, the best of a few runs
+// Returns: nanoseconds per event
+static double benchEvents(void) {
+    double best = 0;
+    for (int r = 0; r < RUNS; r++) {
+        double start = nowNs();
+        for (int i = 0; i < EVENTS; i++) {
+            hostNotify(REDISMODULE_NOTIFY_ZSET, "zadd", 0, keys[i % KEYS]);
+        }
+        double ns = (nowNs() - start) / EVENTS;
+        if (!r || ns < best) {
+            best = ns;
+        }
+    }
+    return best;
+}
+
+// Gets a counter from Z.INFO by its description
+// Returns: the counter, or -1 if the module doesn't have it
+static long long infoCounter(const char *desc) {
+    hostReply_t *r = hostRun(1, "Z.INFO", NULL);
+    long long val = -1;
+    for (size_t i = 0; r && i < r->nelements; i++) {
+        hostReply_t *pair = r->elements[i];
+        if (REDISMODULE_REPLY_ARRAY == pair->type && 2 == pair->nelements &&
+            pair->elements[0]->str && !strcmp(desc, pair->elements[0]->str)) {
+            val = pair->elements[1]->ll;
+        }
+    }
+    hostReplyFree(r);
+    return val;
+}
+
+int main(int argc, char **argv) {
+    const char *name = argc > 1 ? argv[1] : "module";
+    printf("%s: ns per event of a key no client blocks on (%d events, best of %d)\n", name, EVENTS, RUNS);
+
+    nameKeys("cache:%d", 0);
+    printf("  unloaded:                             %6.1f\n", benchEvents());
+
+    hostLoad(NULL);
+    printf("  loaded, no key watched:               %6.1f\n", benchEvents());
+
+    char key[32];
+    for (int i = 0; i < WATCHED; i++) {
+        snprintf(key, sizeof(key), "queue:%d", i);
+        hostRun(1000 + (unsigned long long)i, "Z.BPOP", key, "0", NULL);
+    }
+    long long filtered = infoCounter("total number of events Z's prefilter ruled out");
+    printf("  loaded, %d watched, unrelated keys:  %6.1f\n", WATCHED, benchEvents());
+    nameKeys("queue:%d", 1000000);
+    printf("  loaded, %d watched, same prefix:     %6.1f\n", WATCHED, benchEvents());
+    if (filtered >= 0) {
+        long long events = 2LL * EVENTS * RUNS;
+        filtered = infoCounter("total number of events Z's prefilter ruled out") - filtered;
+        printf("  prefilter false positives:            %5.2f%%\n", 100.0 * (double)(events - filtered) / events);
+    }
+
+    for (int i = 0; i < WATCHED; i++) {
+        hostDisconnect(1000 + (unsigned long long)i);
+    }
+    return 0;
+}
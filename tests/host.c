@@ -0,0 +1,1796 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <errno.h>
+#include <math.h>
+#include <ctype.h>
+#include "host.h"
+
+// A fake, in-process Redis for the module to be loaded into, see host.h
+// Everything is kept as simple as it gets (sorted arrays and linked lists), as the tests
+// care about what the module does and not about how fast the host is. The host's own
+// allocations are plain mallocs, so that only the module's are counted.
+
+#define HOST_DBS 16
+#define HOST_STACK_DEPTH 64
+
+long long hostModuleAllocs = 0;
+long long hostReplicated = 0;
+char hostLastReplicated[1024];
+
+int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc);
+
+/* ------------------------------------------------------------------------------------- */
+/* Strings, values and dbs                                                               */
+/* ------------------------------------------------------------------------------------- */
+
+struct RedisModuleString {
+    char *ptr;
+    size_t len;
+};
+
+typedef struct {
+    double score;
+    char *ele;
+    size_t len;
+} zitem_t;
+
+typedef struct {
+    char *field;
+    size_t flen;
+    char *val;
+    size_t vlen;
+} hitem_t;
+
+typedef struct {
+    int type;                       // REDISMODULE_KEYTYPE_ZSET, _HASH or _STRING
+    zitem_t *z;                     // A zset's elements, by score and then element
+    size_t zlen, zcap;
+    hitem_t *h;                     // A hash's fields
+    size_t hlen;
+    char *s;                        // A string's value
+    size_t slen;
+} value_t;
+
+typedef struct {
+    char *name;
+    size_t len;
+    value_t *val;
+} entry_t;
+
+// A db's keys are kept sorted by name, which SCAN's cursor is an index into
+typedef struct {
+    entry_t *e;
+    size_t len, cap;
+} db_t;
+
+static db_t dbs[HOST_DBS];
+static long long now = 1700000000000LL;
+static int ctxflags = REDISMODULE_CTX_FLAGS_MASTER;
+
+static char *memdup(const char *p, size_t len) {
+    char *d = malloc(len + 1);
+    memcpy(d, p, len);
+    d[len] = '\0';
+    return d;
+}
+
+static int bufcmp(const char *a, size_t alen, const char *b, size_t blen) {
+    int cmp = memcmp(a, b, alen < blen ? alen : blen);
+    if (cmp) {
+        return cmp;
+    }
+    return (alen < blen) ? -1 : (alen > blen);
+}
+
+static RedisModuleString *newString(const char *p, size_t len) {
+    RedisModuleString *s = malloc(sizeof(*s));
+    s->ptr = memdup(p, len);
+    s->len = len;
+    return s;
+}
+
+static void freeString(RedisModuleString *s) {
+    if (s) {
+        free(s->ptr);
+        free(s);
+    }
+}
+
+// Finds a key's position in a db, or where it would be inserted
+static size_t dbSeek(db_t *db, const char *name, size_t len, int *found) {
+    size_t lo = 0, hi = db->len;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        int cmp = bufcmp(db->e[mid].name, db->e[mid].len, name, len);
+        if (!cmp) {
+            *found = 1;
+            return mid;
+        }
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    *found = 0;
+    return lo;
+}
+
+static value_t *dbLookup(int db, const char *name, size_t len) {
+    int found;
+    size_t i = dbSeek(&dbs[db], name, len, &found);
+    return found ? dbs[db].e[i].val : NULL;
+}
+
+static void valueFree(value_t *v) {
+    for (size_t i = 0; i < v->zlen; i++) {
+        free(v->z[i].ele);
+    }
+    for (size_t i = 0; i < v->hlen; i++) {
+        free(v->h[i].field);
+        free(v->h[i].val);
+    }
+    free(v->z);
+    free(v->h);
+    free(v->s);
+    free(v);
+}
+
+static value_t *dbCreate(int db, const char *name, size_t len, int type) {
+    db_t *d = &dbs[db];
+    int found;
+    size_t i = dbSeek(d, name, len, &found);
+    value_t *v = calloc(1, sizeof(value_t));
+    v->type = type;
+    if (found) {
+        valueFree(d->e[i].val);
+        d->e[i].val = v;
+        return v;
+    }
+    if (d->len == d->cap) {
+        d->cap = d->cap ? d->cap * 2 : 16;
+        d->e = realloc(d->e, sizeof(entry_t) * d->cap);
+    }
+    memmove(&d->e[i + 1], &d->e[i], sizeof(entry_t) * (d->len - i));
+    d->e[i].name = memdup(name, len);
+    d->e[i].len = len;
+    d->e[i].val = v;
+    d->len++;
+    return v;
+}
+
+static int dbDelete(int db, const char *name, size_t len) {
+    db_t *d = &dbs[db];
+    int found;
+    size_t i = dbSeek(d, name, len, &found);
+    if (!found) {
+        return 0;
+    }
+    valueFree(d->e[i].val);
+    free(d->e[i].name);
+    memmove(&d->e[i], &d->e[i + 1], sizeof(entry_t) * (d->len - i - 1));
+    d->len--;
+    return 1;
+}
+
+static int zitemCmp(double score, const char *ele, size_t len, const zitem_t *it) {
+    if (score != it->score) {
+        return score < it->score ? -1 : 1;
+    }
+    return bufcmp(ele, len, it->ele, it->len);
+}
+
+static long zsetFind(value_t *v, const char *ele, size_t len) {
+    for (size_t i = 0; i < v->zlen; i++) {
+        if (!bufcmp(v->z[i].ele, v->z[i].len, ele, len)) {
+            return (long)i;
+        }
+    }
+    return -1;
+}
+
+static void zsetRemoveAt(value_t *v, size_t i) {
+    free(v->z[i].ele);
+    memmove(&v->z[i], &v->z[i + 1], sizeof(zitem_t) * (v->zlen - i - 1));
+    v->zlen--;
+}
+
+// Adds or updates an element
+// Returns: 1 if added, 0 if updated
+static int zsetAdd(value_t *v, double score, const char *ele, size_t len) {
+    long at = zsetFind(v, ele, len);
+    int added = (at < 0);
+    if (!added) {
+        zsetRemoveAt(v, (size_t)at);
+    }
+    size_t i = 0;
+    while (i < v->zlen && zitemCmp(score, ele, len, &v->z[i]) > 0) {
+        i++;
+    }
+    if (v->zlen == v->zcap) {
+        v->zcap = v->zcap ? v->zcap * 2 : 8;
+        v->z = realloc(v->z, sizeof(zitem_t) * v->zcap);
+    }
+    memmove(&v->z[i + 1], &v->z[i], sizeof(zitem_t) * (v->zlen - i));
+    v->z[i].score = score;
+    v->z[i].ele = memdup(ele, len);
+    v->z[i].len = len;
+    v->zlen++;
+    return added;
+}
+
+static hitem_t *hashFind(value_t *v, const char *field, size_t flen) {
+    for (size_t i = 0; i < v->hlen; i++) {
+        if (!bufcmp(v->h[i].field, v->h[i].flen, field, flen)) {
+            return &v->h[i];
+        }
+    }
+    return NULL;
+}
+
+/* ------------------------------------------------------------------------------------- */
+/* Replies                                                                               */
+/* ------------------------------------------------------------------------------------- */
+
+struct RedisModuleCallReply {
+    hostReply_t r;
+};
+
+static hostReply_t *replyNew(int type) {
+    hostReply_t *r = calloc(1, sizeof(hostReply_t));
+    r->type = type;
+    return r;
+}
+
+static hostReply_t *replyString(int type, const char *p, size_t len) {
+    hostReply_t *r = replyNew(type);
+    r->str = memdup(p, len);
+    r->len = len;
+    return r;
+}
+
+static hostReply_t *replyInteger(long long ll) {
+    hostReply_t *r = replyNew(REDISMODULE_REPLY_INTEGER);
+    r->ll = ll;
+    return r;
+}
+
+static hostReply_t *replyArray(size_t n) {
+    hostReply_t *r = replyNew(REDISMODULE_REPLY_ARRAY);
+    r->elements = calloc(n ? n : 1, sizeof(hostReply_t *));
+    r->expected = (long)n;
+    return r;
+}
+
+static hostReply_t *replyScore(double score) {
+    char buf[64];
+    int len = snprintf(buf, sizeof(buf), "%.17g", score);
+    return replyString(REDISMODULE_REPLY_STRING, buf, (size_t)len);
+}
+
+static void replyAppend(hostReply_t *arr, hostReply_t *r) {
+    arr->elements = realloc(arr->elements, sizeof(hostReply_t *) * (arr->nelements + 1));
+    arr->elements[arr->nelements++] = r;
+}
+
+void hostReplyFree(hostReply_t *r) {
+    if (!r) {
+        return;
+    }
+    for (size_t i = 0; i < r->nelements; i++) {
+        hostReplyFree(r->elements[i]);
+    }
+    free(r->elements);
+    free(r->str);
+    free(r);
+}
+
+int hostReplyIsNull(const hostReply_t *r) {
+    return r && REDISMODULE_REPLY_NULL == r->type;
+}
+
+int hostReplyIsError(const hostReply_t *r, const char *prefix) {
+    return r && REDISMODULE_REPLY_ERROR == r->type && !strncmp(r->str, prefix, strlen(prefix));
+}
+
+int hostReplyIsInteger(const hostReply_t *r, long long ll) {
+    return r && REDISMODULE_REPLY_INTEGER == r->type && r->ll == ll;
+}
+
+int hostReplyIsStrings(const hostReply_t *r, ...) {
+    if (!r || REDISMODULE_REPLY_ARRAY != r->type) {
+        return 0;
+    }
+    va_list ap;
+    va_start(ap, r);
+    size_t i = 0;
+    const char *s;
+    int match = 1;
+    while ((s = va_arg(ap, const char *))) {
+        if (i >= r->nelements || !r->elements[i]->str || strcmp(s, r->elements[i]->str)) {
+            match = 0;
+            break;
+        }
+        i++;
+    }
+    va_end(ap);
+    return match && i == r->nelements;
+}
+
+/* ------------------------------------------------------------------------------------- */
+/* Contexts, clients, blocked clients and timers                                         */
+/* ------------------------------------------------------------------------------------- */
+
+typedef struct client {
+    unsigned long long id;
+    RedisModuleBlockedClient *bc;   // The client's blocked client handle, while it's blocked
+    hostReply_t *pending;           // The reply it got when it was unblocked, until taken
+    struct client *next;
+} client_t;
+
+struct RedisModuleBlockedClient {
+    client_t *c;
+    RedisModuleCmdFunc reply_cb;
+    RedisModuleCmdFunc timeout_cb;
+    void (*free_privdata)(RedisModuleCtx *, void *);
+    RedisModuleDisconnectFunc disconnect_cb;
+    long long deadline;             // When it times out, or 0 for never
+    void *privdata;
+    int unblocked;                  // Was it unblocked by the module (and yet to be replied to)
+    int dead;                       // Was it done with, so the module mustn't touch it anymore
+    int db;
+    RedisModuleString **argv;
+    int argc;
+    struct RedisModuleBlockedClient *next;
+};
+
+struct RedisModuleCtx {
+    void *getapi;                   // Must come first, as RedisModule_Init looks for it there
+    int db;
+    client_t *c;
+    hostReply_t *reply;             // The reply, once started
+    hostReply_t *stack[HOST_STACK_DEPTH];   // The arrays that are being replied with
+    int depth;
+    void *privdata;                 // The privdata of the blocked client being replied to
+    RedisModuleBlockedClient *bc;   // The client's blocked client handle, if it blocked
+};
+
+typedef struct timer {
+    RedisModuleTimerID id;
+    long long when;
+    RedisModuleTimerProc cb;
+    void *data;
+    struct timer *next;
+} timer_t_;
+
+typedef struct command {
+    char *name;
+    RedisModuleCmdFunc fn;
+    struct command *next;
+} command_t;
+
+static client_t *clients = NULL;
+static RedisModuleBlockedClient *bcs = NULL;
+static timer_t_ *timers = NULL;
+static RedisModuleTimerID timerseq = 0;
+static command_t *commands = NULL;
+static RedisModuleNotificationFunc notifycb = NULL;
+static int notifytypes = 0;
+
+static int hostGetApi(const char *name, void *ptr);
+
+static client_t *clientGet(unsigned long long id) {
+    client_t *c;
+    for (c = clients; c; c = c->next) {
+        if (c->id == id) {
+            return c;
+        }
+    }
+    c = calloc(1, sizeof(client_t));
+    c->id = id;
+    c->next = clients;
+    clients = c;
+    return c;
+}
+
+static void ctxInit(RedisModuleCtx *ctx, client_t *c, int db) {
+    ctx->getapi = (void *)(unsigned long)hostGetApi;
+    ctx->db = db;
+    ctx->c = c;
+    ctx->reply = NULL;
+    ctx->depth = 0;
+    ctx->privdata = NULL;
+    ctx->bc = NULL;
+}
+
+static RedisModuleCtx *ctxNew(client_t *c, int db) {
+    RedisModuleCtx *ctx = malloc(sizeof(RedisModuleCtx));
+    ctxInit(ctx, c, db);
+    return ctx;
+}
+
+// Frees a context, handing its reply to the caller
+static hostReply_t *ctxFree(RedisModuleCtx *ctx) {
+    hostReply_t *r = ctx->reply;
+    if (ctx->depth) {
+        fprintf(stderr, "host: a reply's array wasn't completed\n");
+        abort();
+    }
+    free(ctx);
+    return r;
+}
+
+static int ctxReply(RedisModuleCtx *ctx, hostReply_t *r) {
+    if (!ctx->depth) {
+        if (ctx->reply) {
+            fprintf(stderr, "host: the module replied twice\n");
+            abort();
+        }
+        ctx->reply = r;
+    } else {
+        replyAppend(ctx->stack[ctx->depth - 1], r);
+    }
+    if (REDISMODULE_REPLY_ARRAY == r->type && r->expected) {
+        ctx->stack[ctx->depth++] = r;
+    }
+    while (ctx->depth) {
+        hostReply_t *top = ctx->stack[ctx->depth - 1];
+        if (top->expected < 0 || (long)top->nelements < top->expected) {
+            break;
+        }
+        ctx->depth--;
+    }
+    return REDISMODULE_OK;
+}
+
+static void notify(int type, const char *event, int db, RedisModuleString *key) {
+    // On a context on the stack, like the server's
+    if (notifycb && (notifytypes & type)) {
+        RedisModuleCtx ctx;
+        ctxInit(&ctx, NULL, db);
+        notifycb(&ctx, type, event, key);
+        hostReplyFree(ctx.reply);
+    }
+}
+
+int hostNotify(int type, const char *event, int db, const char *key) {
+    if (!notifycb || !(notifytypes & type)) {
+        return 0;
+    }
+    RedisModuleString k = {(char *)key, strlen(key)};
+    notify(type, event, db, &k);
+    return 1;
+}
+
+/* ------------------------------------------------------------------------------------- */
+/* Native commands                                                                       */
+/* ------------------------------------------------------------------------------------- */
+
+static int parseLongLong(const char *p, size_t len, long long *ll) {
+    if (!len || len > 20 || (!isdigit((unsigned char)p[0]) && '-' != p[0])) {
+        return 0;
+    }
+    char buf[32], *end;
+    memcpy(buf, p, len);
+    buf[len] = '\0';
+    errno = 0;
+    *ll = strtoll(buf, &end, 10);
+    return !errno && *end == '\0';
+}
+
+static int parseDouble(const char *p, size_t len, double *d) {
+    if (!len || len > 300 || isspace((unsigned char)p[0])) {
+        return 0;
+    }
+    char buf[320], *end;
+    memcpy(buf, p, len);
+    buf[len] = '\0';
+    *d = strtod(buf, &end);
+    return *end == '\0' && !isnan(*d);
+}
+
+// Matches a glob-style pattern, like Redis' stringmatchlen
+static int globMatch(const char *p, size_t plen, const char *s, size_t slen) {
+    while (plen) {
+        switch (p[0]) {
+        case '*':
+            while (plen > 1 && '*' == p[1]) {
+                p++;
+                plen--;
+            }
+            if (1 == plen) {
+                return 1;
+            }
+            for (size_t i = 0; i <= slen; i++) {
+                if (globMatch(p + 1, plen - 1, s + i, slen - i)) {
+                    return 1;
+                }
+            }
+            return 0;
+        case '?':
+            if (!slen) {
+                return 0;
+            }
+            s++;
+            slen--;
+            break;
+        case '[': {
+            p++;
+            plen--;
+            int not = (plen && '^' == p[0]);
+            if (not) {
+                p++;
+                plen--;
+            }
+            int match = 0;
+            while (plen && ']' != p[0]) {
+                if ('\\' == p[0] && plen >= 2) {
+                    p++;
+                    plen--;
+                    match |= (slen && p[0] == s[0]);
+                } else if (plen >= 3 && '-' == p[1]) {
+                    char lo = p[0] < p[2] ? p[0] : p[2], hi = p[0] < p[2] ? p[2] : p[0];
+                    match |= (slen && s[0] >= lo && s[0] <= hi);
+                    p += 2;
+                    plen -= 2;
+                } else {
+                    match |= (slen && p[0] == s[0]);
+                }
+                p++;
+                plen--;
+            }
+            if (!slen || match == not) {
+                return 0;
+            }
+            s++;
+            slen--;
+            break;
+        }
+        case '\\':
+            if (plen >= 2) {
+                p++;
+                plen--;
+            }
+            /* fall through */
+        default:
+            if (!slen || p[0] != s[0]) {
+                return 0;
+            }
+            s++;
+            slen--;
+            break;
+        }
+        p++;
+        plen--;
+    }
+    return !slen;
+}
+
+static const char *typeName(value_t *v) {
+    if (!v) {
+        return "none";
+    }
+    switch (v->type) {
+    case REDISMODULE_KEYTYPE_ZSET: return "zset";
+    case REDISMODULE_KEYTYPE_HASH: return "hash";
+    default: return "string";
+    }
+}
+
+#define ARG(i) argv[i]->ptr, argv[i]->len
+#define WRONGTYPE replyString(REDISMODULE_REPLY_ERROR, REDISMODULE_ERRORMSG_WRONGTYPE, strlen(REDISMODULE_ERRORMSG_WRONGTYPE))
+#define SYNTAXERR(msg) replyString(REDISMODULE_REPLY_ERROR, msg, strlen(msg))
+
+static hostReply_t *nativeCommand(int db, RedisModuleString **argv, int argc) {
+    const char *cmd = argv[0]->ptr;
+    if (!strcasecmp("zadd", cmd)) {
+        if (argc < 4 || argc % 2) {
+            return SYNTAXERR("ERR wrong number of arguments");
+        }
+        value_t *v = dbLookup(db, ARG(1));
+        if (v && REDISMODULE_KEYTYPE_ZSET != v->type) {
+            return WRONGTYPE;
+        }
+        for (int i = 2; i < argc; i += 2) {
+            double score;
+            if (!parseDouble(ARG(i), &score)) {
+                return SYNTAXERR("ERR value is not a valid float");
+            }
+        }
+        if (!v) {
+            v = dbCreate(db, ARG(1), REDISMODULE_KEYTYPE_ZSET);
+        }
+        long long added = 0;
+        for (int i = 2; i < argc; i += 2) {
+            double score;
+            parseDouble(ARG(i), &score);
+            added += zsetAdd(v, score, ARG(i + 1));
+        }
+        notify(REDISMODULE_NOTIFY_ZSET, "zadd", db, argv[1]);
+        return replyInteger(added);
+    }
+    if (!strcasecmp("zrem", cmd)) {
+        if (argc < 3) {
+            return SYNTAXERR("ERR wrong number of arguments");
+        }
+        value_t *v = dbLookup(db, ARG(1));
+        if (!v) {
+            return replyInteger(0);
+        }
+        if (REDISMODULE_KEYTYPE_ZSET != v->type) {
+            return WRONGTYPE;
+        }
+        long long removed = 0;
+        for (int i = 2; i < argc; i++) {
+            long at = zsetFind(v, ARG(i));
+            if (at >= 0) {
+                zsetRemoveAt(v, (size_t)at);
+                removed++;
+            }
+        }
+        if (removed) {
+            notify(REDISMODULE_NOTIFY_ZSET, "zrem", db, argv[1]);
+            if (!v->zlen) {
+                dbDelete(db, ARG(1));
+                notify(REDISMODULE_NOTIFY_GENERIC, "del", db, argv[1]);
+            }
+        }
+        return replyInteger(removed);
+    }
+    if (!strcasecmp("zcard", cmd) && 2 == argc) {
+        value_t *v = dbLookup(db, ARG(1));
+        if (v && REDISMODULE_KEYTYPE_ZSET != v->type) {
+            return WRONGTYPE;
+        }
+        return replyInteger(v ? (long long)v->zlen : 0);
+    }
+    if (!strcasecmp("zscore", cmd) && 3 == argc) {
+        value_t *v = dbLookup(db, ARG(1));
+        if (v && REDISMODULE_KEYTYPE_ZSET != v->type) {
+            return WRONGTYPE;
+        }
+        long at = v ? zsetFind(v, ARG(2)) : -1;
+        return (at < 0) ? replyNew(REDISMODULE_REPLY_NULL) : replyScore(v->z[at].score);
+    }
+    if ((!strcasecmp("zrange", cmd) || !strcasecmp("zrevrange", cmd)) && (4 == argc || 5 == argc)) {
+        long long start, stop;
+        int withscores = (5 == argc && !strcasecmp("withscores", argv[4]->ptr));
+        if (!parseLongLong(ARG(2), &start) || !parseLongLong(ARG(3), &stop) || (5 == argc && !withscores)) {
+            return SYNTAXERR("ERR syntax error");
+        }
+        value_t *v = dbLookup(db, ARG(1));
+        if (v && REDISMODULE_KEYTYPE_ZSET != v->type) {
+            return WRONGTYPE;
+        }
+        long long len = v ? (long long)v->zlen : 0;
+        if (start < 0) start += len;
+        if (stop < 0) stop += len;
+        if (start < 0) start = 0;
+        if (stop >= len) stop = len - 1;
+        hostReply_t *r = replyArray(0);
+        for (long long i = start; i <= stop; i++) {
+            zitem_t *it = &v->z[!strcasecmp("zrange", cmd) ? i : len - 1 - i];
+            replyAppend(r, replyString(REDISMODULE_REPLY_STRING, it->ele, it->len));
+            if (withscores) {
+                replyAppend(r, replyScore(it->score));
+            }
+        }
+        return r;
+    }
+    if (!strcasecmp("type", cmd) && 2 == argc) {
+        const char *t = typeName(dbLookup(db, ARG(1)));
+        return replyString(REDISMODULE_REPLY_STRING, t, strlen(t));
+    }
+    if (!strcasecmp("scan", cmd) && argc >= 2) {
+        long long cursor, count = 10;
+        RedisModuleString *pattern = NULL;
+        if (!parseLongLong(ARG(1), &cursor) || cursor < 0) {
+            return SYNTAXERR("ERR invalid cursor");
+        }
+        for (int i = 2; i + 1 < argc; i += 2) {
+            if (!strcasecmp("match", argv[i]->ptr)) {
+                pattern = argv[i + 1];
+            } else if (!strcasecmp("count", argv[i]->ptr)) {
+                parseLongLong(ARG(i + 1), &count);
+            } else {
+                return SYNTAXERR("ERR syntax error");
+            }
+        }
+        db_t *d = &dbs[db];
+        hostReply_t *keys = replyArray(0);
+        size_t i = (size_t)cursor;
+        for (long long n = 0; i < d->len && n < count; i++, n++) {
+            if (!pattern || globMatch(pattern->ptr, pattern->len, d->e[i].name, d->e[i].len)) {
+                replyAppend(keys, replyString(REDISMODULE_REPLY_STRING, d->e[i].name, d->e[i].len));
+            }
+        }
+        char buf[32];
+        int len = snprintf(buf, sizeof(buf), "%zu", i < d->len ? i : 0);
+        hostReply_t *r = replyArray(0);
+        replyAppend(r, replyString(REDISMODULE_REPLY_STRING, buf, (size_t)len));
+        replyAppend(r, keys);
+        return r;
+    }
+    if (!strcasecmp("set", cmd) && 3 == argc) {
+        value_t *v = dbCreate(db, ARG(1), REDISMODULE_KEYTYPE_STRING);
+        v->s = memdup(ARG(2));
+        v->slen = argv[2]->len;
+        notify(REDISMODULE_NOTIFY_STRING, "set", db, argv[1]);
+        return replyString(REDISMODULE_REPLY_STRING, "OK", 2);
+    }
+    if (!strcasecmp("del", cmd) && argc >= 2) {
+        long long deleted = 0;
+        for (int i = 1; i < argc; i++) {
+            if (dbDelete(db, ARG(i))) {
+                deleted++;
+                notify(REDISMODULE_NOTIFY_GENERIC, "del", db, argv[i]);
+            }
+        }
+        return replyInteger(deleted);
+    }
+    if (!strcasecmp("hget", cmd) && 3 == argc) {
+        value_t *v = dbLookup(db, ARG(1));
+        if (v && REDISMODULE_KEYTYPE_HASH != v->type) {
+            return WRONGTYPE;
+        }
+        hitem_t *h = v ? hashFind(v, ARG(2)) : NULL;
+        return h ? replyString(REDISMODULE_REPLY_STRING, h->val, h->vlen) : replyNew(REDISMODULE_REPLY_NULL);
+    }
+    return SYNTAXERR("ERR unknown command");
+}
+
+/* ------------------------------------------------------------------------------------- */
+/* The modules API                                                                       */
+/* ------------------------------------------------------------------------------------- */
+
+static void *hostAlloc(size_t bytes) {
+    hostModuleAllocs++;
+    return malloc(bytes);
+}
+
+static void *hostCalloc(size_t nmemb, size_t size) {
+    hostModuleAllocs++;
+    return calloc(nmemb, size);
+}
+
+static void *hostRealloc(void *ptr, size_t bytes) {
+    hostModuleAllocs++;
+    return realloc(ptr, bytes);
+}
+
+static void hostFree(void *ptr) {
+    free(ptr);
+}
+
+static int hostIsModuleNameBusy(const char *name) {
+    (void)name;
+    return 0;
+}
+
+static void hostSetModuleAttribs(RedisModuleCtx *ctx, const char *name, int ver, int apiver) {
+    (void)ctx, (void)name, (void)ver, (void)apiver;
+}
+
+static int hostCreateCommand(RedisModuleCtx *ctx, const char *name, RedisModuleCmdFunc fn, const char *flags,
+                             int firstkey, int lastkey, int keystep) {
+    (void)ctx, (void)flags, (void)firstkey, (void)lastkey, (void)keystep;
+    command_t *c = malloc(sizeof(command_t));
+    c->name = memdup(name, strlen(name));
+    c->fn = fn;
+    c->next = commands;
+    commands = c;
+    return REDISMODULE_OK;
+}
+
+static void hostLog(RedisModuleCtx *ctx, const char *level, const char *fmt, ...) {
+    (void)ctx;
+    if (getenv("HOST_VERBOSE")) {
+        va_list ap;
+        va_start(ap, fmt);
+        fprintf(stderr, "[%s] ", level);
+        vfprintf(stderr, fmt, ap);
+        fprintf(stderr, "\n");
+        va_end(ap);
+    }
+}
+
+static int hostWrongArity(RedisModuleCtx *ctx) {
+    return ctxReply(ctx, SYNTAXERR("ERR wrong number of arguments"));
+}
+
+static int hostReplyWithLongLong(RedisModuleCtx *ctx, long long ll) {
+    return ctxReply(ctx, replyInteger(ll));
+}
+
+static int hostReplyWithError(RedisModuleCtx *ctx, const char *err) {
+    return ctxReply(ctx, replyString(REDISMODULE_REPLY_ERROR, err, strlen(err)));
+}
+
+static int hostReplyWithSimpleString(RedisModuleCtx *ctx, const char *msg) {
+    return ctxReply(ctx, replyString(REDISMODULE_REPLY_STRING, msg, strlen(msg)));
+}
+
+static int hostReplyWithArray(RedisModuleCtx *ctx, long len) {
+    hostReply_t *r = replyArray(REDISMODULE_POSTPONED_ARRAY_LEN == len ? 0 : (size_t)len);
+    r->expected = len;
+    return ctxReply(ctx, r);
+}
+
+static void hostReplySetArrayLength(RedisModuleCtx *ctx, long len) {
+    int i = ctx->depth - 1;
+    while (i >= 0 && ctx->stack[i]->expected >= 0) {
+        i--;
+    }
+    if (i < 0 || (long)ctx->stack[i]->nelements != len) {
+        fprintf(stderr, "host: a postponed array's length doesn't match its elements\n");
+        abort();
+    }
+    ctx->stack[i]->expected = len;
+    ctx->depth = i;
+}
+
+static int hostReplyWithStringBuffer(RedisModuleCtx *ctx, const char *buf, size_t len) {
+    return ctxReply(ctx, replyString(REDISMODULE_REPLY_STRING, buf, len));
+}
+
+static int hostReplyWithString(RedisModuleCtx *ctx, RedisModuleString *str) {
+    return ctxReply(ctx, replyString(REDISMODULE_REPLY_STRING, str->ptr, str->len));
+}
+
+static int hostReplyWithNull(RedisModuleCtx *ctx) {
+    return ctxReply(ctx, replyNew(REDISMODULE_REPLY_NULL));
+}
+
+static int hostReplyWithDouble(RedisModuleCtx *ctx, double d) {
+    hostReply_t *r = replyScore(d);
+    r->type = HOST_REPLY_DOUBLE;
+    r->d = d;
+    return ctxReply(ctx, r);
+}
+
+static int hostGetSelectedDb(RedisModuleCtx *ctx) {
+    return ctx->db;
+}
+
+static int hostSelectDb(RedisModuleCtx *ctx, int db) {
+    if (db < 0 || db >= HOST_DBS) {
+        return REDISMODULE_ERR;
+    }
+    ctx->db = db;
+    return REDISMODULE_OK;
+}
+
+static RedisModuleString *hostCreateString(RedisModuleCtx *ctx, const char *ptr, size_t len) {
+    (void)ctx;
+    return newString(ptr, len);
+}
+
+static RedisModuleString *hostCreateStringPrintf(RedisModuleCtx *ctx, const char *fmt, ...) {
+    (void)ctx;
+    va_list ap;
+    va_start(ap, fmt);
+    char *buf = NULL;
+    int len = vasprintf(&buf, fmt, ap);
+    va_end(ap);
+    RedisModuleString *s = newString(buf, (size_t)len);
+    free(buf);
+    return s;
+}
+
+static RedisModuleString *hostCreateStringFromLongLong(RedisModuleCtx *ctx, long long ll) {
+    return hostCreateStringPrintf(ctx, "%lld", ll);
+}
+
+static RedisModuleString *hostCreateStringFromString(RedisModuleCtx *ctx, const RedisModuleString *str) {
+    (void)ctx;
+    return newString(str->ptr, str->len);
+}
+
+static void hostFreeString(RedisModuleCtx *ctx, RedisModuleString *str) {
+    (void)ctx;
+    freeString(str);
+}
+
+static const char *hostStringPtrLen(const RedisModuleString *str, size_t *len) {
+    if (len) {
+        *len = str->len;
+    }
+    return str->ptr;
+}
+
+static int hostStringToLongLong(const RedisModuleString *str, long long *ll) {
+    return parseLongLong(str->ptr, str->len, ll) ? REDISMODULE_OK : REDISMODULE_ERR;
+}
+
+static int hostStringToDouble(const RedisModuleString *str, double *d) {
+    return parseDouble(str->ptr, str->len, d) ? REDISMODULE_OK : REDISMODULE_ERR;
+}
+
+static int hostStringAppendBuffer(RedisModuleCtx *ctx, RedisModuleString *str, const char *buf, size_t len) {
+    (void)ctx;
+    str->ptr = realloc(str->ptr, str->len + len + 1);
+    memcpy(str->ptr + str->len, buf, len);
+    str->len += len;
+    str->ptr[str->len] = '\0';
+    return REDISMODULE_OK;
+}
+
+static int hostStringCompare(RedisModuleString *a, RedisModuleString *b) {
+    return bufcmp(a->ptr, a->len, b->ptr, b->len);
+}
+
+// Builds the arguments of an RM_Call or RM_Replicate by their format
+// Returns: the number of arguments, and whether to replicate in 'replicate'
+static int buildArgs(const char *cmdname, const char *fmt, va_list ap, RedisModuleString ***argvp, int *replicate) {
+    int argc = 1;
+    RedisModuleString **argv = malloc(sizeof(RedisModuleString *));
+    argv[0] = newString(cmdname, strlen(cmdname));
+    if (replicate) {
+        *replicate = 0;
+    }
+    for (const char *p = fmt; *p; p++) {
+        RedisModuleString *add[1] = { NULL };
+        RedisModuleString **many = NULL;
+        size_t nmany = 0;
+        switch (*p) {
+        case 'c': {
+            const char *s = va_arg(ap, const char *);
+            add[0] = newString(s, strlen(s));
+            break;
+        }
+        case 's': {
+            RedisModuleString *s = va_arg(ap, RedisModuleString *);
+            add[0] = newString(s->ptr, s->len);
+            break;
+        }
+        case 'b': {
+            const char *s = va_arg(ap, const char *);
+            size_t len = va_arg(ap, size_t);
+            add[0] = newString(s, len);
+            break;
+        }
+        case 'l': {
+            char buf[32];
+            int len = snprintf(buf, sizeof(buf), "%lld", va_arg(ap, long long));
+            add[0] = newString(buf, (size_t)len);
+            break;
+        }
+        case 'v':
+            many = va_arg(ap, RedisModuleString **);
+            nmany = va_arg(ap, size_t);
+            break;
+        case '!':
+            if (replicate) {
+                *replicate = 1;
+            }
+            continue;
+        default:
+            continue;
+        }
+        if (add[0]) {
+            many = add;
+            nmany = 1;
+        }
+        argv = realloc(argv, sizeof(RedisModuleString *) * (argc + nmany));
+        for (size_t i = 0; i < nmany; i++) {
+            argv[argc++] = (many == add) ? add[0] : newString(many[i]->ptr, many[i]->len);
+        }
+    }
+    *argvp = argv;
+    return argc;
+}
+
+static void recordReplicated(RedisModuleString **argv, int argc) {
+    size_t off = 0;
+    hostReplicated++;
+    for (int i = 0; i < argc && off < sizeof(hostLastReplicated) - 1; i++) {
+        off += snprintf(hostLastReplicated + off, sizeof(hostLastReplicated) - off, "%s%.*s",
+                        i ? " " : "", (int)argv[i]->len, argv[i]->ptr);
+    }
+}
+
+static void freeArgs(RedisModuleString **argv, int argc) {
+    for (int i = 0; i < argc; i++) {
+        freeString(argv[i]);
+    }
+    free(argv);
+}
+
+static RedisModuleCallReply *hostCall(RedisModuleCtx *ctx, const char *cmdname, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    RedisModuleString **argv;
+    int replicate;
+    int argc = buildArgs(cmdname, fmt, ap, &argv, &replicate);
+    va_end(ap);
+    hostReply_t *r = nativeCommand(ctx->db, argv, argc);
+    if (replicate && REDISMODULE_REPLY_ERROR != r->type) {
+        recordReplicated(argv, argc);
+    }
+    freeArgs(argv, argc);
+    return (RedisModuleCallReply *)r;
+}
+
+static int hostReplicate(RedisModuleCtx *ctx, const char *cmdname, const char *fmt, ...) {
+    (void)ctx;
+    va_list ap;
+    va_start(ap, fmt);
+    RedisModuleString **argv;
+    int argc = buildArgs(cmdname, fmt, ap, &argv, NULL);
+    va_end(ap);
+    recordReplicated(argv, argc);
+    freeArgs(argv, argc);
+    return REDISMODULE_OK;
+}
+
+static void hostFreeCallReply(RedisModuleCallReply *reply) {
+    hostReplyFree((hostReply_t *)reply);
+}
+
+static int hostCallReplyType(RedisModuleCallReply *reply) {
+    return reply ? reply->r.type : REDISMODULE_REPLY_UNKNOWN;
+}
+
+static long long hostCallReplyInteger(RedisModuleCallReply *reply) {
+    return reply->r.ll;
+}
+
+static size_t hostCallReplyLength(RedisModuleCallReply *reply) {
+    if (REDISMODULE_REPLY_ARRAY == reply->r.type) {
+        return reply->r.nelements;
+    }
+    return reply->r.len;
+}
+
+static RedisModuleCallReply *hostCallReplyArrayElement(RedisModuleCallReply *reply, size_t idx) {
+    if (REDISMODULE_REPLY_ARRAY != reply->r.type || idx >= reply->r.nelements) {
+        return NULL;
+    }
+    return (RedisModuleCallReply *)reply->r.elements[idx];
+}
+
+static const char *hostCallReplyStringPtr(RedisModuleCallReply *reply, size_t *len) {
+    if (!reply || !reply->r.str) {
+        return NULL;
+    }
+    if (len) {
+        *len = reply->r.len;
+    }
+    return reply->r.str;
+}
+
+static RedisModuleString *hostCreateStringFromCallReply(RedisModuleCallReply *reply) {
+    if (!reply) {
+        return NULL;
+    }
+    if (REDISMODULE_REPLY_INTEGER == reply->r.type) {
+        return hostCreateStringFromLongLong(NULL, reply->r.ll);
+    }
+    return reply->r.str ? newString(reply->r.str, reply->r.len) : NULL;
+}
+
+/* Keys */
+
+typedef struct {
+    int inf;                        // -1 for "-", 1 for "+", 0 for a bound
+    int ex;                         // Is the bound exclusive
+    const char *p;
+    size_t len;
+} lexbound_t;
+
+struct RedisModuleKey {
+    int db;
+    char *name;
+    size_t len;
+    int mode;
+    int iter;                       // Is a zset range iterator active
+    int lex;                        // Is the range lexicographical
+    long idx;                       // The iterator's position
+    int ended;                      // Did the iterator go past the range
+    double min, max;
+    int minex, maxex;
+    lexbound_t lmin, lmax;
+    char *lminbuf, *lmaxbuf;
+};
+
+static value_t *keyValue(RedisModuleKey *key) {
+    return key ? dbLookup(key->db, key->name, key->len) : NULL;
+}
+
+static void *hostOpenKey(RedisModuleCtx *ctx, RedisModuleString *keyname, int mode) {
+    if (!(mode & REDISMODULE_WRITE) && !dbLookup(ctx->db, keyname->ptr, keyname->len)) {
+        return NULL;
+    }
+    RedisModuleKey *key = calloc(1, sizeof(RedisModuleKey));
+    key->db = ctx->db;
+    key->name = memdup(keyname->ptr, keyname->len);
+    key->len = keyname->len;
+    key->mode = mode;
+    return key;
+}
+
+static void hostZsetRangeStop(RedisModuleKey *key) {
+    if (key) {
+        key->iter = 0;
+        key->ended = 0;
+        free(key->lminbuf);
+        free(key->lmaxbuf);
+        key->lminbuf = key->lmaxbuf = NULL;
+    }
+}
+
+static void hostCloseKey(RedisModuleKey *key) {
+    if (key) {
+        hostZsetRangeStop(key);
+        free(key->name);
+        free(key);
+    }
+}
+
+static int hostKeyType(RedisModuleKey *key) {
+    value_t *v = keyValue(key);
+    return v ? v->type : REDISMODULE_KEYTYPE_EMPTY;
+}
+
+static size_t hostValueLength(RedisModuleKey *key) {
+    value_t *v = keyValue(key);
+    if (!v) {
+        return 0;
+    }
+    switch (v->type) {
+    case REDISMODULE_KEYTYPE_ZSET: return v->zlen;
+    case REDISMODULE_KEYTYPE_HASH: return v->hlen;
+    default: return v->slen;
+    }
+}
+
+static int hostDeleteKey(RedisModuleKey *key) {
+    if (!key || !(key->mode & REDISMODULE_WRITE)) {
+        return REDISMODULE_ERR;
+    }
+    dbDelete(key->db, key->name, key->len);
+    return REDISMODULE_OK;
+}
+
+static int hostZsetAdd(RedisModuleKey *key, double score, RedisModuleString *ele, int *flagsptr) {
+    if (!key || !(key->mode & REDISMODULE_WRITE) || isnan(score)) {
+        return REDISMODULE_ERR;
+    }
+    value_t *v = keyValue(key);
+    if (v && REDISMODULE_KEYTYPE_ZSET != v->type) {
+        return REDISMODULE_ERR;
+    }
+    int in = flagsptr ? *flagsptr : 0;
+    long at = v ? zsetFind(v, ele->ptr, ele->len) : -1;
+    if (((in & REDISMODULE_ZADD_NX) && at >= 0) || ((in & REDISMODULE_ZADD_XX) && at < 0)) {
+        if (flagsptr) {
+            *flagsptr = REDISMODULE_ZADD_NOP;
+        }
+        return REDISMODULE_OK;
+    }
+    if (!v) {
+        v = dbCreate(key->db, key->name, key->len, REDISMODULE_KEYTYPE_ZSET);
+    }
+    int added = zsetAdd(v, score, ele->ptr, ele->len);
+    if (flagsptr) {
+        *flagsptr = added ? REDISMODULE_ZADD_ADDED : REDISMODULE_ZADD_UPDATED;
+    }
+    return REDISMODULE_OK;
+}
+
+static int hostZsetScore(RedisModuleKey *key, RedisModuleString *ele, double *score) {
+    value_t *v = keyValue(key);
+    if (!v || REDISMODULE_KEYTYPE_ZSET != v->type) {
+        return REDISMODULE_ERR;
+    }
+    long at = zsetFind(v, ele->ptr, ele->len);
+    if (at < 0) {
+        return REDISMODULE_ERR;
+    }
+    *score = v->z[at].score;
+    return REDISMODULE_OK;
+}
+
+// Removes an element, leaving an emptied zset in place like the server does (see
+// https://github.com/antirez/redis/issues/4859)
+static int hostZsetRem(RedisModuleKey *key, RedisModuleString *ele, int *deleted) {
+    value_t *v = keyValue(key);
+    if (!v || REDISMODULE_KEYTYPE_ZSET != v->type || !(key->mode & REDISMODULE_WRITE)) {
+        return REDISMODULE_ERR;
+    }
+    long at = zsetFind(v, ele->ptr, ele->len);
+    if (at >= 0) {
+        zsetRemoveAt(v, (size_t)at);
+    }
+    if (deleted) {
+        *deleted = (at >= 0);
+    }
+    return REDISMODULE_OK;
+}
+
+static int inRange(RedisModuleKey *key, zitem_t *it) {
+    if (key->lex) {
+        if (key->lmin.inf > 0 || key->lmax.inf < 0) {
+            return 0;
+        }
+        if (!key->lmin.inf) {
+            int cmp = bufcmp(it->ele, it->len, key->lmin.p, key->lmin.len);
+            if (cmp < 0 || (!cmp && key->lmin.ex)) {
+                return 0;
+            }
+        }
+        if (!key->lmax.inf) {
+            int cmp = bufcmp(it->ele, it->len, key->lmax.p, key->lmax.len);
+            if (cmp > 0 || (!cmp && key->lmax.ex)) {
+                return 0;
+            }
+        }
+        return 1;
+    }
+    if (it->score < key->min || (key->minex && it->score == key->min)) {
+        return 0;
+    }
+    if (it->score > key->max || (key->maxex && it->score == key->max)) {
+        return 0;
+    }
+    return 1;
+}
+
+// Positions a range iterator at the first (or last) element that is in its range
+static int rangeSeek(RedisModuleKey *key, int last) {
+    value_t *v = keyValue(key);
+    if (!v || REDISMODULE_KEYTYPE_ZSET != v->type) {
+        return REDISMODULE_ERR;
+    }
+    key->iter = 1;
+    key->ended = 1;
+    for (size_t n = 0; n < v->zlen; n++) {
+        size_t i = last ? v->zlen - 1 - n : n;
+        if (inRange(key, &v->z[i])) {
+            key->idx = (long)i;
+            key->ended = 0;
+            break;
+        }
+    }
+    return REDISMODULE_OK;
+}
+
+static int hostZsetFirstInScoreRange(RedisModuleKey *key, double min, double max, int minex, int maxex) {
+    if (!key) {
+        return REDISMODULE_ERR;
+    }
+    hostZsetRangeStop(key);
+    key->lex = 0;
+    key->min = min;
+    key->max = max;
+    key->minex = minex;
+    key->maxex = maxex;
+    return rangeSeek(key, 0);
+}
+
+static int hostZsetLastInScoreRange(RedisModuleKey *key, double min, double max, int minex, int maxex) {
+    if (!key) {
+        return REDISMODULE_ERR;
+    }
+    hostZsetRangeStop(key);
+    key->lex = 0;
+    key->min = min;
+    key->max = max;
+    key->minex = minex;
+    key->maxex = maxex;
+    return rangeSeek(key, 1);
+}
+
+static int parseLexBound(RedisModuleString *s, lexbound_t *b, char **buf) {
+    if (1 == s->len && ('-' == s->ptr[0] || '+' == s->ptr[0])) {
+        b->inf = ('-' == s->ptr[0]) ? -1 : 1;
+        return 1;
+    }
+    if (!s->len || ('[' != s->ptr[0] && '(' != s->ptr[0])) {
+        return 0;
+    }
+    b->inf = 0;
+    b->ex = ('(' == s->ptr[0]);
+    *buf = memdup(s->ptr + 1, s->len - 1);
+    b->p = *buf;
+    b->len = s->len - 1;
+    return 1;
+}
+
+static int lexRange(RedisModuleKey *key, RedisModuleString *min, RedisModuleString *max, int last) {
+    if (!key) {
+        return REDISMODULE_ERR;
+    }
+    hostZsetRangeStop(key);
+    key->lex = 1;
+    if (!parseLexBound(min, &key->lmin, &key->lminbuf) || !parseLexBound(max, &key->lmax, &key->lmaxbuf)) {
+        hostZsetRangeStop(key);
+        return REDISMODULE_ERR;
+    }
+    return rangeSeek(key, last);
+}
+
+static int hostZsetFirstInLexRange(RedisModuleKey *key, RedisModuleString *min, RedisModuleString *max) {
+    return lexRange(key, min, max, 0);
+}
+
+static int hostZsetLastInLexRange(RedisModuleKey *key, RedisModuleString *min, RedisModuleString *max) {
+    return lexRange(key, min, max, 1);
+}
+
+static RedisModuleString *hostZsetRangeCurrentElement(RedisModuleKey *key, double *score) {
+    value_t *v = keyValue(key);
+    if (!v || !key->iter || key->ended || key->idx < 0 || (size_t)key->idx >= v->zlen) {
+        return NULL;
+    }
+    zitem_t *it = &v->z[key->idx];
+    if (score) {
+        *score = it->score;
+    }
+    return newString(it->ele, it->len);
+}
+
+static int rangeStep(RedisModuleKey *key, int delta) {
+    value_t *v = keyValue(key);
+    if (!v || !key->iter || key->ended) {
+        return 0;
+    }
+    long idx = key->idx + delta;
+    if (idx < 0 || (size_t)idx >= v->zlen || !inRange(key, &v->z[idx])) {
+        key->ended = 1;
+        return 0;
+    }
+    key->idx = idx;
+    return 1;
+}
+
+static int hostZsetRangeNext(RedisModuleKey *key) {
+    return rangeStep(key, 1);
+}
+
+static int hostZsetRangePrev(RedisModuleKey *key) {
+    return rangeStep(key, -1);
+}
+
+static int hostZsetRangeEndReached(RedisModuleKey *key) {
+    return !key || !key->iter || key->ended;
+}
+
+// Sets (or deletes, with REDISMODULE_HASH_DELETE) fields, by RedisModuleString names
+// or C strings with REDISMODULE_HASH_CFIELDS
+static int hostHashSet(RedisModuleKey *key, int flags, ...) {
+    if (!key || !(key->mode & REDISMODULE_WRITE)) {
+        return 0;
+    }
+    value_t *v = keyValue(key);
+    if (v && REDISMODULE_KEYTYPE_HASH != v->type) {
+        return 0;
+    }
+    va_list ap;
+    va_start(ap, flags);
+    int updated = 0;
+    for (;;) {
+        const char *field;
+        size_t flen;
+        if (flags & REDISMODULE_HASH_CFIELDS) {
+            field = va_arg(ap, const char *);
+            if (!field) {
+                break;
+            }
+            flen = strlen(field);
+        } else {
+            RedisModuleString *f = va_arg(ap, RedisModuleString *);
+            if (!f) {
+                break;
+            }
+            field = f->ptr;
+            flen = f->len;
+        }
+        RedisModuleString *val = va_arg(ap, RedisModuleString *);
+        if (!v && REDISMODULE_HASH_DELETE != val) {
+            v = dbCreate(key->db, key->name, key->len, REDISMODULE_KEYTYPE_HASH);
+        }
+        hitem_t *h = v ? hashFind(v, field, flen) : NULL;
+        if (REDISMODULE_HASH_DELETE == val) {
+            if (h) {
+                free(h->field);
+                free(h->val);
+                *h = v->h[--v->hlen];
+                updated++;
+            }
+        } else if (h) {
+            free(h->val);
+            h->val = memdup(val->ptr, val->len);
+            h->vlen = val->len;
+            updated++;
+        } else {
+            v->h = realloc(v->h, sizeof(hitem_t) * (v->hlen + 1));
+            h = &v->h[v->hlen++];
+            h->field = memdup(field, flen);
+            h->flen = flen;
+            h->val = memdup(val->ptr, val->len);
+            h->vlen = val->len;
+            updated++;
+        }
+    }
+    va_end(ap);
+    if (v && !v->hlen) {
+        dbDelete(key->db, key->name, key->len);
+    }
+    return updated;
+}
+
+static int hostHashGet(RedisModuleKey *key, int flags, ...) {
+    value_t *v = keyValue(key);
+    if (v && REDISMODULE_KEYTYPE_HASH != v->type) {
+        return REDISMODULE_ERR;
+    }
+    va_list ap;
+    va_start(ap, flags);
+    for (;;) {
+        const char *field;
+        size_t flen;
+        if (flags & REDISMODULE_HASH_CFIELDS) {
+            field = va_arg(ap, const char *);
+            if (!field) {
+                break;
+            }
+            flen = strlen(field);
+        } else {
+            RedisModuleString *f = va_arg(ap, RedisModuleString *);
+            if (!f) {
+                break;
+            }
+            field = f->ptr;
+            flen = f->len;
+        }
+        hitem_t *h = v ? hashFind(v, field, flen) : NULL;
+        if (flags & REDISMODULE_HASH_EXISTS) {
+            *va_arg(ap, int *) = (NULL != h);
+        } else {
+            *va_arg(ap, RedisModuleString **) = h ? newString(h->val, h->vlen) : NULL;
+        }
+    }
+    va_end(ap);
+    return REDISMODULE_OK;
+}
+
+/* Everything else */
+
+static int hostIsKeysPositionRequest(RedisModuleCtx *ctx) {
+    (void)ctx;
+    return 0;
+}
+
+static void hostKeyAtPos(RedisModuleCtx *ctx, int pos) {
+    (void)ctx, (void)pos;
+}
+
+static unsigned long long hostGetClientId(RedisModuleCtx *ctx) {
+    return ctx->c ? ctx->c->id : 0;
+}
+
+static int hostGetContextFlags(RedisModuleCtx *ctx) {
+    (void)ctx;
+    return ctxflags;
+}
+
+static long long hostMilliseconds(void) {
+    return now;
+}
+
+static RedisModuleBlockedClient *hostBlockClient(RedisModuleCtx *ctx, RedisModuleCmdFunc reply_cb,
+                                                 RedisModuleCmdFunc timeout_cb,
+                                                 void (*free_privdata)(RedisModuleCtx *, void *),
+                                                 long long timeout_ms) {
+    RedisModuleBlockedClient *bc = calloc(1, sizeof(RedisModuleBlockedClient));
+    bc->c = ctx->c;
+    bc->reply_cb = reply_cb;
+    bc->timeout_cb = timeout_cb;
+    bc->free_privdata = free_privdata;
+    bc->deadline = timeout_ms > 0 ? now + timeout_ms : 0;
+    bc->db = ctx->db;
+    bc->next = bcs;
+    bcs = bc;
+    ctx->bc = bc;
+    ctx->c->bc = bc;
+    return bc;
+}
+
+static int hostUnblockClient(RedisModuleBlockedClient *bc, void *privdata) {
+    if (bc->dead || bc->unblocked) {
+        fprintf(stderr, "host: the module unblocked a client that %s\n",
+                bc->dead ? "is gone" : "was already unblocked");
+        abort();
+    }
+    bc->unblocked = 1;
+    bc->privdata = privdata;
+    return REDISMODULE_OK;
+}
+
+static void *hostGetBlockedClientPrivateData(RedisModuleCtx *ctx) {
+    return ctx->privdata;
+}
+
+static void hostSetDisconnectCallback(RedisModuleBlockedClient *bc, RedisModuleDisconnectFunc cb) {
+    bc->disconnect_cb = cb;
+}
+
+static int hostSubscribeToKeyspaceEvents(RedisModuleCtx *ctx, int types, RedisModuleNotificationFunc cb) {
+    (void)ctx;
+    notifytypes = types;
+    notifycb = cb;
+    return REDISMODULE_OK;
+}
+
+static RedisModuleTimerID hostCreateTimer(RedisModuleCtx *ctx, mstime_t period, RedisModuleTimerProc cb, void *data) {
+    (void)ctx;
+    timer_t_ *t = malloc(sizeof(timer_t_));
+    t->id = ++timerseq;
+    t->when = now + period;
+    t->cb = cb;
+    t->data = data;
+    t->next = timers;
+    timers = t;
+    return t->id;
+}
+
+static int hostStopTimer(RedisModuleCtx *ctx, RedisModuleTimerID id, void **data) {
+    (void)ctx;
+    for (timer_t_ **pt = &timers; *pt; pt = &(*pt)->next) {
+        if ((*pt)->id == id) {
+            timer_t_ *t = *pt;
+            *pt = t->next;
+            if (data) {
+                *data = t->data;
+            }
+            free(t);
+            return REDISMODULE_OK;
+        }
+    }
+    return REDISMODULE_ERR;
+}
+
+static const struct {
+    const char *name;
+    void *fn;
+} api[] = {
+    #define API(name) { "RedisModule_" #name, (void *)(unsigned long)host ## name }
+    API(Alloc), API(Calloc), API(Realloc), API(Free), API(IsModuleNameBusy), API(SetModuleAttribs),
+    API(CreateCommand), API(Log), API(WrongArity), API(ReplyWithLongLong), API(ReplyWithError),
+    API(ReplyWithSimpleString), API(ReplyWithArray), API(ReplySetArrayLength),
+    API(ReplyWithStringBuffer), API(ReplyWithString), API(ReplyWithNull), API(ReplyWithDouble),
+    API(GetSelectedDb), API(SelectDb), API(CreateString), API(CreateStringPrintf),
+    API(CreateStringFromLongLong), API(CreateStringFromString), API(FreeString), API(StringPtrLen), API(StringToLongLong),
+    API(StringToDouble), API(StringAppendBuffer), API(StringCompare), API(Call), API(Replicate),
+    API(FreeCallReply), API(CallReplyType), API(CallReplyInteger), API(CallReplyLength),
+    API(CallReplyArrayElement), API(CallReplyStringPtr), API(CreateStringFromCallReply),
+    API(OpenKey), API(CloseKey), API(KeyType), API(ValueLength), API(DeleteKey),
+    { "RedisModule_UnlinkKey", (void *)(unsigned long)hostDeleteKey },
+    API(ZsetAdd), API(ZsetScore), API(ZsetRem), API(ZsetRangeStop), API(ZsetFirstInScoreRange),
+    API(ZsetLastInScoreRange), API(ZsetFirstInLexRange), API(ZsetLastInLexRange),
+    API(ZsetRangeCurrentElement), API(ZsetRangeNext), API(ZsetRangePrev), API(ZsetRangeEndReached),
+    API(HashSet), API(HashGet), API(IsKeysPositionRequest), API(KeyAtPos), API(GetClientId),
+    API(GetContextFlags), API(Milliseconds), API(BlockClient), API(UnblockClient),
+    API(GetBlockedClientPrivateData), API(SetDisconnectCallback), API(SubscribeToKeyspaceEvents),
+    API(CreateTimer), API(StopTimer),
+    #undef API
+};
+
+static int hostGetApi(const char *name, void *ptr) {
+    for (size_t i = 0; i < sizeof(api) / sizeof(api[0]); i++) {
+        if (!strcmp(api[i].name, name)) {
+            *(void **)ptr = api[i].fn;
+            return REDISMODULE_OK;
+        }
+    }
+    return REDISMODULE_ERR;
+}
+
+/* ------------------------------------------------------------------------------------- */
+/* The host's interface                                                                  */
+/* ------------------------------------------------------------------------------------- */
+
+static RedisModuleString **vargs(const char *first, va_list ap, int *argc) {
+    RedisModuleString **argv = NULL;
+    *argc = 0;
+    for (const char *s = first; s; s = va_arg(ap, const char *)) {
+        argv = realloc(argv, sizeof(RedisModuleString *) * (*argc + 1));
+        argv[(*argc)++] = newString(s, strlen(s));
+    }
+    return argv;
+}
+
+int hostLoad(const char *arg, ...) {
+    va_list ap;
+    va_start(ap, arg);
+    int argc;
+    RedisModuleString **argv = vargs(arg, ap, &argc);
+    va_end(ap);
+    RedisModuleCtx *ctx = ctxNew(NULL, 0);
+    int ret = RedisModule_OnLoad(ctx, argv, argc);
+    hostReplyFree(ctxFree(ctx));
+    freeArgs(argv, argc);
+    return ret;
+}
+
+hostReply_t *hostRun(unsigned long long client, const char *cmd, ...) {
+    va_list ap;
+    va_start(ap, cmd);
+    int argc;
+    RedisModuleString **argv = vargs(cmd, ap, &argc);
+    va_end(ap);
+    client_t *c = clientGet(client);
+    if (c->bc) {
+        fprintf(stderr, "host: a blocked client can't run commands\n");
+        abort();
+    }
+    command_t *command = commands;
+    while (command && strcasecmp(command->name, cmd)) {
+        command = command->next;
+    }
+    if (!command) {
+        hostReply_t *r = nativeCommand(0, argv, argc);
+        freeArgs(argv, argc);
+        return r;
+    }
+    RedisModuleCtx *ctx = ctxNew(c, 0);
+    command->fn(ctx, argv, argc);
+    RedisModuleBlockedClient *bc = ctx->bc;
+    hostReply_t *r = ctxFree(ctx);
+    if (bc) {
+        if (r) {
+            fprintf(stderr, "host: a client that blocked was replied to\n");
+            abort();
+        }
+        bc->argv = argv;
+        bc->argc = argc;
+        return NULL;
+    }
+    freeArgs(argv, argc);
+    return r;
+}
+
+hostReply_t *hostTakeReply(unsigned long long client) {
+    client_t *c = clientGet(client);
+    hostReply_t *r = c->pending;
+    c->pending = NULL;
+    return r;
+}
+
+int hostBlocked(unsigned long long client) {
+    return NULL != clientGet(client)->bc;
+}
+
+// Is done with a blocked client, that was replied to or disconnected
+static void bcDone(RedisModuleBlockedClient *bc) {
+    bc->dead = 1;
+    if (bc->c) {
+        bc->c->bc = NULL;
+    }
+    freeArgs(bc->argv, bc->argc);
+    bc->argv = NULL;
+    bc->argc = 0;
+}
+
+void hostDisconnect(unsigned long long client) {
+    client_t *c = clientGet(client);
+    RedisModuleBlockedClient *bc = c->bc;
+    if (!bc) {
+        return;
+    }
+    RedisModuleCtx *ctx = ctxNew(c, bc->db);
+    if (!bc->unblocked && bc->disconnect_cb) {
+        bc->disconnect_cb(ctx, bc);
+    }
+    if (bc->privdata && bc->free_privdata) {
+        bc->free_privdata(ctx, bc->privdata);
+    }
+    hostReplyFree(ctxFree(ctx));
+    bcDone(bc);
+}
+
+// Replies to the clients that were unblocked, or that timed out
+// Returns: whether any was
+static int serveBlocked(void) {
+    int served = 0;
+    for (RedisModuleBlockedClient *bc = bcs; bc; bc = bc->next) {
+        if (bc->dead) {
+            continue;
+        }
+        RedisModuleCmdFunc cb = NULL;
+        if (bc->unblocked) {
+            cb = bc->reply_cb;
+        } else if (bc->deadline && bc->deadline <= now) {
+            cb = bc->timeout_cb;
+        } else {
+            continue;
+        }
+        RedisModuleCtx *ctx = ctxNew(bc->c, bc->db);
+        ctx->privdata = bc->privdata;
+        cb(ctx, bc->argv, bc->argc);
+        if (bc->privdata && bc->free_privdata) {
+            bc->free_privdata(ctx, bc->privdata);
+        }
+        hostReplyFree(bc->c->pending);
+        bc->c->pending = ctxFree(ctx);
+        bcDone(bc);
+        served = 1;
+    }
+    return served;
+}
+
+// Fires the earliest timer that is due
+// Returns: whether any was
+static int fireTimer(void) {
+    timer_t_ **best = NULL;
+    for (timer_t_ **pt = &timers; *pt; pt = &(*pt)->next) {
+        if ((*pt)->when <= now && (!best || (*pt)->when < (*best)->when ||
+                                   ((*pt)->when == (*best)->when && (*pt)->id < (*best)->id))) {
+            best = pt;
+        }
+    }
+    if (!best) {
+        return 0;
+    }
+    timer_t_ *t = *best;
+    *best = t->next;
+    RedisModuleCtx *ctx = ctxNew(NULL, 0);
+    t->cb(ctx, t->data);
+    hostReplyFree(ctxFree(ctx));
+    free(t);
+    return 1;
+}
+
+static void iterate(void) {
+    while (serveBlocked() || fireTimer()) {
+    }
+}
+
+void hostAdvance(long long ms) {
+    long long target = now + ms;
+    for (;;) {
+        iterate();
+        long long next = target;
+        for (timer_t_ *t = timers; t; t = t->next) {
+            if (t->when < next) {
+                next = t->when;
+            }
+        }
+        for (RedisModuleBlockedClient *bc = bcs; bc; bc = bc->next) {
+            if (!bc->dead && bc->deadline && bc->deadline < next) {
+                next = bc->deadline;
+            }
+        }
+        if (next <= now) {
+            next = now;
+        }
+        now = next;
+        if (now >= target) {
+            iterate();
+            break;
+        }
+    }
+}
+
+long long hostNow(void) {
+    return now;
+}
+
+void hostSetContextFlags(int flags) {
+    ctxflags = flags;
+}
+
+int hostZScore(int db, const char *key, const char *member, double *score) {
+    value_t *v = dbLookup(db, key, strlen(key));
+    long at = (v && REDISMODULE_KEYTYPE_ZSET == v->type) ? zsetFind(v, member, strlen(member)) : -1;
+    if (at < 0) {
+        return 0;
+    }
+    *score = v->z[at].score;
+    return 1;
+}
+
+const char *hostType(int db, const char *key) {
+    return typeName(dbLookup(db, key, strlen(key)));
+}
@@ -0,0 +1,75 @@
+#ifndef HOST_H
+#define HOST_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#define REDISMODULE_EXPERIMENTAL_API
+#include "redismodule.h"
+
+// A fake, in-process Redis for the module to be loaded into: it implements the parts of
+// the modules API that the module uses, a handful of native commands (ZADD, ZREM, ZCARD,
+// ZSCORE, ZRANGE, ZREVRANGE, TYPE, SCAN, SET, DEL and HGET), keyspace events, blocked
+// clients and timers, with a clock that only moves when told to.
+
+// A reply, of the module to a client or of the host to the module's RM_Call
+#define HOST_REPLY_DOUBLE 5
+typedef struct hostReply {
+    int type;                       // One of REDISMODULE_REPLY_*, or HOST_REPLY_DOUBLE
+    char *str;                      // A string's, error's or double's (formatted) value
+    size_t len;                     // Its length
+    long long ll;                   // An integer's value
+    double d;                       // A double's value
+    struct hostReply **elements;    // An array's elements
+    size_t nelements;               // Their number
+    long expected;                  // The elements an array still waits for while it's built
+} hostReply_t;
+
+// Loads the module with its (NULL terminated) arguments
+// Returns: the module's OnLoad status
+int hostLoad(const char *arg, ...);
+
+// Runs a command as a client, by its (NULL terminated) arguments
+// Returns: the reply, which the caller frees, or NULL if the client blocked
+hostReply_t *hostRun(unsigned long long client, const char *cmd, ...);
+
+// Takes the reply of a client that was unblocked, once it is
+// Returns: the reply, which the caller frees, or NULL if it has none (yet)
+hostReply_t *hostTakeReply(unsigned long long client);
+
+// Tells if a client is blocked
+int hostBlocked(unsigned long long client);
+
+// Disconnects a client, which may be blocked
+void hostDisconnect(unsigned long long client);
+
+// Advances the clock, firing the timers and serving the blocked clients on the way, like
+// event loop iterations do. hostAdvance(0) is a single iteration at the current time.
+void hostAdvance(long long ms);
+
+// Fires a keyspace event, as a native command that wrote to a key would
+// Returns: 1 if the module is subscribed to the event, 0 otherwise
+int hostNotify(int type, const char *event, int db, const char *key);
+
+long long hostNow(void);
+void hostSetContextFlags(int flags);
+void hostReplyFree(hostReply_t *r);
+
+// Checks a reply: for nil, for an error starting with 'prefix', for an integer, and for
+// an array of (NULL terminated) strings
+int hostReplyIsNull(const hostReply_t *r);
+int hostReplyIsError(const hostReply_t *r, const char *prefix);
+int hostReplyIsInteger(const hostReply_t *r, long long ll);
+int hostReplyIsStrings(const hostReply_t *r, ...);
+
+// Gets a zset member's score, or a key's type ("none", "zset", ...), directly from the db
+int hostZScore(int db, const char *key, const char *member, double *score);
+const char *hostType(int db, const char *key);
+
+// Counters: the module's allocations (RM_Alloc, RM_Calloc and RM_Realloc calls), and the
+// commands it replicated, the last of which is kept as a space separated string
+extern long long hostModuleAllocs;
+extern long long hostReplicated;
+extern char hostLastReplicated[1024];
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef TEST_H
+#define TEST_H
+
+#include <stdio.h>
+#include "host.h"
+
+// A minimal unit test harness: a test program runs its checks, and a failed check prints
+// where it failed and makes the program's exit code non-zero
+
+static int testChecks = 0;
+static int testFailures = 0;
+
+#define CHECK(cond) do {                                                            \
+    testChecks++;                                                                   \
+    if (!(cond)) {                                                                  \
+        testFailures++;                                                             \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);    \
+    }                                                                               \
+} while (0)
+
+// Checks a reply with one of host.h's checkers, and frees it
+#define CHECK_REPLY(reply, checker, ...) do {                                       \
+    hostReply_t *_r = (reply);                                                      \
+    CHECK(checker(_r, ##__VA_ARGS__));                                              \
+    hostReplyFree(_r);                                                              \
+} while (0)
+
+#define TEST(name) static void name(void)
+#define RUN(name) do { name(); } while (0)
+
+// Reports the checks of a test program
+// Returns: its exit code
+static int testReport(const char *name) {
+    printf("%s: %d checks, %d failed\n", name, testChecks, testFailures);
+    return testFailures ? 1 : 0;
+}
+
+#endif
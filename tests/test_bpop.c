@@ -0,0 +1,165 @@
+#include "test.h"
+
+// Checks a blocked client's reply: the key, then the popped scores and elements
+static int servedWith(unsigned long long client, const char *key, const char *ele) {
+    if (hostBlocked(client)) {
+        return 0;
+    }
+    hostReply_t *r = hostTakeReply(client);
+    int ok = r && REDISMODULE_REPLY_ARRAY == r->type && 3 == r->nelements &&
+             !strcmp(key, r->elements[0]->str) && !strcmp(ele, r->elements[2]->str);
+    hostReplyFree(r);
+    return ok;
+}
+
+// Plain blocked clients are served in the order they blocked, one element each
+TEST(testFifo) {
+    for (unsigned long long c = 10; c < 15; c++) {
+        CHECK(NULL == hostRun(c, "Z.BPOP", "q", "0", NULL));
+    }
+    CHECK_REPLY(hostRun(1, "ZADD", "q", "1", "a", "2", "b", "3", "c", NULL), hostReplyIsInteger, 3);
+    hostAdvance(0);
+    CHECK(servedWith(10, "q", "a"));
+    CHECK(servedWith(11, "q", "b"));
+    CHECK(servedWith(12, "q", "c"));
+    CHECK(hostBlocked(13) && hostBlocked(14));
+    CHECK(!strcmp("none", hostType(0, "q")));
+
+    CHECK_REPLY(hostRun(1, "ZADD", "q", "4", "d", NULL), hostReplyIsInteger, 1);
+    hostAdvance(0);
+    CHECK(servedWith(13, "q", "d"));
+    CHECK(hostBlocked(14));
+    hostDisconnect(14);
+}
+
+// A client that lingers for a fuller batch is passed over while the key has fewer
+// elements than it wants, including after the clients behind it are served
+TEST(testLinger) {
+    CHECK(NULL == hostRun(20, "Z.BPOP", "q", "0", "COUNT", "5", "MINBATCH", "3", "LINGER", "1000", NULL));
+    CHECK(NULL == hostRun(21, "Z.BPOP", "q", "0", NULL));
+    CHECK(NULL == hostRun(22, "Z.BPOP", "q", "0", NULL));
+    CHECK_REPLY(hostRun(1, "ZADD", "q", "1", "a", "2", "b", "3", "c", NULL), hostReplyIsInteger, 3);
+    hostAdvance(0);
+
+    // With 3 elements, the lingering client is served first
+    CHECK(!hostBlocked(20));
+    hostReply_t *r = hostTakeReply(20);
+    CHECK(r && 7 == r->nelements);
+    hostReplyFree(r);
+    CHECK(hostBlocked(21) && hostBlocked(22));
+
+    // With 2, it isn't, and the ones after it are
+    CHECK(NULL == hostRun(20, "Z.BPOP", "q", "0", "COUNT", "5", "MINBATCH", "3", "LINGER", "1000", NULL));
+    CHECK_REPLY(hostRun(1, "ZADD", "q", "1", "a", "2", "b", NULL), hostReplyIsInteger, 2);
+    hostAdvance(0);
+    CHECK(servedWith(21, "q", "a"));
+    CHECK(servedWith(22, "q", "b"));
+    CHECK(hostBlocked(20));
+
+    // Once it stops lingering, it takes whatever there is
+    CHECK_REPLY(hostRun(1, "ZADD", "q", "3", "c", NULL), hostReplyIsInteger, 1);
+    hostAdvance(0);
+    CHECK(hostBlocked(20));
+    hostAdvance(1000);
+    CHECK(servedWith(20, "q", "c"));
+}
+
+// Commands that pop from a key that was written to since the last tick let the clients
+// that were already blocked on it, or on a prefix of it, be served first
+TEST(testReadyWaitersFirst) {
+    CHECK(NULL == hostRun(30, "Z.BPOP", "q", "0", NULL));
+    CHECK_REPLY(hostRun(1, "ZADD", "q", "1", "a", NULL), hostReplyIsInteger, 1);
+    CHECK_REPLY(hostRun(1, "Z.POP", "q", NULL), hostReplyIsNull);
+    hostAdvance(0);
+    CHECK(servedWith(30, "q", "a"));
+
+    CHECK(NULL == hostRun(31, "Z.BPOPPREFIX", "p:", "0", NULL));
+    CHECK_REPLY(hostRun(1, "ZADD", "p:1", "1", "a", "2", "b", NULL), hostReplyIsInteger, 2);
+    CHECK_REPLY(hostRun(1, "Z.MPOP", "MIN", "COUNT", "1", "p:1", NULL), hostReplyIsStrings,
+                "p:1", "2", "b", NULL);
+    hostAdvance(0);
+    CHECK(servedWith(31, "p:1", "a"));
+
+    CHECK(NULL == hostRun(32, "Z.BPOP", "q", "0", NULL));
+    CHECK_REPLY(hostRun(1, "ZADD", "q", "5", "x", NULL), hostReplyIsInteger, 1);
+    CHECK(NULL == hostRun(33, "Z.BPOPBYSCORE", "q", "0", "10", "0", NULL));
+    hostAdvance(0);
+    CHECK(servedWith(32, "q", "x"));
+    CHECK(hostBlocked(33));
+    hostDisconnect(33);
+}
+
+// Banded clients are served elements in their bands, and are left blocked only when their
+// bands have none, however the bands nest and overlap and clients come and go. Every round
+// of elements is in a higher window of scores, so the bands below it are passed over.
+TEST(testBands) {
+    enum { NCLIENTS = 300, NELES = 600 };
+    double lo[NCLIENTS], hi[NCLIENTS];
+    int loex[NCLIENTS], hiex[NCLIENTS], gone[NCLIENTS] = {0};
+    char min[32], max[32], score[32], member[32];
+    srand(25);
+    for (int c = 0; c < NCLIENTS; c++) {
+        lo[c] = rand() % 1000;
+        hi[c] = lo[c] + rand() % 60;
+        loex[c] = !(rand() % 4);
+        hiex[c] = !(rand() % 4);
+        snprintf(min, sizeof(min), "%s%g", loex[c] ? "(" : "", lo[c]);
+        snprintf(max, sizeof(max), "%s%g", hiex[c] ? "(" : "", hi[c]);
+        CHECK(NULL == hostRun(100 + c, "Z.BPOPBYSCORE", "q", min, max, "0", NULL));
+        if (!(rand() % 3)) {
+            hostDisconnect(100 + c);
+            gone[c] = 1;
+        }
+    }
+
+    for (int e = 0; e < NELES; e++) {
+        if (!(e % 100)) {
+            hostReplyFree(hostRun(1, "DEL", "q", NULL));
+        }
+        snprintf(score, sizeof(score), "%d", (e / 100) * 180 + rand() % 150);
+        snprintf(member, sizeof(member), "e%d", e);
+        hostReplyFree(hostRun(1, "ZADD", "q", score, member, NULL));
+        if (e % 100 != 99) {
+            continue;
+        }
+        hostAdvance(0);
+
+        for (int c = 0; c < NCLIENTS; c++) {
+            if (gone[c]) {
+                continue;
+            }
+            if (!hostBlocked(100 + c)) {
+                hostReply_t *r = hostTakeReply(100 + c);
+                double d = (r && 3 == r->nelements) ? atof(r->elements[1]->str) : -1;
+                CHECK((loex[c] ? d > lo[c] : d >= lo[c]) && (hiex[c] ? d < hi[c] : d <= hi[c]));
+                hostReplyFree(r);
+                gone[c] = 1;
+                continue;
+            }
+            int inband = 0;
+            for (int i = 0; i <= e; i++) {
+                double d;
+                snprintf(member, sizeof(member), "e%d", i);
+                if (hostZScore(0, "q", member, &d)) {
+                    inband |= (loex[c] ? d > lo[c] : d >= lo[c]) && (hiex[c] ? d < hi[c] : d <= hi[c]);
+                }
+            }
+            CHECK(!inband);
+        }
+    }
+    for (int c = 0; c < NCLIENTS; c++) {
+        if (!gone[c]) {
+            hostDisconnect(100 + c);
+        }
+    }
+    hostReplyFree(hostRun(1, "DEL", "q", NULL));
+}
+
+int main(void) {
+    CHECK(REDISMODULE_OK == hostLoad(NULL));
+    RUN(testFifo);
+    RUN(testLinger);
+    RUN(testReadyWaitersFirst);
+    RUN(testBands);
+    return testReport("bpop");
+}
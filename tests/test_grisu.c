@@ -0,0 +1,120 @@
+#include <float.h>
+#include "test.h"
+#include "grisu.h"
+
+#define RANDOM_DOUBLES 200000
+
+static double randomDouble(void) {
+    uint64_t u;
+    double d;
+    do {
+        u = ((uint64_t)lrand48() << 42) ^ ((uint64_t)lrand48() << 21) ^ (uint64_t)lrand48();
+        memcpy(&d, &u, sizeof(d));
+    } while (isnan(d) || isinf(d));
+    return d;
+}
+
+// Counts the significant digits of a formatted double
+static int significantDigits(const char *s) {
+    int digits = 0, zeros = 0, leading = 1;
+    for (; *s && 'e' != *s; s++) {
+        if (*s < '0' || *s > '9') {
+            continue;
+        }
+        if ('0' == *s) {
+            if (!leading) {
+                zeros++;
+            }
+            continue;
+        }
+        leading = 0;
+        digits += zeros + 1;
+        zeros = 0;
+    }
+    return digits ? digits : 1;
+}
+
+// Gets the fewest significant digits that read back as the very same double
+static int shortestDigits(double d) {
+    char buf[64];
+    for (int p = 1; p < 17; p++) {
+        snprintf(buf, sizeof(buf), "%.*g", p, d);
+        if (strtod(buf, NULL) == d) {
+            return p;
+        }
+    }
+    return 17;
+}
+
+// Formats a double, checking it reads back as the same bits
+// Returns: its significant digits, or -1 if it didn't round-trip
+static int formatChecked(double d, char *buf) {
+    size_t len = grisuFormat(d, buf);
+    buf[len] = '\0';
+    CHECK(len < GRISU_BUF_LEN);
+    double back = strtod(buf, NULL);
+    if (memcmp(&back, &d, sizeof(d))) {
+        fprintf(stderr, "%.17g formatted as %s\n", d, buf);
+        return -1;
+    }
+    return significantDigits(buf);
+}
+
+TEST(testSpecialValues) {
+    char buf[GRISU_BUF_LEN + 1];
+    const struct {
+        double d;
+        const char *s;
+    } cases[] = {
+        { 0.0, "0" }, { -0.0, "-0" }, { 1.0, "1" }, { -42.0, "-42" },
+        { 0.1, "0.1" }, { 1.5, "1.5" }, { 123.456, "123.456" }, { 1e21, "1e21" }, { 1e-7, "1e-7" }, { 1e-6, "0.000001" },
+        { 5e-324, "5e-324" },
+        { 9007199254740991.0, "9007199254740991" }, { 1.0 / 0.0, "inf" }, { -1.0 / 0.0, "-inf" },
+    };
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        size_t len = grisuFormat(cases[i].d, buf);
+        buf[len] = '\0';
+        if (strcmp(cases[i].s, buf)) {
+            fprintf(stderr, "%.17g: expected %s, got %s\n", cases[i].d, cases[i].s, buf);
+        }
+        CHECK(!strcmp(cases[i].s, buf));
+    }
+    const double extremes[] = { DBL_MAX, -DBL_MAX, DBL_MIN, DBL_EPSILON, 1.0 / 3, 2.0 / 3, 1e23 };
+    for (size_t i = 0; i < sizeof(extremes) / sizeof(extremes[0]); i++) {
+        CHECK(formatChecked(extremes[i], buf) > 0);
+    }
+}
+
+// Every output reads back as the same double. Grisu2 isn't always the shortest: it misses
+// the shorter outputs that are within a sliver of the rounding interval's ends, so that
+// rarely (under 0.2% of the doubles) its output is a few digits longer.
+TEST(testRoundTripAndShortest) {
+    char buf[GRISU_BUF_LEN + 1];
+    long failed = 0, longer = 0;
+    for (int i = 0; i < RANDOM_DOUBLES; i++) {
+        double d = randomDouble();
+        if (i % 2) {
+            // Also doubles of the usual magnitudes, like scores and timestamps
+            d = (double)(lrand48() % 100000000) / (double)(1 + lrand48() % 10000);
+        }
+        int digits = formatChecked(d, buf);
+        if (digits < 0) {
+            failed++;
+            continue;
+        }
+        int shortest = shortestDigits(d);
+        if (digits > shortest) {
+            longer++;
+        }
+    }
+    printf("grisu: %d doubles, %ld not shortest\n", RANDOM_DOUBLES, longer);
+    CHECK(0 == failed);
+    CHECK(longer * 500 < RANDOM_DOUBLES);
+}
+
+int main(void) {
+    srand48(42);
+    RUN(testSpecialValues);
+    RUN(testRoundTripAndShortest);
+    return testReport("grisu");
+}
@@ -0,0 +1,77 @@
+#include "test.h"
+#include "heap.h"
+
+typedef struct {
+    int value;
+    size_t idx;
+} item_t;
+
+static int itemCmp(const void *a, const void *b) {
+    const item_t *ia = a, *ib = b;
+    return (ia->value > ib->value) - (ia->value < ib->value);
+}
+
+static void itemSetIdx(void *data, size_t idx) {
+    ((item_t *)data)->idx = idx;
+}
+
+// Pops what was pushed in order, growing from the smallest size
+TEST(testPushPop) {
+    heap_t *h = heapNew(itemCmp, 0);
+    item_t items[1000];
+    CHECK(NULL == heapPeek(h));
+    CHECK(NULL == heapPop(h));
+    for (int i = 0; i < 1000; i++) {
+        items[i].value = rand() % 100;
+        heapPush(h, &items[i]);
+    }
+    CHECK(1000 == h->len);
+    int last = -1;
+    for (int i = 0; i < 1000; i++) {
+        item_t *top = heapPeek(h);
+        item_t *it = heapPop(h);
+        CHECK(top == it);
+        CHECK(it->value >= last);
+        last = it->value;
+    }
+    CHECK(0 == h->len);
+    heapFree(h);
+}
+
+// Removes items by the position the index function tells, anywhere in the heap
+TEST(testRemove) {
+    heap_t *h = heapNew(itemCmp, 4);
+    heapSetIdxFunc(h, itemSetIdx);
+    item_t items[500];
+    for (int i = 0; i < 500; i++) {
+        items[i].value = rand() % 1000;
+        heapPush(h, &items[i]);
+    }
+    for (size_t i = 0; i < h->len; i++) {
+        CHECK(((item_t *)h->items[i])->idx == i);
+    }
+    for (int i = 0; i < 500; i += 3) {
+        CHECK(heapRemove(h, items[i].idx) == &items[i]);
+    }
+    for (size_t i = 0; i < h->len; i++) {
+        CHECK(((item_t *)h->items[i])->idx == i);
+    }
+    int last = -1, popped = 0;
+    item_t *it;
+    while ((it = heapPop(h))) {
+        CHECK((it - items) % 3 != 0);
+        CHECK(it->value >= last);
+        last = it->value;
+        popped++;
+    }
+    CHECK(500 - 167 == popped);
+    heapFree(h);
+}
+
+int main(void) {
+    hostLoad(NULL);
+    srand(42);
+    RUN(testPushPop);
+    RUN(testRemove);
+    return testReport("heap");
+}
@@ -0,0 +1,129 @@
+#include "test.h"
+
+#define LEASES "{q}:zpop:leases"
+#define SCORES "{q}:zpop:scores"
+
+static long long zcard(const char *key) {
+    hostReply_t *r = hostRun(1, "ZCARD", key, NULL);
+    long long card = r->ll;
+    hostReplyFree(r);
+    return card;
+}
+
+// Leased elements move to the companion set, scored by their deadline, until acked, and
+// their original scores are kept aside
+TEST(testLeaseAndAck) {
+    CHECK_REPLY(hostRun(1, "ZADD", "q", "1", "a", "2", "b", "3", "c", NULL), hostReplyIsInteger, 3);
+    CHECK_REPLY(hostRun(1, "Z.POPLEASE", "q", "1000", NULL), hostReplyIsStrings, "1", "a", NULL);
+    double score = 0;
+    CHECK(hostZScore(0, LEASES, "a", &score) && score == (double)(hostNow() + 1000));
+    CHECK(2 == zcard("q"));
+    CHECK(!strcmp("HSET " SCORES " a 1", hostLastReplicated));
+    hostReply_t *r = hostRun(1, "HGET", SCORES, "a", NULL);
+    CHECK(REDISMODULE_REPLY_STRING == r->type && !strcmp("1", r->str));
+    hostReplyFree(r);
+
+    CHECK_REPLY(hostRun(1, "Z.ACK", "q", "a", "nosuch", NULL), hostReplyIsInteger, 1);
+    CHECK(!strcmp("HDEL " SCORES " a nosuch", hostLastReplicated));
+    CHECK(!strcmp("none", hostType(0, LEASES)));
+    CHECK(!strcmp("none", hostType(0, SCORES)));
+    CHECK_REPLY(hostRun(1, "Z.ACK", "q", "a", NULL), hostReplyIsInteger, 0);
+
+    // Acked leases are never returned
+    hostAdvance(2000);
+    CHECK(2 == zcard("q"));
+    CHECK_REPLY(hostRun(1, "DEL", "q", NULL), hostReplyIsInteger, 1);
+}
+
+// Expired leases are returned to their key, with their original scores, by the reaper,
+// unless the host is a replica
+TEST(testReap) {
+    CHECK_REPLY(hostRun(1, "ZADD", "q", "1.5", "a", "2", "b", NULL), hostReplyIsInteger, 2);
+    CHECK_REPLY(hostRun(1, "Z.POPLEASE", "q", "50", NULL), hostReplyIsStrings, "1.5", "a", NULL);
+
+    hostSetContextFlags(REDISMODULE_CTX_FLAGS_SLAVE);
+    hostAdvance(1000);
+    CHECK(1 == zcard("q"));
+    CHECK(1 == zcard(LEASES));
+
+    hostSetContextFlags(REDISMODULE_CTX_FLAGS_MASTER);
+    hostAdvance(200);
+    CHECK(2 == zcard("q"));
+    CHECK(!strcmp("none", hostType(0, LEASES)));
+    CHECK(!strcmp("none", hostType(0, SCORES)));
+    CHECK(!strcmp("ZADD q 1.5 a", hostLastReplicated));
+    double score = 0;
+    CHECK(hostZScore(0, "q", "a", &score) && score == 1.5);
+    CHECK_REPLY(hostRun(1, "Z.ACK", "q", "a", NULL), hostReplyIsInteger, 0);
+
+    // A blocked client is served what the reaper returns
+    hostReplyFree(hostRun(1, "Z.POPLEASE", "q", "50", NULL));
+    hostReplyFree(hostRun(1, "Z.POPLEASE", "q", "50", NULL));
+    CHECK(0 == zcard("q"));
+    CHECK(NULL == hostRun(2, "Z.BPOP", "q", "0", NULL));
+    hostAdvance(200);
+    CHECK(!hostBlocked(2));
+    CHECK_REPLY(hostTakeReply(2), hostReplyIsStrings, "q", "1.5", "a", NULL);
+    CHECK(1 == zcard("q"));
+    CHECK_REPLY(hostRun(1, "DEL", "q", NULL), hostReplyIsInteger, 1);
+}
+
+// The reaper returns a bounded batch per tick, and resumes right away when it runs out
+TEST(testReapBudget) {
+    char score[32], member[32];
+    for (int i = 0; i < 2500; i++) {
+        snprintf(score, sizeof(score), "%d", i);
+        snprintf(member, sizeof(member), "m%d", i);
+        hostReplyFree(hostRun(1, "ZADD", "q", score, member, NULL));
+        hostReplyFree(hostRun(1, "Z.POPLEASE", "q", "1", NULL));
+    }
+    CHECK(2500 == zcard(LEASES));
+    while (2500 == zcard(LEASES)) {
+        hostAdvance(1);
+    }
+    CHECK(1500 == zcard(LEASES));
+    hostAdvance(1);
+    CHECK(500 == zcard(LEASES));
+    hostAdvance(1);
+    CHECK(2500 == zcard("q"));
+    CHECK_REPLY(hostRun(1, "DEL", "q", NULL), hostReplyIsInteger, 1);
+}
+
+// Sets of leases that are added to under the reserved names, e.g. by replication, are
+// reaped just the same
+TEST(testReservedName) {
+    char deadline[32];
+    snprintf(deadline, sizeof(deadline), "%lld", hostNow() + 10);
+    CHECK_REPLY(hostRun(1, "ZADD", "{r}:zpop:leases", deadline, "x", NULL), hostReplyIsInteger, 1);
+    hostAdvance(200);
+    CHECK(1 == zcard("r"));
+    CHECK(!strcmp("none", hostType(0, "{r}:zpop:leases")));
+    double score = 0;
+    CHECK(hostZScore(0, "r", "x", &score) && score == (double)(hostNow() - 190));
+    CHECK_REPLY(hostRun(1, "DEL", "r", NULL), hostReplyIsInteger, 1);
+}
+
+TEST(testErrors) {
+    CHECK_REPLY(hostRun(1, "Z.POPLEASE", "q", "0", NULL), hostReplyIsError, "ERR lease");
+    CHECK_REPLY(hostRun(1, "Z.POPLEASE", "q", "x", NULL), hostReplyIsError, "ERR lease");
+    CHECK_REPLY(hostRun(1, "Z.POPLEASE", "a}b", "100", NULL), hostReplyIsError, "ERR key must be");
+    CHECK_REPLY(hostRun(1, "Z.POPLEASE", "", "100", NULL), hostReplyIsError, "ERR key must be");
+    CHECK_REPLY(hostRun(1, "Z.ACK", "a}b", "x", NULL), hostReplyIsError, "ERR key must be");
+    CHECK_REPLY(hostRun(1, "Z.ACK", "q", NULL), hostReplyIsError, "ERR wrong number");
+    CHECK_REPLY(hostRun(1, "Z.POPLEASE", "q", "100", NULL), hostReplyIsNull);
+
+    hostReplyFree(hostRun(1, "SET", "s", "v", NULL));
+    CHECK_REPLY(hostRun(1, "Z.POPLEASE", "s", "100", NULL), hostReplyIsError, "WRONGTYPE");
+    hostReplyFree(hostRun(1, "SET", "{s}:zpop:leases", "v", NULL));
+    CHECK_REPLY(hostRun(1, "Z.ACK", "s", "x", NULL), hostReplyIsError, "WRONGTYPE");
+}
+
+int main(void) {
+    CHECK(REDISMODULE_OK == hostLoad(NULL));
+    RUN(testLeaseAndAck);
+    RUN(testReap);
+    RUN(testReapBudget);
+    RUN(testReservedName);
+    RUN(testErrors);
+    return testReport("leases");
+}
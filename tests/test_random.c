@@ -0,0 +1,134 @@
+#include "test.h"
+
+static long long zcard(const char *key) {
+    hostReply_t *r = hostRun(1, "ZCARD", key, NULL);
+    long long card = r->ll;
+    hostReplyFree(r);
+    return card;
+}
+
+// Pops random elements and checks that they're distinct members that had their scores,
+// which are their indices in 'm<index>' names
+// Returns: the number of popped elements, or -1 if the reply is wrong
+static long long popRandom(const char *count, int weighted, char *seen, size_t nseen) {
+    hostReply_t *r = weighted ? hostRun(1, "Z.POPRANDOM", "q", "COUNT", count, "WEIGHTED", NULL) :
+                                hostRun(1, "Z.POPRANDOM", "q", "COUNT", count, NULL);
+    long long popped = -1;
+    if (r && REDISMODULE_REPLY_ARRAY == r->type && !(r->nelements % 2)) {
+        popped = (long long)r->nelements / 2;
+        for (size_t i = 0; i < r->nelements; i += 2) {
+            size_t at = (size_t)atol(r->elements[i + 1]->str + 1);
+            if (at >= nseen || seen[at] || atof(r->elements[i]->str) != (double)at) {
+                popped = -1;
+                break;
+            }
+            seen[at] = 1;
+        }
+    }
+    hostReplyFree(r);
+    return popped;
+}
+
+static void addMembers(int from, int to) {
+    char score[32], member[32];
+    for (int i = from; i < to; i++) {
+        snprintf(score, sizeof(score), "%d", i);
+        snprintf(member, sizeof(member), "m%d", i);
+        hostReplyFree(hostRun(1, "ZADD", "q", score, member, NULL));
+    }
+}
+
+// Uniform picks are distinct, keep their scores, and are replicated as a single ZREM
+TEST(testUniform) {
+    char seen[1000] = {0};
+    addMembers(0, 1000);
+    CHECK(400 == popRandom("400", 0, seen, sizeof(seen)));
+    CHECK(600 == zcard("q"));
+    CHECK(!strncmp("ZREM q m", hostLastReplicated, 8));
+    CHECK(600 == popRandom("1000", 0, seen, sizeof(seen)));
+    CHECK(!strcmp("none", hostType(0, "q")));
+}
+
+// Every rank is as likely to be picked
+TEST(testUniformFairness) {
+    int hits[4] = {0};
+    addMembers(0, 4);
+    for (int i = 0; i < 4000; i++) {
+        char seen[4] = {0};
+        CHECK(1 == popRandom("1", 0, seen, sizeof(seen)));
+        for (int j = 0; j < 4; j++) {
+            hits[j] += seen[j];
+            if (seen[j]) {
+                addMembers(j, j + 1);
+            }
+        }
+    }
+    for (int j = 0; j < 4; j++) {
+        CHECK(hits[j] > 850 && hits[j] < 1150);
+    }
+    CHECK_REPLY(hostRun(1, "DEL", "q", NULL), hostReplyIsInteger, 1);
+}
+
+// Weighted picks are proportional to the scores, and never have a score that isn't positive
+TEST(testWeighted) {
+    int hits[4] = {0};
+    addMembers(0, 4);
+    for (int i = 0; i < 6000; i++) {
+        char seen[4] = {0};
+        CHECK(1 == popRandom("1", 1, seen, sizeof(seen)));
+        for (int j = 0; j < 4; j++) {
+            hits[j] += seen[j];
+            if (seen[j]) {
+                addMembers(j, j + 1);
+            }
+        }
+    }
+    CHECK(0 == hits[0]);
+    CHECK(hits[1] > 850 && hits[1] < 1150);
+    CHECK(hits[2] > 1800 && hits[2] < 2200);
+    CHECK(hits[3] > 2750 && hits[3] < 3250);
+
+    char seen[4] = {0};
+    CHECK(3 == popRandom("4", 1, seen, sizeof(seen)));
+    CHECK(!seen[0] && 1 == zcard("q"));
+    CHECK_REPLY(hostRun(1, "DEL", "q", NULL), hostReplyIsInteger, 1);
+}
+
+// Scores too skewed for rejection sampling fall back to a walk, which picks what's left
+TEST(testWeightedSkewed) {
+    char member[32];
+    for (int i = 0; i < 200; i++) {
+        snprintf(member, sizeof(member), "m%d", i);
+        hostReplyFree(hostRun(1, "ZADD", "q", "1", member, NULL));
+    }
+    CHECK_REPLY(hostRun(1, "ZADD", "q", "1e12", "big", NULL), hostReplyIsInteger, 1);
+    hostReply_t *r = hostRun(1, "Z.POPRANDOM", "q", "COUNT", "5", "WEIGHTED", NULL);
+    CHECK(r && REDISMODULE_REPLY_ARRAY == r->type && 10 == r->nelements);
+    int big = 0, distinct = 1;
+    for (size_t i = 1; r && i < r->nelements; i += 2) {
+        big += !strcmp("big", r->elements[i]->str);
+        for (size_t j = 1; j < i; j += 2) {
+            distinct &= !!strcmp(r->elements[j]->str, r->elements[i]->str);
+        }
+    }
+    hostReplyFree(r);
+    CHECK(1 == big && distinct);
+    CHECK(196 == zcard("q"));
+    CHECK_REPLY(hostRun(1, "DEL", "q", NULL), hostReplyIsInteger, 1);
+
+    CHECK_REPLY(hostRun(1, "ZADD", "q", "+inf", "a", "1", "b", NULL), hostReplyIsInteger, 2);
+    r = hostRun(1, "Z.POPRANDOM", "q", "WEIGHTED", NULL);
+    CHECK(r && REDISMODULE_REPLY_ARRAY == r->type && 2 == r->nelements);
+    hostReplyFree(r);
+    CHECK(1 == zcard("q"));
+    CHECK_REPLY(hostRun(1, "DEL", "q", NULL), hostReplyIsInteger, 1);
+}
+
+int main(void) {
+    CHECK(REDISMODULE_OK == hostLoad(NULL));
+    RUN(testUniform);
+    RUN(testUniformFairness);
+    RUN(testWeighted);
+    RUN(testWeightedSkewed);
+    return testReport("random");
+}
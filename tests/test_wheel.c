@@ -0,0 +1,95 @@
+#include "test.h"
+#include "wheel.h"
+
+#define TIMERS 2000
+#define START 1700000000000LL
+
+// Expires every timer exactly at its tick, from each of the wheel's levels, in order
+TEST(testExpire) {
+    wheel_t w;
+    wheelInit(&w, START);
+    static wtimer_t timers[TIMERS];
+    static int expired[TIMERS];
+    for (int i = 0; i < TIMERS; i++) {
+        // Spread the timers over the first four levels, i.e. up to 2^26 ticks ahead
+        long long span = 1LL << (8 + 6 * (i % 4));
+        timers[i].expires = START + (long long)(drand48() * span);
+        timers[i].slot = NULL;
+        wheelAdd(&w, &timers[i]);
+        expired[i] = 0;
+    }
+    CHECK(TIMERS == w.len);
+
+    // Timers that are removed never expire
+    for (int i = 0; i < TIMERS; i += 7) {
+        wheelRemove(&w, &timers[i]);
+        CHECK(NULL == timers[i].slot);
+        wheelRemove(&w, &timers[i]);
+    }
+
+    long long last = START, end = START + (1LL << 26);
+    int count = 0;
+    wtimer_t *t;
+    while ((t = wheelExpire(&w, end))) {
+        int i = (int)(t - timers);
+        CHECK(t->expires == w.now);
+        CHECK(t->expires >= last);
+        CHECK(!expired[i] && i % 7);
+        CHECK(NULL == t->slot);
+        expired[i] = 1;
+        last = t->expires;
+        count++;
+    }
+    CHECK(TIMERS - (TIMERS + 6) / 7 == count);
+    CHECK(0 == w.len);
+    CHECK(end == w.now);
+}
+
+// Timers that are due when added expire right away, and an empty wheel skips ahead
+TEST(testOverdue) {
+    wheel_t w;
+    wheelInit(&w, START);
+    CHECK(NULL == wheelExpire(&w, START + 1000000));
+    CHECK(START + 1000000 == w.now);
+    CHECK(-1 == wheelNextTick(&w));
+
+    wtimer_t t = { .expires = START };
+    wheelAdd(&w, &t);
+    CHECK(&t == wheelExpire(&w, w.now));
+    CHECK(START + 1000000 == w.now);
+}
+
+// Nothing expires before the next tick, be it a timer's or a rotation's end
+TEST(testNextTick) {
+    wheel_t w;
+    wheelInit(&w, START);
+    wtimer_t near = { .expires = START + 10 }, far = { .expires = START + 100000 };
+    wheelAdd(&w, &near);
+    wheelAdd(&w, &far);
+    CHECK(START + 10 == wheelNextTick(&w));
+    CHECK(NULL == wheelExpire(&w, START + 9));
+    CHECK(&near == wheelExpire(&w, wheelNextTick(&w)));
+
+    // Past the first level's rotation, the next ticks are the rotations' ends until the
+    // far timer is cascaded down to the first level
+    long long next;
+    wtimer_t *t = NULL;
+    while (!t && -1 != (next = wheelNextTick(&w))) {
+        CHECK(next > w.now);
+        CHECK(next == far.expires || !(next % WHEEL_L0_SLOTS));
+        t = wheelExpire(&w, next);
+        CHECK(next == w.now);
+    }
+    CHECK(&far == t);
+    CHECK(far.expires == w.now);
+    CHECK(-1 == wheelNextTick(&w));
+}
+
+int main(void) {
+    hostLoad(NULL);
+    srand48(42);
+    RUN(testExpire);
+    RUN(testOverdue);
+    RUN(testNextTick);
+    return testReport("wheel");
+}